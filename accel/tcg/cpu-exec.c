@@ -393,6 +393,25 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     return;
 }
 
+/*
+ * @tb has been executed tcg_tier_threshold times: translate it again as a
+ * trace, which continues through forward jumps and branches, and replace
+ * it with that.
+ */
+static TranslationBlock *tb_tier_up(CPUState *cpu, TranslationBlock *tb)
+{
+    TranslationBlock *trace;
+
+    mmap_lock();
+    tb_phys_invalidate(tb, -1);
+    trace = tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags,
+                        (tb->cflags & CF_HASH_MASK) | CF_TRACE);
+    mmap_unlock();
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(trace->pc)], trace);
+    atomic_inc(&tb_ctx.tb_tier_up_count);
+    return trace;
+}
+
 static inline TranslationBlock *tb_find(CPUState *cpu,
                                         TranslationBlock *last_tb,
                                         int tb_exit, uint32_t cf_mask)
@@ -409,6 +428,14 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
         /* We add the TB in the virtual pc hash table for the fast lookup */
         atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     }
+    if (tcg_tier_threshold && !(tb_cflags(tb) & CF_TRACE)) {
+        if (atomic_fetch_inc(&tb->exec_count) + 1 == tcg_tier_threshold) {
+            tb = tb_tier_up(cpu, tb);
+        } else {
+            /* Nothing jumps to it directly, so that it keeps being counted */
+            last_tb = NULL;
+        }
+    }
 #ifndef CONFIG_USER_ONLY
     /* We don't take care of direct jumps when address mapping changes in
      * system emulation. So it's not safe to make a direct jump to a TB
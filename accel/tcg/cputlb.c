@@ -282,6 +282,21 @@ void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
     *pelide = elide;
 }
 
+void tlb_dirty_counts(size_t *pnotdirty, size_t *preset)
+{
+    CPUState *cpu;
+    size_t notdirty = 0, reset = 0;
+
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        notdirty += atomic_read(&env->tlb_c.notdirty_write_count);
+        reset += atomic_read(&env->tlb_c.reset_dirty_count);
+    }
+    *pnotdirty = notdirty;
+    *preset = reset;
+}
+
 static void tlb_flush_one_mmuidx_locked(CPUArchState *env, int mmu_idx)
 {
     tlb_table_flush_by_mmuidx(env, mmu_idx);
@@ -610,6 +625,8 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 
     env = cpu->env_ptr;
     qemu_spin_lock(&env->tlb_c.lock);
+    atomic_set(&env->tlb_c.reset_dirty_count,
+               env->tlb_c.reset_dirty_count + 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
         unsigned int n = tlb_n_entries(env, mmu_idx);
@@ -0,0 +1,506 @@
+/*
+ * Persistent translated code cache
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Guests that load the same code at the same physical addresses on every
+ * boot (firmware, console kernels and games) spend most of their startup
+ * translating it again.  With -accel tcg,tb-cache=FILE, the host code of
+ * every TB is kept together with the relocations recorded by the TCG
+ * backend, and written to FILE when QEMU exits.  On the next run
+ * tb_gen_code() copies a TB from the cache instead of translating it,
+ * provided its key (physical and virtual PC, cs_base, flags and cflags)
+ * matches and the guest code is byte for byte identical.  TBs invalidated
+ * by guest writes are dropped from the cache.
+ *
+ * The host code refers to QEMU's own helpers, so a cache file is only
+ * valid for the executable that wrote it.  What gets translated also
+ * depends on the CPU model and on options such as idle detection or
+ * tier-threshold, so the file header records a digest of that
+ * configuration too and a file written with another one is ignored.
+ * The CPU only exists once the machine is set up, so the file is loaded
+ * when the first TB is looked up.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/tb-hash.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "sysemu/sysemu.h"
+#include "tcg.h"
+#include "tb-cache.h"
+
+#define TB_CACHE_MAGIC      "QEMUTBC\0"
+#define TB_CACHE_VERSION    2
+
+#define TB_CACHE_CONFIG_ID_LEN 32   /* SHA-256 */
+
+/* Stop adding entries once they take this much memory */
+#define TB_CACHE_MAX_BYTES  (256 * MiB)
+
+/* A TB never spans more than two guest pages */
+#define TB_CACHE_MAX_GUEST_SIZE (2 * TARGET_PAGE_SIZE)
+
+typedef struct TBCacheKey {
+    uint64_t phys_pc;
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t trace_vcpu_dstate;
+    uint32_t pad;
+} TBCacheKey;
+
+typedef struct TBCacheEntry {
+    TBCacheKey key;
+    uint32_t cflags;            /* tb->cflags, for the bits not in the key */
+    uint32_t size;              /* guest code bytes */
+    uint32_t icount;
+    uint32_t code_size;         /* host code bytes, tb->tc.size */
+    uint32_t data_size;         /* host code and search data bytes */
+    uint32_t nb_relocs;
+    uint16_t jmp_reset_offset[2];
+    uint32_t jmp_target_arg[2];
+    /* Followed by the relocations, the guest code and the host data */
+    TCGTBReloc relocs[];
+} TBCacheEntry;
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_entries;
+    uint64_t exe_id[4];
+    uint8_t config_id[TB_CACHE_CONFIG_ID_LEN];
+} TBCacheHeader;
+
+static struct {
+    bool enabled;
+    bool loaded_file;
+    char *path;
+    uint64_t exe_id[4];
+    uint8_t config_id[TB_CACHE_CONFIG_ID_LEN];
+    QemuMutex lock;
+    GHashTable *htable;
+    size_t bytes;
+    size_t loaded;
+    size_t hits;
+    size_t misses;
+    size_t invalidated;
+    Notifier exit_notifier;
+} tb_cache;
+
+static inline uint8_t *tb_cache_entry_guest(TBCacheEntry *e)
+{
+    return (uint8_t *)&e->relocs[e->nb_relocs];
+}
+
+static inline uint8_t *tb_cache_entry_host(TBCacheEntry *e)
+{
+    return tb_cache_entry_guest(e) + e->size;
+}
+
+static inline size_t tb_cache_entry_len(const TBCacheEntry *e)
+{
+    return sizeof(*e) + e->nb_relocs * sizeof(TCGTBReloc) +
+           e->size + e->data_size;
+}
+
+static guint tb_cache_key_hash(gconstpointer p)
+{
+    const TBCacheKey *k = p;
+
+    return tb_hash_func(k->phys_pc, k->pc, k->flags, k->cflags,
+                        k->trace_vcpu_dstate);
+}
+
+static gboolean tb_cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(TBCacheKey));
+}
+
+static void tb_cache_make_key(TBCacheKey *k, TranslationBlock *tb,
+                              tb_page_addr_t phys_pc)
+{
+    memset(k, 0, sizeof(*k));
+    k->phys_pc = phys_pc;
+    k->pc = tb->pc;
+    k->cs_base = tb->cs_base;
+    k->flags = tb->flags;
+    k->cflags = tb->cflags & CF_HASH_MASK;
+    k->trace_vcpu_dstate = tb->trace_vcpu_dstate;
+}
+
+/* Call with tb_cache.lock held */
+static void tb_cache_add(TBCacheEntry *e)
+{
+    TBCacheEntry *old = g_hash_table_lookup(tb_cache.htable, &e->key);
+    size_t len = tb_cache_entry_len(e);
+
+    if (old) {
+        tb_cache.bytes -= tb_cache_entry_len(old);
+    }
+    if (tb_cache.bytes + len > TB_CACHE_MAX_BYTES) {
+        if (old) {
+            g_hash_table_remove(tb_cache.htable, &e->key);
+        }
+        g_free(e);
+        return;
+    }
+    tb_cache.bytes += len;
+    /* replace rather than insert: the key lives in the entry */
+    g_hash_table_replace(tb_cache.htable, &e->key, e);
+}
+
+/* Identify the executable: the host code calls into it */
+static bool tb_cache_get_exe_id(uint64_t *id)
+{
+#ifdef CONFIG_LINUX
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st) < 0) {
+        return false;
+    }
+    id[0] = st.st_dev;
+    id[1] = st.st_ino;
+    id[2] = st.st_size;
+    id[3] = (uint64_t)st.st_mtim.tv_sec * NANOSECONDS_PER_SECOND +
+            st.st_mtim.tv_nsec;
+    return true;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+/* Identify what translation depends on besides the TB key */
+static void tb_cache_get_config_id(CPUState *cpu, uint8_t *id)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    const char *model = object_get_typename(OBJECT(cpu));
+    GByteArray *config = g_byte_array_new();
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    gsize len = TB_CACHE_CONFIG_ID_LEN;
+
+    g_byte_array_append(config, (guint8 *)model, strlen(model) + 1);
+    g_byte_array_append(config, (guint8 *)&tcg_tier_threshold,
+                        sizeof(tcg_tier_threshold));
+    if (cc->tb_cache_config) {
+        cc->tb_cache_config(cpu, config);
+    }
+
+    g_checksum_update(sum, config->data, config->len);
+    g_checksum_get_digest(sum, id, &len);
+    g_checksum_free(sum);
+    g_byte_array_free(config, true);
+}
+
+/* Call with tb_cache.lock held */
+static void tb_cache_load(CPUState *cpu)
+{
+    TBCacheHeader *h;
+    gchar *buf;
+    gsize len, pos;
+    uint32_t i;
+
+    tb_cache_get_config_id(cpu, tb_cache.config_id);
+    atomic_mb_set(&tb_cache.loaded_file, true);
+
+    if (!g_file_get_contents(tb_cache.path, &buf, &len, NULL)) {
+        /* first run */
+        return;
+    }
+
+    h = (TBCacheHeader *)buf;
+    if (len < sizeof(*h) ||
+        memcmp(h->magic, TB_CACHE_MAGIC, sizeof(h->magic)) ||
+        h->version != TB_CACHE_VERSION ||
+        memcmp(h->exe_id, tb_cache.exe_id, sizeof(h->exe_id))) {
+        info_report("TB cache %s was written by another QEMU, ignoring it",
+                    tb_cache.path);
+        g_free(buf);
+        return;
+    }
+    if (memcmp(h->config_id, tb_cache.config_id, sizeof(h->config_id))) {
+        info_report("TB cache %s was written for another CPU or "
+                    "translation configuration, ignoring it", tb_cache.path);
+        g_free(buf);
+        return;
+    }
+
+    pos = sizeof(*h);
+    for (i = 0; i < h->nb_entries; i++) {
+        TBCacheEntry hdr, *e;
+        size_t elen;
+
+        if (len - pos < sizeof(hdr)) {
+            break;
+        }
+        memcpy(&hdr, buf + pos, sizeof(hdr));
+        if (hdr.nb_relocs > TCG_MAX_TB_RELOCS ||
+            hdr.size > TB_CACHE_MAX_GUEST_SIZE ||
+            hdr.code_size > hdr.data_size ||
+            hdr.data_size > tcg_init_ctx.code_gen_buffer_size) {
+            break;
+        }
+        elen = tb_cache_entry_len(&hdr);
+        if (len - pos < elen) {
+            break;
+        }
+        e = g_malloc(elen);
+        memcpy(e, buf + pos, elen);
+        tb_cache_add(e);
+        pos += elen;
+    }
+    if (i != h->nb_entries) {
+        warn_report("TB cache %s is truncated, using the first %u entries",
+                    tb_cache.path, i);
+    }
+    tb_cache.loaded = g_hash_table_size(tb_cache.htable);
+    g_free(buf);
+}
+
+static void tb_cache_save(Notifier *notifier, void *data)
+{
+    TBCacheHeader h = {};
+    GByteArray *out;
+    GHashTableIter iter;
+    gpointer value;
+    GError *err = NULL;
+
+    qemu_mutex_lock(&tb_cache.lock);
+    if (!tb_cache.loaded_file) {
+        /* Nothing was translated, keep the file as it is */
+        qemu_mutex_unlock(&tb_cache.lock);
+        return;
+    }
+    out = g_byte_array_sized_new(sizeof(h) + tb_cache.bytes);
+    memcpy(h.magic, TB_CACHE_MAGIC, sizeof(h.magic));
+    h.version = TB_CACHE_VERSION;
+    h.nb_entries = g_hash_table_size(tb_cache.htable);
+    memcpy(h.exe_id, tb_cache.exe_id, sizeof(h.exe_id));
+    memcpy(h.config_id, tb_cache.config_id, sizeof(h.config_id));
+    g_byte_array_append(out, (guint8 *)&h, sizeof(h));
+
+    g_hash_table_iter_init(&iter, tb_cache.htable);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        TBCacheEntry *e = value;
+
+        g_byte_array_append(out, (guint8 *)e, tb_cache_entry_len(e));
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+
+    if (!g_file_set_contents(tb_cache.path, (gchar *)out->data, out->len,
+                             &err)) {
+        warn_report("Failed to write TB cache: %s", err->message);
+        g_error_free(err);
+    }
+    g_byte_array_free(out, true);
+}
+
+void tb_cache_init(const char *path, Error **errp)
+{
+    if (!TCG_TARGET_HAS_tb_reloc) {
+        error_setg(errp, "tb-cache is not supported on this host");
+        return;
+    }
+    if (!tb_cache_get_exe_id(tb_cache.exe_id)) {
+        error_setg_errno(errp, errno, "tb-cache: cannot identify executable");
+        return;
+    }
+
+    tb_cache.path = g_strdup(path);
+    qemu_mutex_init(&tb_cache.lock);
+    tb_cache.htable = g_hash_table_new_full(tb_cache_key_hash,
+                                            tb_cache_key_equal,
+                                            NULL, g_free);
+
+    tb_cache.exit_notifier.notify = tb_cache_save;
+    qemu_add_exit_notifier(&tb_cache.exit_notifier);
+    tb_cache.enabled = true;
+}
+
+bool tb_cache_enabled(void)
+{
+    return tb_cache.enabled;
+}
+
+static void tb_cache_ensure_loaded(CPUState *cpu)
+{
+    if (atomic_mb_read(&tb_cache.loaded_file)) {
+        return;
+    }
+    qemu_mutex_lock(&tb_cache.lock);
+    if (!tb_cache.loaded_file) {
+        tb_cache_load(cpu);
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+static bool tb_cache_read_guest(CPUState *cpu, TranslationBlock *tb,
+                                uint8_t *buf, uint32_t size)
+{
+    return size <= TB_CACHE_MAX_GUEST_SIZE &&
+           cpu_memory_rw_debug(cpu, tb->pc, buf, size, 0) == 0;
+}
+
+/*
+ * Fill in @tb, whose pc, cs_base, flags and cflags are set, from the
+ * cache.  Returns the size of the host code, 0 if the TB must be
+ * translated, or -1 if the code buffer is full.
+ */
+int tb_cache_lookup(CPUState *cpu, TranslationBlock *tb,
+                    tb_page_addr_t phys_pc, int *search_size)
+{
+    uint8_t guest[TB_CACHE_MAX_GUEST_SIZE];
+    TBCacheKey key;
+    TBCacheEntry *e;
+    uint32_t size;
+    int ret = 0;
+    int i;
+
+    tb_cache_ensure_loaded(cpu);
+    tb_cache_make_key(&key, tb, phys_pc);
+
+    /*
+     * Reading guest memory may have to take other locks, so the size is
+     * looked up first and the entry checked again after the read.
+     */
+    qemu_mutex_lock(&tb_cache.lock);
+    e = g_hash_table_lookup(tb_cache.htable, &key);
+    size = e ? e->size : 0;
+    qemu_mutex_unlock(&tb_cache.lock);
+    if (!e || !tb_cache_read_guest(cpu, tb, guest, size)) {
+        atomic_inc(&tb_cache.misses);
+        return 0;
+    }
+
+    qemu_mutex_lock(&tb_cache.lock);
+    e = g_hash_table_lookup(tb_cache.htable, &key);
+    if (!e || e->size != size || memcmp(tb_cache_entry_guest(e), guest, size)) {
+        goto out;
+    }
+    if (tb->tc.ptr + e->data_size > tcg_ctx->code_gen_highwater) {
+        ret = -1;
+        goto out;
+    }
+
+    memcpy(tb->tc.ptr, tb_cache_entry_host(e), e->data_size);
+    tb->cflags |= e->cflags & CF_TRACE;
+    tb->size = e->size;
+    tb->icount = e->icount;
+    tb->tc.size = e->code_size;
+    for (i = 0; i < 2; i++) {
+        tb->jmp_reset_offset[i] = e->jmp_reset_offset[i];
+        tb->jmp_target_arg[i] = e->jmp_target_arg[i];
+    }
+    if (!tcg_tb_reloc_apply(tcg_ctx, tb, e->relocs, e->nb_relocs)) {
+        /* not ours to fix: let it be translated and replaced */
+        goto out;
+    }
+    flush_icache_range((uintptr_t)tb->tc.ptr,
+                       (uintptr_t)tb->tc.ptr + e->code_size);
+
+    *search_size = e->data_size - e->code_size;
+    ret = e->code_size;
+
+ out:
+    qemu_mutex_unlock(&tb_cache.lock);
+    if (ret > 0) {
+        atomic_inc(&tb_cache.hits);
+    } else if (ret == 0) {
+        atomic_inc(&tb_cache.misses);
+    }
+    return ret;
+}
+
+/*
+ * Add the TB just generated by tcg_gen_code() to the cache.  Must be
+ * called before its jumps are patched.
+ */
+void tb_cache_insert(CPUState *cpu, TranslationBlock *tb,
+                     tb_page_addr_t phys_pc, int search_size)
+{
+    TCGContext *s = tcg_ctx;
+    TBCacheEntry *e;
+    int i;
+
+    if (s->tb_reloc_failed || tb->size > TB_CACHE_MAX_GUEST_SIZE) {
+        return;
+    }
+    tb_cache_ensure_loaded(cpu);
+
+    e = g_malloc(sizeof(*e) + s->nb_tb_relocs * sizeof(TCGTBReloc) +
+                 tb->size + tb->tc.size + search_size);
+    tb_cache_make_key(&e->key, tb, phys_pc);
+    e->cflags = tb->cflags;
+    e->size = tb->size;
+    e->icount = tb->icount;
+    e->code_size = tb->tc.size;
+    e->data_size = tb->tc.size + search_size;
+    e->nb_relocs = s->nb_tb_relocs;
+    for (i = 0; i < 2; i++) {
+        e->jmp_reset_offset[i] = tb->jmp_reset_offset[i];
+        e->jmp_target_arg[i] = tb->jmp_target_arg[i];
+    }
+    memcpy(e->relocs, s->tb_relocs, e->nb_relocs * sizeof(TCGTBReloc));
+    if (!tb_cache_read_guest(cpu, tb, tb_cache_entry_guest(e), tb->size)) {
+        g_free(e);
+        return;
+    }
+    memcpy(tb_cache_entry_host(e), tb->tc.ptr, e->data_size);
+
+    qemu_mutex_lock(&tb_cache.lock);
+    tb_cache_add(e);
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+/* The guest wrote to the code of @tb */
+void tb_cache_invalidate(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    TBCacheKey key;
+    TBCacheEntry *e;
+
+    tb_cache_make_key(&key, tb, phys_pc);
+    qemu_mutex_lock(&tb_cache.lock);
+    e = g_hash_table_lookup(tb_cache.htable, &key);
+    if (e) {
+        tb_cache.bytes -= tb_cache_entry_len(e);
+        g_hash_table_remove(tb_cache.htable, &key);
+        tb_cache.invalidated++;
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache.enabled) {
+        return;
+    }
+    qemu_mutex_lock(&tb_cache.lock);
+    cpu_fprintf(f, "TB cache entries    %u (%zu loaded, %zu KB)\n",
+                g_hash_table_size(tb_cache.htable), tb_cache.loaded,
+                tb_cache.bytes / KiB);
+    cpu_fprintf(f, "TB cache hits       %zu\n", atomic_read(&tb_cache.hits));
+    cpu_fprintf(f, "TB cache misses     %zu\n",
+                atomic_read(&tb_cache.misses));
+    cpu_fprintf(f, "TB cache invalidated %zu\n", tb_cache.invalidated);
+    qemu_mutex_unlock(&tb_cache.lock);
+}
@@ -0,0 +1,54 @@
+/*
+ * Persistent translated code cache
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+#include "exec/exec-all.h"
+
+#ifdef CONFIG_SOFTMMU
+void tb_cache_init(const char *path, Error **errp);
+bool tb_cache_enabled(void);
+int tb_cache_lookup(CPUState *cpu, TranslationBlock *tb,
+                    tb_page_addr_t phys_pc, int *search_size);
+void tb_cache_insert(CPUState *cpu, TranslationBlock *tb,
+                     tb_page_addr_t phys_pc, int search_size);
+void tb_cache_invalidate(TranslationBlock *tb, tb_page_addr_t phys_pc);
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+#else
+static inline bool tb_cache_enabled(void)
+{
+    return false;
+}
+
+static inline int tb_cache_lookup(CPUState *cpu, TranslationBlock *tb,
+                                  tb_page_addr_t phys_pc, int *search_size)
+{
+    return 0;
+}
+
+static inline void tb_cache_insert(CPUState *cpu, TranslationBlock *tb,
+                                   tb_page_addr_t phys_pc, int search_size)
+{
+}
+
+static inline void tb_cache_invalidate(TranslationBlock *tb,
+                                       tb_page_addr_t phys_pc)
+{
+}
+#endif
+
+#endif /* TB_CACHE_H */
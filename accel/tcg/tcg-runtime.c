@@ -155,6 +155,10 @@ void *HELPER(lookup_tb_ptr)(CPUArchState *env)
     if (tb == NULL) {
         return tcg_ctx->code_gen_epilogue;
     }
+    /* Executions of TBs that may tier up are counted by cpu_exec() */
+    if (tcg_tier_threshold && !(tb_cflags(tb) & CF_TRACE)) {
+        return tcg_ctx->code_gen_epilogue;
+    }
     qemu_log_mask_and_addr(CPU_LOG_EXEC, pc,
                            "Chain %d: %p ["
                            TARGET_FMT_lx "/" TARGET_FMT_lx "/%#x] %s\n",
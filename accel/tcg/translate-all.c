@@ -48,6 +48,7 @@
 #include "exec/cputlb.h"
 #include "exec/tb-hash.h"
 #include "translate-all.h"
+#include "tb-cache.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -211,6 +212,7 @@ TCGContext tcg_init_ctx;
 __thread TCGContext *tcg_ctx;
 TBContext tb_ctx;
 bool parallel_cpus;
+uint32_t tcg_tier_threshold;
 
 static void page_table_config_init(void)
 {
@@ -1444,6 +1446,9 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
         !qht_remove(&tb_ctx.htable, tb, h)) {
         return;
     }
+    if (tb_cache_enabled() && !(tb->cflags & CF_NOCACHE)) {
+        tb_cache_invalidate(tb, phys_pc);
+    }
 
     /* remove the TB from the page list */
     if (rm_from_page_list) {
@@ -1709,7 +1714,24 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->flags = flags;
     tb->cflags = cflags;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->exec_count = 0;
     tcg_ctx->tb_cflags = cflags;
+    /* Debug state changes the code generated for a TB without showing up
+     * in its key: leave the cache alone while it is in effect */
+    tcg_ctx->tb_reloc_enabled = tb_cache_enabled() &&
+                                !(cflags & CF_NOCACHE) &&
+                                !cpu->singlestep_enabled && !singlestep &&
+                                QTAILQ_EMPTY(&cpu->breakpoints);
+
+    if (tcg_ctx->tb_reloc_enabled) {
+        gen_code_size = tb_cache_lookup(cpu, tb, phys_pc, &search_size);
+        if (unlikely(gen_code_size < 0)) {
+            goto buffer_overflow;
+        }
+        if (gen_code_size > 0) {
+            goto tb_cached;
+        }
+    }
 
 #ifdef CONFIG_PROFILER
     /* includes aborted translations because of exceptions */
@@ -1758,6 +1780,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
     tb->tc.size = gen_code_size;
 
+    if (tcg_ctx->tb_reloc_enabled) {
+        tb_cache_insert(cpu, tb, phys_pc, search_size);
+    }
+
 #ifdef CONFIG_PROFILER
     atomic_set(&prof->code_time, prof->code_time + profile_getclock() - ti);
     atomic_set(&prof->code_in_len, prof->code_in_len + tb->size);
@@ -1797,6 +1823,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
 #endif
 
+ tb_cached:
     atomic_set(&tcg_ctx->code_gen_ptr, (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN));
@@ -2290,6 +2317,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
+    size_t notdirty_writes, dirty_resets;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
     nb_tbs = tst.nb_tbs;
@@ -2325,11 +2353,23 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "TB flush count      %u\n",
                 atomic_read(&tb_ctx.tb_flush_count));
     cpu_fprintf(f, "TB invalidate count %zu\n", tcg_tb_phys_invalidate_count());
+    if (tcg_tier_threshold) {
+        cpu_fprintf(f, "TB tier-up count    %u\n",
+                    atomic_read(&tb_ctx.tb_tier_up_count));
+        cpu_fprintf(f, "Trace jumps folded  %u\n",
+                    atomic_read(&tb_ctx.trace_jmp_count));
+        cpu_fprintf(f, "Trace side exits    %u\n",
+                    atomic_read(&tb_ctx.trace_side_exit_count));
+    }
 
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     cpu_fprintf(f, "TLB full flushes    %zu\n", flush_full);
     cpu_fprintf(f, "TLB partial flushes %zu\n", flush_part);
     cpu_fprintf(f, "TLB elided flushes  %zu\n", flush_elide);
+    tlb_dirty_counts(&notdirty_writes, &dirty_resets);
+    cpu_fprintf(f, "TLB notdirty writes %zu\n", notdirty_writes);
+    cpu_fprintf(f, "TLB dirty re-arms   %zu\n", dirty_resets);
+    tb_cache_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
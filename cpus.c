@@ -50,6 +50,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
 #include "tcg.h"
+#include "tb-cache.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
 #include "hw/boards.h"
@@ -203,6 +204,18 @@ static bool default_mttcg_enabled(void)
 void qemu_tcg_configure(QemuOpts *opts, Error **errp)
 {
     const char *t = qemu_opt_get(opts, "thread");
+    const char *cache = qemu_opt_get(opts, "tb-cache");
+
+    tcg_tier_threshold = qemu_opt_get_number(opts, "tier-threshold", 0);
+    if (cache) {
+        Error *local_err = NULL;
+
+        tb_cache_init(cache, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
     if (t) {
         if (strcmp(t, "multi") == 0) {
             if (TCG_OVERSIZED_GUEST) {
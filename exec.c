@@ -1343,9 +1343,9 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
 }
 
 /* Note: start and end must be within the same ram block.  */
-bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
-                                              ram_addr_t length,
-                                              unsigned client)
+bool cpu_physical_memory_test_and_clear_dirty_deferred(ram_addr_t start,
+                                                       ram_addr_t length,
+                                                       unsigned client)
 {
     DirtyMemoryBlocks *blocks;
     unsigned long end, page;
@@ -1374,20 +1374,41 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
 
     rcu_read_unlock();
 
-    if (dirty && tcg_enabled()) {
+    return dirty;
+}
+
+void cpu_physical_memory_rearm_dirty(ram_addr_t start, ram_addr_t length)
+{
+    if (length && tcg_enabled()) {
         tlb_reset_dirty_range_all(start, length);
     }
+}
+
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client)
+{
+    bool dirty;
+
+    dirty = cpu_physical_memory_test_and_clear_dirty_deferred(start, length,
+                                                              client);
+    if (dirty) {
+        cpu_physical_memory_rearm_dirty(start, length);
+    }
 
     return dirty;
 }
 
-DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty_deferred
      (ram_addr_t start, ram_addr_t length, unsigned client)
 {
     DirtyMemoryBlocks *blocks;
     unsigned long align = 1UL << (TARGET_PAGE_BITS + BITS_PER_LEVEL);
     ram_addr_t first = QEMU_ALIGN_DOWN(start, align);
     ram_addr_t last  = QEMU_ALIGN_UP(start + length, align);
+    unsigned long start_page = start >> TARGET_PAGE_BITS;
+    unsigned long end_page = TARGET_PAGE_ALIGN(start + length)
+                             >> TARGET_PAGE_BITS;
     DirtyBitmapSnapshot *snap;
     unsigned long page, end, dest;
 
@@ -1408,23 +1429,48 @@ DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
         unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+        unsigned long *src, k;
 
         assert(QEMU_IS_ALIGNED(offset, (1 << BITS_PER_LEVEL)));
         assert(QEMU_IS_ALIGNED(num,    (1 << BITS_PER_LEVEL)));
-        offset >>= BITS_PER_LEVEL;
-
-        bitmap_copy_and_clear_atomic(snap->dirty + dest,
-                                     blocks->blocks[idx] + offset,
-                                     num);
+        src = blocks->blocks[idx] + (offset >> BITS_PER_LEVEL);
+
+        /* Only the pages of the range are taken out of the bitmap; the
+         * rest of the edge words is left for other users */
+        for (k = 0; k < num >> BITS_PER_LEVEL; k++) {
+            unsigned long word_page = page + (k << BITS_PER_LEVEL);
+            unsigned long lo = MAX(start_page, word_page) - word_page;
+            unsigned long hi = MIN(end_page, word_page + BITS_PER_LONG)
+                               - word_page;
+            unsigned long mask = BITMAP_FIRST_WORD_MASK(lo) &
+                                 BITMAP_LAST_WORD_MASK(hi);
+
+            if (!atomic_read(&src[k])) {
+                continue;
+            }
+            if (mask == ~0UL) {
+                snap->dirty[dest + k] = atomic_xchg(&src[k], 0);
+            } else {
+                snap->dirty[dest + k] = atomic_fetch_and(&src[k], ~mask) & mask;
+            }
+        }
         page += num;
         dest += num >> BITS_PER_LEVEL;
     }
 
     rcu_read_unlock();
 
-    if (tcg_enabled()) {
-        tlb_reset_dirty_range_all(start, length);
-    }
+    return snap;
+}
+
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+     (ram_addr_t start, ram_addr_t length, unsigned client)
+{
+    DirtyBitmapSnapshot *snap;
+
+    snap = cpu_physical_memory_snapshot_and_clear_dirty_deferred(start, length,
+                                                                 client);
+    cpu_physical_memory_rearm_dirty(start, length);
 
     return snap;
 }
@@ -2681,6 +2727,8 @@ void memory_notdirty_write_prepare(NotDirtyInfo *ndi,
                           ram_addr_t ram_addr,
                           unsigned size)
 {
+    CPUArchState *env = cpu->env_ptr;
+
     ndi->cpu = cpu;
     ndi->ram_addr = ram_addr;
     ndi->mem_vaddr = mem_vaddr;
@@ -2688,6 +2736,8 @@ void memory_notdirty_write_prepare(NotDirtyInfo *ndi,
     ndi->pages = NULL;
 
     assert(tcg_enabled());
+    atomic_set(&env->tlb_c.notdirty_write_count,
+               env->tlb_c.notdirty_write_count + 1);
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
         ndi->pages = page_collection_lock(ram_addr, ram_addr + size);
         tb_invalidate_phys_page_fast(ndi->pages, ram_addr, size);
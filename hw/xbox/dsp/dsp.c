@@ -170,8 +170,7 @@ void dsp_run(DSPState* dsp, int cycles)
     //  printf("--> %d\n", dsp->core.save_cycles);
     while (dsp->save_cycles > 0)
     {
-        dsp56k_execute_instruction(&dsp->core);
-        dsp->save_cycles -= dsp->core.instr_cycle;
+        dsp->save_cycles -= dsp56k_execute_block(&dsp->core, dsp->save_cycles);
     }
 
 } 
@@ -181,6 +180,7 @@ void dsp_bootstrap(DSPState* dsp)
     // scratch memory is dma'd in to pram by the bootrom
     dsp->dma.scratch_rw(dsp->dma.rw_opaque,
         (uint8_t*)dsp->core.pram, 0, 0x800*4, false);
+    dsp56k_invalidate_pram(&dsp->core, 0, 0x800);
 }
 
 void dsp_start_frame(DSPState* dsp)
@@ -201,46 +201,40 @@ uint32_t dsp_disasm_address(DSPState* dsp, FILE *out, uint32_t lowerAdr, uint32_
     return dsp_pc;
 }
 
-uint32_t dsp_read_memory(DSPState* dsp, char space, uint32_t address)
+static int dsp_space_id(char space)
 {
-    int space_id;
-
     switch (space) {
     case 'X':
-        space_id = DSP_SPACE_X;
-        break;
+        return DSP_SPACE_X;
     case 'Y':
-        space_id = DSP_SPACE_Y;
-        break;
+        return DSP_SPACE_Y;
     case 'P':
-        space_id = DSP_SPACE_P;
-        break;
+        return DSP_SPACE_P;
     default:
         assert(false);
+        return -1;
     }
+}
 
-    return dsp56k_read_memory(&dsp->core, space_id, address);
+uint32_t dsp_read_memory(DSPState* dsp, char space, uint32_t address)
+{
+    return dsp56k_read_memory(&dsp->core, dsp_space_id(space), address);
 }
 
 void dsp_write_memory(DSPState* dsp, char space, uint32_t address, uint32_t value)
 {
-    int space_id;
+    dsp56k_write_memory(&dsp->core, dsp_space_id(space), address, value);
+}
 
-    switch (space) {
-    case 'X':
-        space_id = DSP_SPACE_X;
-        break;
-    case 'Y':
-        space_id = DSP_SPACE_Y;
-        break;
-    case 'P':
-        space_id = DSP_SPACE_P;
-        break;
-    default:
-        assert(false);
-    }
+/* Block transfers are bounds checked once and must stay within one memory */
+void dsp_read_memory_block(DSPState* dsp, char space, uint32_t address, uint32_t* values, size_t count)
+{
+    dsp56k_read_memory_block(&dsp->core, dsp_space_id(space), address, values, count);
+}
 
-    dsp56k_write_memory(&dsp->core, space_id, address, value);
+void dsp_write_memory_block(DSPState* dsp, char space, uint32_t address, const uint32_t* values, size_t count)
+{
+    dsp56k_write_memory_block(&dsp->core, dsp_space_id(space), address, values, count);
 }
 
 /**
@@ -53,6 +53,8 @@ void dsp_start_frame(DSPState* dsp);
 /* Dsp Debugger commands */
 uint32_t dsp_read_memory(DSPState* dsp, char space, uint32_t addr);
 void dsp_write_memory(DSPState* dsp, char space, uint32_t address, uint32_t value);
+void dsp_read_memory_block(DSPState* dsp, char space, uint32_t address, uint32_t* values, size_t count);
+void dsp_write_memory_block(DSPState* dsp, char space, uint32_t address, const uint32_t* values, size_t count);
 uint32_t dsp_disasm_memory(DSPState* dsp, uint32_t dsp_memdump_addr, uint32_t dsp_memdump_upper, char space);
 uint32_t dsp_disasm_address(DSPState* dsp, FILE *out, uint32_t lowerAdr, uint32_t UpperAdr);
 void dsp_info(DSPState* dsp);
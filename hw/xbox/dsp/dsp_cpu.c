@@ -56,6 +56,8 @@
 static void dsp_postexecute_update_pc(dsp_core_t* dsp);
 static void dsp_postexecute_interrupts(dsp_core_t* dsp);
 
+static void flush_blocks(dsp_core_t* dsp);
+
 static uint32_t read_memory_p(dsp_core_t* dsp, uint32_t address);
 static uint32_t read_memory_disasm(dsp_core_t* dsp, int space, uint32_t address);
 
@@ -386,6 +388,7 @@ void dsp56k_reset_cpu(dsp_core_t* dsp)
     memset(dsp->periph, 0, sizeof(dsp->periph));
     memset(dsp->stack, 0, sizeof(dsp->stack));
     memset(dsp->registers, 0, sizeof(dsp->registers));
+    dsp56k_invalidate_pram(dsp, 0, DSP_PRAM_SIZE);
     
     /* Registers */
     dsp->pc = 0x0000;
@@ -439,6 +442,31 @@ static OpcodeEntry lookup_opcode(uint32_t op) {
     return r;
 }
 
+/* Decode the instruction at the current PC, caching the handler so
+ * following executions of the same P memory word skip the opcode search */
+static dsp_insn_func_t decode_instruction(dsp_core_t* dsp)
+{
+    dsp_insn_func_t func = dsp->pram_decoded[dsp->pc];
+    if (func) {
+        return func;
+    }
+
+    if (dsp->cur_inst < 0x100000) {
+        const OpcodeEntry op = lookup_opcode(dsp->cur_inst);
+        if (!op.emu_func) {
+            /* Not cached, so it is reported every time it is hit */
+            printf("%x - %s\n", dsp->cur_inst, op.name);
+            return emu_undefined;
+        }
+        func = op.emu_func;
+    } else {
+        func = opcodes_parmove[(dsp->cur_inst>>20) & BITMASK(4)];
+    }
+
+    dsp->pram_decoded[dsp->pc] = func;
+    return func;
+}
+
 static uint16_t disasm_instruction(dsp_core_t* dsp, dsp_trace_disasm_t mode)
 {
     dsp->disasm_mode = mode;
@@ -660,18 +688,7 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
         }
     }
             
-    if (dsp->cur_inst < 0x100000) {
-        const OpcodeEntry op = lookup_opcode(dsp->cur_inst);
-        if (op.emu_func) {
-            op.emu_func(dsp);
-        } else {
-            printf("%x - %s\n", dsp->cur_inst, op.name);
-            emu_undefined(dsp);
-        }
-    } else {
-        /* Do parallel move read */
-        opcodes_parmove[(dsp->cur_inst>>20) & BITMASK(4)](dsp);
-    }
+    decode_instruction(dsp)(dsp);
 
     /* Disasm current instruction ? (trace mode only) */
     if (TRACE_DSP_DISASM) {
@@ -718,6 +735,224 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
 #endif
 }
 
+/**********************************
+ *  Block execution
+ **********************************/
+
+static void flush_blocks(dsp_core_t* dsp)
+{
+    memset(dsp->block_index, 0, sizeof(dsp->block_index));
+    memset(dsp->pram_in_block, 0, sizeof(dsp->pram_in_block));
+    dsp->num_blocks = 0;
+    dsp->block_flushes++;
+}
+
+static bool block_ends_after(dsp_insn_func_t func)
+{
+    return func == emu_rep_aa || func == emu_rep_imm
+        || func == emu_rep_ea || func == emu_rep_reg
+        || func == emu_do_aa || func == emu_do_imm
+        || func == emu_do_ea || func == emu_do_reg
+        || func == emu_dor_imm || func == emu_dor_reg
+        || func == emu_enddo
+        || func == emu_jmp_imm || func == emu_jmp_ea
+        || func == emu_bra_imm || func == emu_bra_long
+        || func == emu_rts || func == emu_rti
+        || func == emu_illegal || func == emu_reset
+        || func == emu_stop || func == emu_wait;
+}
+
+/* Jumps and branches which, when taken to their own address, poll state
+ * that nothing but the DSP itself can change during dsp56k_execute_block */
+static bool is_idle_jump(dsp_insn_func_t func)
+{
+    return func == emu_jmp_imm || func == emu_jcc_imm
+        || func == emu_bra_imm || func == emu_bra_long
+        || func == emu_bcc_imm || func == emu_bcc_long
+        || func == emu_jclr_aa || func == emu_jclr_pp || func == emu_jclr_reg
+        || func == emu_jset_aa || func == emu_jset_pp || func == emu_jset_reg
+        || func == emu_brclr_pp || func == emu_brclr_reg
+        || func == emu_brset_pp || func == emu_brset_reg;
+}
+
+/* Decode instructions from the current PC on, without executing them.
+ * Instruction lengths come from the disassembler. Unimplemented opcodes
+ * end the block so they are reported when they are actually reached. */
+static dsp_block_t* translate_block(dsp_core_t* dsp)
+{
+    uint32_t save_pc = dsp->pc;
+    uint32_t save_prev_inst_pc = dsp->disasm_prev_inst_pc;
+    bool save_is_looping = dsp->disasm_is_looping;
+    dsp_block_t* b;
+    uint32_t pc, i;
+
+    if (dsp->num_blocks == DSP_BLOCK_CACHE_SIZE) {
+        flush_blocks(dsp);
+    }
+    b = &dsp->blocks[dsp->num_blocks];
+    b->pc = save_pc;
+    b->num_insns = 0;
+
+    pc = save_pc;
+    while (b->num_insns < DSP_BLOCK_MAX_INSNS && pc + 1 < DSP_PRAM_SIZE) {
+        dsp_block_insn_t* e = &b->insns[b->num_insns];
+
+        e->inst = read_memory_p(dsp, pc);
+        e->func = dsp->pram_decoded[pc];
+        if (!e->func) {
+            if (e->inst < 0x100000) {
+                e->func = lookup_opcode(e->inst).emu_func;
+                if (!e->func) {
+                    break;
+                }
+            } else {
+                e->func = opcodes_parmove[(e->inst>>20) & BITMASK(4)];
+            }
+            dsp->pram_decoded[pc] = e->func;
+        }
+
+        dsp->pc = pc;
+        e->len = disasm_instruction(dsp, DSP_DISASM_MODE);
+        if (pc + e->len > DSP_PRAM_SIZE) {
+            break;
+        }
+
+        b->num_insns++;
+        pc += e->len;
+        if (block_ends_after(e->func)) {
+            break;
+        }
+    }
+
+    dsp->pc = save_pc;
+    dsp->disasm_prev_inst_pc = save_prev_inst_pc;
+    dsp->disasm_is_looping = save_is_looping;
+
+    if (b->num_insns == 0) {
+        return NULL;
+    }
+
+    for (i = b->pc; i < pc; i++) {
+        dsp->pram_in_block[i] = true;
+    }
+    dsp->block_index[b->pc] = ++dsp->num_blocks;
+    return b;
+}
+
+/* Slow path checks: trace, pending or running interrupts */
+static bool block_exit_pending(dsp_core_t* dsp)
+{
+    return dsp->interrupt_state != DSP_INTERRUPT_NONE
+        || dsp->interrupt_counter != 0
+        || (dsp->registers[DSP_REG_SR] & (1<<DSP_SR_T));
+}
+
+/* Repeat the instruction a REP is running on with its decoded handler */
+static int execute_rep(dsp_core_t* dsp, int budget)
+{
+    uint32_t pc = dsp->pc;
+    int cycles = 0;
+    dsp_insn_func_t func;
+
+    dsp->cur_inst = read_memory_p(dsp, pc);
+    func = decode_instruction(dsp);
+
+    do {
+        dsp->cur_inst_len = 1;
+        dsp->instr_cycle = 2;
+        func(dsp);
+        cycles += dsp->instr_cycle;
+        dsp_postexecute_update_pc(dsp);
+    } while (dsp->loop_rep && dsp->pc == pc && cycles < budget
+             && dsp->pram_decoded[pc] == func);
+
+    return cycles;
+}
+
+/**
+ * Execute translated blocks until budget cycles are used, an interrupt has
+ * to be taken or execution leaves the block. Returns the cycles used, which
+ * may overshoot budget by one instruction like dsp56k_execute_instruction.
+ * A block jumping back to its own start, like a DO loop body, is run again
+ * without a lookup. A REP runs its instruction with execute_rep. A jump to
+ * itself on a polled condition can't make progress until the next call, so
+ * it uses up the rest of the budget.
+ */
+int dsp56k_execute_block(dsp_core_t* dsp, int budget)
+{
+    int cycles = 0;
+    uint32_t flushes = dsp->block_flushes;
+    uint32_t pc, i;
+    dsp_block_t* b;
+
+    if (TRACE_DSP_DISASM || block_exit_pending(dsp)) {
+        dsp56k_execute_instruction(dsp);
+        return dsp->instr_cycle;
+    }
+
+    if (dsp->loop_rep && !dsp->pc_on_rep) {
+        cycles = execute_rep(dsp, budget);
+        if (dsp->loop_rep || cycles >= budget) {
+            return cycles;
+        }
+        if (block_exit_pending(dsp)) {
+            dsp_postexecute_interrupts(dsp);
+            return cycles;
+        }
+        flushes = dsp->block_flushes;
+    }
+
+    assert(dsp->pc < DSP_PRAM_SIZE);
+    if (dsp->block_index[dsp->pc]) {
+        b = &dsp->blocks[dsp->block_index[dsp->pc] - 1];
+    } else {
+        b = translate_block(dsp);
+        if (!b) {
+            dsp56k_execute_instruction(dsp);
+            return cycles + dsp->instr_cycle;
+        }
+        flushes = dsp->block_flushes;
+    }
+
+    for (;;) {
+        pc = b->pc;
+        for (i = 0; i < b->num_insns; i++) {
+            const dsp_block_insn_t* e = &b->insns[i];
+
+            dsp->disasm_memory_ptr = 0;
+            dsp->cur_inst = e->inst;
+            dsp->cur_inst_len = 1;
+            dsp->instr_cycle = 2;
+            e->func(dsp);
+            cycles += dsp->instr_cycle;
+            dsp_postexecute_update_pc(dsp);
+
+            if (block_exit_pending(dsp)) {
+                dsp_postexecute_interrupts(dsp);
+                return cycles;
+            }
+            if (dsp->block_flushes != flushes) {
+                return cycles;
+            }
+            if (dsp->pc != pc + e->len || dsp->loop_rep) {
+                if (dsp->pc == pc && dsp->cur_inst_len == 0
+                    && is_idle_jump(e->func)) {
+                    return MAX(cycles, budget);
+                }
+                break;
+            }
+            if (cycles >= budget) {
+                return cycles;
+            }
+            pc += e->len;
+        }
+
+        if (dsp->pc != b->pc || dsp->loop_rep || cycles >= budget) {
+            return cycles;
+        }
+    }
+}
+
 /**********************************
  *  Update the PC
 **********************************/
@@ -1022,8 +1257,98 @@ static void write_memory_raw(dsp_core_t* dsp, int space, uint32_t address, uint3
     } else if (space == DSP_SPACE_P) {
         assert(address < DSP_PRAM_SIZE);
         stl_le_p(&dsp->pram[address], value);
+        dsp56k_invalidate_pram(dsp, address, 1);
+    } else {
+        assert(false);
+    }
+}
+
+/* Array backing count words at address, or NULL for peripheral space.
+ * The whole range has to be inside a single memory. */
+static uint32_t* memory_block_ptr(dsp_core_t* dsp, int space, uint32_t address, uint32_t count)
+{
+    assert((address & 0xFF000000) == 0);
+
+    if (space == DSP_SPACE_X) {
+        if (address >= DSP_PERIPH_BASE) {
+            assert(address + count <= DSP_PERIPH_BASE+DSP_PERIPH_SIZE);
+            return NULL;
+        } else if (address >= DSP_MIXBUFFER_BASE && address < DSP_MIXBUFFER_BASE+DSP_MIXBUFFER_SIZE) {
+            assert(address + count <= DSP_MIXBUFFER_BASE+DSP_MIXBUFFER_SIZE);
+            return &dsp->mixbuffer[address-DSP_MIXBUFFER_BASE];
+        } else {
+            assert(address + count <= DSP_XRAM_SIZE);
+            return &dsp->xram[address];
+        }
+    } else if (space == DSP_SPACE_Y) {
+        assert(address + count <= DSP_YRAM_SIZE);
+        return &dsp->yram[address];
+    } else if (space == DSP_SPACE_P) {
+        assert(address + count <= DSP_PRAM_SIZE);
+        return &dsp->pram[address];
     } else {
         assert(false);
+        return NULL;
+    }
+}
+
+void dsp56k_read_memory_block(dsp_core_t* dsp, int space, uint32_t address, uint32_t* values, uint32_t count)
+{
+    uint32_t* ptr = memory_block_ptr(dsp, space, address, count);
+    uint32_t i;
+
+    if (ptr == NULL) {
+        assert(dsp->read_peripheral);
+        for (i = 0; i < count; i++) {
+            values[i] = dsp->read_peripheral(dsp, address + i);
+        }
+    } else if (space == DSP_SPACE_P) {
+        for (i = 0; i < count; i++) {
+            values[i] = ldl_le_p(&ptr[i]);
+        }
+    } else {
+        memcpy(values, ptr, count * sizeof(uint32_t));
+    }
+}
+
+/* Values must already be 24 bit */
+void dsp56k_write_memory_block(dsp_core_t* dsp, int space, uint32_t address, const uint32_t* values, uint32_t count)
+{
+    uint32_t* ptr = memory_block_ptr(dsp, space, address, count);
+    uint32_t i;
+
+    if (TRACE_DSP_DISASM_MEM) {
+        for (i = 0; i < count; i++) {
+            write_memory_disasm(dsp, space, address + i, values[i]);
+        }
+    } else if (ptr == NULL) {
+        assert(dsp->write_peripheral);
+        for (i = 0; i < count; i++) {
+            dsp->write_peripheral(dsp, address + i, values[i]);
+        }
+    } else if (space == DSP_SPACE_P) {
+        for (i = 0; i < count; i++) {
+            stl_le_p(&ptr[i], values[i]);
+        }
+        dsp56k_invalidate_pram(dsp, address, count);
+    } else {
+        memcpy(ptr, values, count * sizeof(uint32_t));
+    }
+}
+
+/* Must be called after P memory is modified without dsp56k_write_memory */
+void dsp56k_invalidate_pram(dsp_core_t* dsp, uint32_t address, uint32_t count)
+{
+    uint32_t i;
+
+    assert(address + count <= DSP_PRAM_SIZE);
+    memset(&dsp->pram_decoded[address], 0, count * sizeof(dsp->pram_decoded[0]));
+
+    for (i = 0; i < count; i++) {
+        if (dsp->pram_in_block[address + i]) {
+            flush_blocks(dsp);
+            break;
+        }
     }
 }
 
@@ -153,6 +153,25 @@ typedef struct dsp_interrupt_s {
 
 typedef struct dsp_core_s dsp_core_t;
 
+typedef void (*dsp_insn_func_t)(dsp_core_t* dsp);
+
+#define DSP_BLOCK_MAX_INSNS 32
+#define DSP_BLOCK_CACHE_SIZE 128
+
+typedef struct dsp_block_insn_s {
+    dsp_insn_func_t func;
+    uint32_t inst;
+    uint32_t len;
+} dsp_block_insn_t;
+
+/* Straight line run of decoded instructions, ending at the first
+ * unconditional jump, REP, DO or ENDDO */
+typedef struct dsp_block_s {
+    uint32_t pc;
+    uint32_t num_insns;
+    dsp_block_insn_t insns[DSP_BLOCK_MAX_INSNS];
+} dsp_block_t;
+
 struct dsp_core_s {
     /* DSP instruction Cycle counter */
     uint16_t instr_cycle;
@@ -168,6 +187,19 @@ struct dsp_core_s {
     uint32_t yram[DSP_YRAM_SIZE];
     uint32_t pram[DSP_PRAM_SIZE];
 
+    /* Decoded handler for each P memory word, NULL if not yet decoded.
+     * Entries are dropped whenever the P memory word is written. */
+    dsp_insn_func_t pram_decoded[DSP_PRAM_SIZE];
+
+    /* Translated blocks, found by start address through block_index
+     * (slot + 1, 0 if none). The whole cache is dropped when it is full
+     * or when a P memory word covered by any block is written. */
+    dsp_block_t blocks[DSP_BLOCK_CACHE_SIZE];
+    uint16_t block_index[DSP_PRAM_SIZE];
+    bool pram_in_block[DSP_PRAM_SIZE];
+    uint32_t num_blocks;
+    uint32_t block_flushes;
+
     uint32_t mixbuffer[DSP_MIXBUFFER_SIZE];
 
     /* peripheral space, x:0xffff80-0xffffff */
@@ -245,10 +277,14 @@ struct dsp_core_s {
 /* Functions */
 void dsp56k_reset_cpu(dsp_core_t* dsp);		/* Set dsp_core to use */
 void dsp56k_execute_instruction(dsp_core_t* dsp);	/* Execute 1 instruction */
+int dsp56k_execute_block(dsp_core_t* dsp, int budget);	/* Execute up to budget cycles, return cycles used */
 uint16_t dsp56k_execute_one_disasm_instruction(dsp_core_t* dsp, FILE *out, uint32_t pc);	/* Execute 1 instruction in disasm mode */
 
 uint32_t dsp56k_read_memory(dsp_core_t* dsp, int space, uint32_t address);
 void dsp56k_write_memory(dsp_core_t* dsp, int space, uint32_t address, uint32_t value);
+void dsp56k_read_memory_block(dsp_core_t* dsp, int space, uint32_t address, uint32_t* values, uint32_t count);
+void dsp56k_write_memory_block(dsp_core_t* dsp, int space, uint32_t address, const uint32_t* values, uint32_t count);
+void dsp56k_invalidate_pram(dsp_core_t* dsp, uint32_t address, uint32_t count);
 
 /* Interrupt relative functions */
 void dsp56k_add_interrupt(dsp_core_t* dsp, uint16_t inter);
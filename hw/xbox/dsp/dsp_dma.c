@@ -17,11 +17,8 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <stdlib.h>
-#include <stdint.h>
-#include <stdbool.h>
-#include <assert.h>
-
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "dsp_dma.h"
 
 #define DMA_CONFIGURATION_AUTOSTART (1 << 0)
@@ -86,6 +83,45 @@ const char *format_names[] = {
 };
 #endif
 
+/* Conversion between buffer items and DSP words, a whole run at a time.
+ * Plain loops over unaliased arrays, so they are left to the compiler
+ * to vectorize. */
+static void dma_unpack_16(uint32_t *restrict dst, const uint8_t *restrict src,
+                          uint32_t count)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        dst[i] = lduw_le_p(src + i * 2);
+    }
+}
+
+static void dma_unpack_32(uint32_t *restrict dst, const uint8_t *restrict src,
+                          uint32_t count, uint32_t mask)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        dst[i] = ldl_le_p(src + i * 4) & mask;
+    }
+}
+
+static void dma_pack_16(uint8_t *restrict dst, const uint32_t *restrict src,
+                        uint32_t count)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        stw_le_p(dst + i * 2, src[i]);
+    }
+}
+
+static void dma_pack_32(uint8_t *restrict dst, const uint32_t *restrict src,
+                        uint32_t count)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        stl_le_p(dst + i * 4, src[i]);
+    }
+}
+
 static void dsp_dma_run(DSPDMAState *s)
 {
     if (!(s->control & DMA_CONTROL_RUNNING)
@@ -94,15 +130,17 @@ static void dsp_dma_run(DSPDMAState *s)
     }
     while (!(s->next_block & NODE_POINTER_EOL)) {
         uint32_t addr = s->next_block & NODE_POINTER_VAL;
-        assert((addr+6) < sizeof(s->core->xram));
 
-        uint32_t next_block = dsp56k_read_memory(s->core, DSP_SPACE_X, addr);
-        uint32_t control = dsp56k_read_memory(s->core, DSP_SPACE_X, addr+1);
-        uint32_t count = dsp56k_read_memory(s->core, DSP_SPACE_X, addr+2);
-        uint32_t dsp_offset = dsp56k_read_memory(s->core, DSP_SPACE_X, addr+3);
-        uint32_t scratch_offset = dsp56k_read_memory(s->core, DSP_SPACE_X, addr+4);
-        uint32_t scratch_base = dsp56k_read_memory(s->core, DSP_SPACE_X, addr+5);
-        uint32_t scratch_size = dsp56k_read_memory(s->core, DSP_SPACE_X, addr+6)+1;
+        uint32_t node[7];
+        dsp56k_read_memory_block(s->core, DSP_SPACE_X, addr, node, 7);
+
+        uint32_t next_block = node[0];
+        uint32_t control = node[1];
+        uint32_t count = node[2];
+        uint32_t dsp_offset = node[3];
+        uint32_t scratch_offset = node[4];
+        uint32_t scratch_base = node[5];
+        uint32_t scratch_size = node[6]+1;
 
         s->next_block = next_block;
         if (s->next_block & NODE_POINTER_EOL) {
@@ -222,24 +260,17 @@ static void dsp_dma_run(DSPDMAState *s)
 
 
         size_t transfer_size = count * item_size;
-        uint8_t* scratch_buf = calloc(count, item_size);
+        uint32_t* words = malloc(count * (sizeof(uint32_t) + item_size));
+        uint8_t* scratch_buf = (uint8_t*)(words + count);
 
         if (direction) {
-            int i;
-            for (i=0; i<count; i++) {
-                uint32_t v = dsp56k_read_memory(s->core,
-                    mem_space, mem_address+i);
-                switch(item_size) {
-                case 2:
-                    *(uint16_t*)(scratch_buf + i*2) = v;
-                    break;
-                case 4:
-                    *(uint32_t*)(scratch_buf + i*4) = v;
-                    break;
-                default:
-                    assert(false);
-                    break;
-                }
+            dsp56k_read_memory_block(s->core,
+                mem_space, mem_address, words, count);
+
+            if (item_size == 2) {
+                dma_pack_16(scratch_buf, words, count);
+            } else {
+                dma_pack_32(scratch_buf, words, count);
             }
 
             /* FIXME: Move to function; then reuse for both directions */
@@ -272,26 +303,17 @@ static void dsp_dma_run(DSPDMAState *s)
             s->scratch_rw(s->rw_opaque,
                 scratch_buf, scratch_addr, transfer_size, 0);
 
-            int i;
-            for (i=0; i<count; i++) {
-                uint32_t v;
-                switch(item_size) {
-                case 2:
-                    v = *(uint16_t*)(scratch_buf + i*2);
-                    break;
-                case 4:
-                    v = (*(uint32_t*)(scratch_buf + i*4)) & item_mask;
-                    break;
-                default:
-                    assert(false);
-                    break;
-                }
-                // DPRINTF("... %06x\n", v);
-                dsp56k_write_memory(s->core, mem_space, mem_address+i, v);
+            if (item_size == 2) {
+                dma_unpack_16(words, scratch_buf, count);
+            } else {
+                dma_unpack_32(words, scratch_buf, count, item_mask);
             }
+
+            dsp56k_write_memory_block(s->core,
+                mem_space, mem_address, words, count);
         }
 
-        free(scratch_buf);
+        free(words);
 
     }
 }
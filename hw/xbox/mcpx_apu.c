@@ -23,12 +23,37 @@
 #include "hw/i386/pc.h"
 #include "hw/pci/pci.h"
 #include "cpu.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
+#include "audio/audio.h"
 #include "hw/xbox/dsp/dsp.h"
 #include <math.h>
 
 #define NUM_SAMPLES_PER_FRAME 32
 #define NUM_MIXBINS 32
 
+/* 32 samples at 48kHz */
+#define SE_FRAME_RATE 1500
+#define SE_FRAME_NS (NANOSECONDS_PER_SECOND / SE_FRAME_RATE)
+/* Give up on catching up when running this far behind */
+#define SE_FRAME_MAX_LAG_NS (SE_FRAME_NS * 16)
+
+/* GP and EP DSP56300 clock */
+#define DSP_CLOCK_HZ 160000000
+#define DSP_CYCLES_PER_FRAME (DSP_CLOCK_HZ / SE_FRAME_RATE)
+
+/* Host output, must be a power of two */
+#define OUT_RING_FRAMES 4096
+/* Fill level the output resampler steers towards, ~21ms */
+#define OUT_TARGET_FRAMES 1024
+/* Largest deviation from the nominal rate used to absorb clock drift */
+#define OUT_MAX_RATE_ADJUST 0.005f
+/* GP output FIFO 0 data held back per frame, in case the EP replaces it */
+#define OUT_GP_STAGE_BYTES (NUM_SAMPLES_PER_FRAME * 8 * 4)
+
 #include "hw/xbox/mcpx_apu.h"
 
 #define NV_PAPU_ISTS                                     0x00001000
@@ -286,6 +311,9 @@ static const struct {
 
 #define MCPX_HW_MAX_VOICES 256
 
+/* Header sample plus 64 nibbles */
+#define ADPCM_SAMPLES_PER_BLOCK 65
+
 #define GET_MASK(v, mask) (((v) & (mask)) >> ctz32(mask))
 
 #define SET_MASK(v, mask, val)                                       \
@@ -311,6 +339,14 @@ static const struct {
 /* More debug functionality */
 #define GENERATE_MIXBIN_BEEP      0
 
+typedef struct VoiceADPCMBlock {
+    bool valid;
+    bool stereo;
+    uint32_t ba;
+    uint32_t block_index;
+    int16_t samples[2][ADPCM_SAMPLES_PER_BLOCK];
+} VoiceADPCMBlock;
+
 typedef struct MCPXAPUState {
     PCIDevice dev;
 
@@ -319,14 +355,25 @@ typedef struct MCPXAPUState {
 
     MemoryRegion mmio;
 
+    /* Protects all state below, including voice memory and the DSPs.
+     * Taken after the BQL when both are required. */
+    QemuMutex lock;
+    bool exiting;
+    bool set_irq;
+
     /* Setup Engine */
     struct {
-        QEMUTimer *frame_timer;
+        QemuThread frame_thread;
+        QemuCond frame_cond;
+        int64_t next_frame_ns;
+        bool vm_running;
+        VMChangeStateEntry *vmstate;
     } se;
 
     /* Voice Processor */
     struct {
         MemoryRegion mmio;
+        VoiceADPCMBlock adpcm_cache[MCPX_HW_MAX_VOICES][2];
     } vp;
 
     /* Global Processor */
@@ -343,6 +390,28 @@ typedef struct MCPXAPUState {
         uint32_t regs[0x10000];
     } ep;
 
+    /* Host audio output, fed from the EP (or GP) output FIFO 0.
+     * The ring is single producer (frame thread) and single consumer
+     * (audio callback) and is not protected by the lock. */
+    struct {
+        QEMUSoundCard card;
+        SWVoiceOut *voice;
+        uint8_t gp_stage[OUT_GP_STAGE_BYTES];
+        size_t gp_stage_len;
+        bool ep_output;
+        bool streaming; /* The last frame produced output */
+        int16_t ring[OUT_RING_FRAMES][2];
+        unsigned int ring_head;
+        unsigned int ring_tail;
+        float resample_pos;
+        uint64_t underruns;
+        uint64_t overruns;
+        char *wav_path;
+        FILE *wav;
+        uint32_t wav_bytes;
+        Notifier wav_exit;
+    } out;
+
     uint32_t inbuf_sge_handle; //FIXME: Where is this stored?
     uint32_t outbuf_sge_handle; //FIXME: Where is this stored?
     uint32_t regs[0x20000];
@@ -352,6 +421,23 @@ typedef struct MCPXAPUState {
 #define MCPX_APU_DEVICE(obj) \
     OBJECT_CHECK(MCPXAPUState, (obj), "mcpx-apu")
 
+/* Everything the APU reads and writes in guest memory is system RAM. It is
+ * accessed directly rather than through memory dispatch, which takes the
+ * BQL for MMIO targets: done from the frame thread with d->lock held, that
+ * would take the two locks in the opposite order to the MMIO handlers. */
+static uint32_t apu_ldl(MCPXAPUState *d, hwaddr addr)
+{
+    assert(addr + 4 <= memory_region_size(d->ram));
+    return ldl_le_p(&d->ram_ptr[addr]);
+}
+
+static void apu_stl(MCPXAPUState *d, hwaddr addr, uint32_t val)
+{
+    assert(addr + 4 <= memory_region_size(d->ram));
+    stl_le_p(&d->ram_ptr[addr], val);
+    memory_region_set_dirty(d->ram, addr, 4);
+}
+
 static uint32_t voice_get_mask(MCPXAPUState *d,
                                unsigned int voice_handle,
                                hwaddr offset,
@@ -360,8 +446,7 @@ static uint32_t voice_get_mask(MCPXAPUState *d,
     assert(voice_handle < 0xFFFF);
     hwaddr voice = d->regs[NV_PAPU_VPVADDR]
                     + voice_handle * NV_PAVS_SIZE;
-    return (ldl_le_phys(&address_space_memory, voice + offset) & mask)
-              >> ctz32(mask);
+    return (apu_ldl(d, voice + offset) & mask) >> ctz32(mask);
 }
 static void voice_set_mask(MCPXAPUState *d,
                            unsigned int voice_handle,
@@ -372,9 +457,16 @@ static void voice_set_mask(MCPXAPUState *d,
     assert(voice_handle < 0xFFFF);
     hwaddr voice = d->regs[NV_PAPU_VPVADDR]
                     + voice_handle * NV_PAVS_SIZE;
-    uint32_t v = ldl_le_phys(&address_space_memory, voice + offset) & ~mask;
-    stl_le_phys(&address_space_memory, voice + offset,
-                v | ((val << ctz32(mask)) & mask));
+    uint32_t v = apu_ldl(d, voice + offset) & ~mask;
+    apu_stl(d, voice + offset, v | ((val << ctz32(mask)) & mask));
+}
+
+static void voice_invalidate_adpcm_cache(MCPXAPUState *d, unsigned int v)
+{
+    if (v < MCPX_HW_MAX_VOICES) {
+        d->vp.adpcm_cache[v][0].valid = false;
+        d->vp.adpcm_cache[v][1].valid = false;
+    }
 }
 
 static void update_irq(MCPXAPUState *d)
@@ -398,6 +490,8 @@ static uint64_t mcpx_apu_read(void *opaque,
 {
     MCPXAPUState *d = opaque;
 
+    qemu_mutex_lock(&d->lock);
+
     uint64_t r = 0;
     switch (addr) {
     case NV_PAPU_XGSCNT:
@@ -410,6 +504,8 @@ static uint64_t mcpx_apu_read(void *opaque,
         break;
     }
 
+    qemu_mutex_unlock(&d->lock);
+
     MCPX_DPRINTF("mcpx apu: read [0x%llx] -> 0x%llx\n", addr, r);
     return r;
 }
@@ -421,6 +517,8 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
 
     MCPX_DPRINTF("mcpx apu: [0x%llx] = 0x%llx\n", addr, val);
 
+    qemu_mutex_lock(&d->lock);
+
     switch (addr) {
     case NV_PAPU_ISTS:
         /* the bits of the interrupts to clear are wrtten */
@@ -428,20 +526,15 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
         update_irq(d);
         break;
     case NV_PAPU_SECTL:
-        if (((val & NV_PAPU_SECTL_XCNTMODE) >> 3)
-              == NV_PAPU_SECTL_XCNTMODE_OFF) {
-            timer_del(d->se.frame_timer);
-        } else {
-            timer_mod(d->se.frame_timer,
-                qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 10);
-        }
         d->regs[addr] = val;
+        d->se.next_frame_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        qemu_cond_signal(&d->se.frame_cond);
         break;
     case NV_PAPU_FEMEMDATA:
         /* 'magic write'
          * This value is expected to be written to FEMEMADDR on completion of
          * something to do with notifies. Just do it now :/ */
-        stl_le_phys(&address_space_memory, d->regs[NV_PAPU_FEMEMADDR], val);
+        apu_stl(d, d->regs[NV_PAPU_FEMEMADDR], val);
         d->regs[addr] = val;
         break;
     default:
@@ -450,6 +543,8 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
         }
         break;
     }
+
+    qemu_mutex_unlock(&d->lock);
 }
 
 static const MemoryRegionOps mcpx_apu_mmio_ops = {
@@ -477,6 +572,7 @@ static void fe_method(MCPXAPUState *d,
         break;
     case NV1BA0_PIO_VOICE_ON:
         selected_handle = argument & NV1BA0_PIO_VOICE_ON_HANDLE;
+        voice_invalidate_adpcm_cache(d, selected_handle);
         list = GET_MASK(d->regs[NV_PAPU_FEAV], NV_PAPU_FEAV_LST);
         if (list != NV1BA0_PIO_SET_ANTECEDENT_VOICE_LIST_INHERIT) {
             /* voice is added to the top of the selected list */
@@ -659,7 +755,7 @@ static void fe_method(MCPXAPUState *d,
         //FIXME: Is there an upper limit for the SGE table size?
         //FIXME: NV_PAPU_VPSGEADDR is probably bad, as outbuf SGE use the same handle range (or that is also wrong)
         hwaddr sge_address = d->regs[NV_PAPU_VPSGEADDR] + d->inbuf_sge_handle * 8;
-        stl_le_phys(&address_space_memory, sge_address, argument & NV1BA0_PIO_SET_CURRENT_INBUF_SGE_OFFSET_PARAMETER);
+        apu_stl(d, sge_address, argument & NV1BA0_PIO_SET_CURRENT_INBUF_SGE_OFFSET_PARAMETER);
         MCPX_DPRINTF("Wrote inbuf SGE[0x%X] = 0x%08X\n", d->inbuf_sge_handle, argument & NV1BA0_PIO_SET_CURRENT_INBUF_SGE_OFFSET_PARAMETER);
         break;
     }
@@ -689,7 +785,7 @@ static void fe_method(MCPXAPUState *d,
         // NV_PAPU_GPFADDR   GP outbufs
         // But how does it know which outbuf is being written?!
         hwaddr sge_address = d->regs[NV_PAPU_VPSGEADDR] + d->outbuf_sge_handle * 8;
-        stl_le_phys(&address_space_memory, sge_address, argument & NV1BA0_PIO_SET_CURRENT_OUTBUF_SGE_OFFSET_PARAMETER);
+        apu_stl(d, sge_address, argument & NV1BA0_PIO_SET_CURRENT_OUTBUF_SGE_OFFSET_PARAMETER);
         MCPX_DPRINTF("Wrote outbuf SGE[0x%X] = 0x%08X\n", d->outbuf_sge_handle, argument & NV1BA0_PIO_SET_CURRENT_OUTBUF_SGE_OFFSET_PARAMETER);
         break;
     }
@@ -702,8 +798,10 @@ static void fe_method(MCPXAPUState *d,
             d->regs[NV_PAPU_FECTL] &= ~NV_PAPU_FECTL_FETRAPREASON;
             d->regs[NV_PAPU_FECTL] |= NV_PAPU_FECTL_FETRAPREASON_REQUESTED;
 
+            /* Only reached from the frame thread, which doesn't hold the
+             * BQL; the interrupt is raised once the frame is done */
             d->regs[NV_PAPU_ISTS] |= NV_PAPU_ISTS_FETINTSTS;
-            update_irq(d);
+            d->set_irq = true;
         } else {
             assert(false);
         }
@@ -765,7 +863,9 @@ static void vp_write(void *opaque, hwaddr addr,
     case NV1BA0_PIO_SET_CURRENT_OUTBUF_SGE:
     case NV1BA0_PIO_SET_CURRENT_OUTBUF_SGE_OFFSET:
         /* TODO: these should instead be queueing up fe commands */
+        qemu_mutex_lock(&d->lock);
         fe_method(d, addr, val);
+        qemu_mutex_unlock(&d->lock);
         break;
     default:
         break;
@@ -777,6 +877,171 @@ static const MemoryRegionOps vp_ops = {
     .write = vp_write,
 };
 
+static void out_wav_open(MCPXAPUState *d)
+{
+    uint8_t hdr[] = {
+        0x52, 0x49, 0x46, 0x46, 0x00, 0x00, 0x00, 0x00, 0x57, 0x41, 0x56,
+        0x45, 0x66, 0x6d, 0x74, 0x20, 0x10, 0x00, 0x00, 0x00, 0x01, 0x00,
+        0x02, 0x00, 0x80, 0xbb, 0x00, 0x00, 0x00, 0xee, 0x02, 0x00, 0x04,
+        0x00, 0x10, 0x00, 0x64, 0x61, 0x74, 0x61, 0x00, 0x00, 0x00, 0x00
+    };
+
+    d->out.wav = fopen(d->out.wav_path, "wb");
+    if (!d->out.wav) {
+        error_report("mcpx-apu: failed to open wav capture %s: %s",
+                     d->out.wav_path, strerror(errno));
+        return;
+    }
+    if (fwrite(hdr, sizeof(hdr), 1, d->out.wav) != 1) {
+        error_report("mcpx-apu: wav capture header write failed: %s",
+                     strerror(errno));
+    }
+    d->out.wav_bytes = 0;
+}
+
+static void out_wav_close(MCPXAPUState *d)
+{
+    uint8_t rlen[4];
+    uint8_t dlen[4];
+
+    if (!d->out.wav) {
+        return;
+    }
+
+    stl_le_p(rlen, d->out.wav_bytes + 36);
+    stl_le_p(dlen, d->out.wav_bytes);
+    if (fseek(d->out.wav, 4, SEEK_SET) || fwrite(rlen, 4, 1, d->out.wav) != 1
+        || fseek(d->out.wav, 40, SEEK_SET)
+        || fwrite(dlen, 4, 1, d->out.wav) != 1) {
+        error_report("mcpx-apu: wav capture finalize failed: %s",
+                     strerror(errno));
+    }
+    fclose(d->out.wav);
+    d->out.wav = NULL;
+}
+
+/* The device isn't torn down on a normal shutdown, so the header sizes are
+ * written when QEMU exits */
+static void out_wav_exit_notify(Notifier *notifier, void *data)
+{
+    MCPXAPUState *d = container_of(notifier, MCPXAPUState, out.wav_exit);
+
+    qemu_mutex_lock(&d->lock);
+    out_wav_close(d);
+    qemu_mutex_unlock(&d->lock);
+}
+
+/* Queue DSP output FIFO data for the host. The FIFO holds interleaved
+ * stereo, with 24 bit samples in 32 bit containers. */
+static void out_push_fifo_data(MCPXAPUState *d, const uint8_t *ptr, size_t len)
+{
+    unsigned int num_frames = len / 8;
+    unsigned int head = d->out.ring_head;
+    unsigned int tail = atomic_read(&d->out.ring_tail);
+    unsigned int i;
+
+    for (i = 0; i < num_frames; i++) {
+        if (head - tail >= OUT_RING_FRAMES) {
+            d->out.overruns++;
+            break;
+        }
+        int16_t *frame = d->out.ring[head & (OUT_RING_FRAMES - 1)];
+        int c;
+        for (c = 0; c < 2; c++) {
+            int32_t sample =
+                (int32_t)((uint32_t)ldl_le_p(ptr + i * 8 + c * 4) << 8);
+            frame[c] = sample >> 16;
+        }
+        if (d->out.wav) {
+            uint8_t buf[4];
+            stw_le_p(&buf[0], frame[0]);
+            stw_le_p(&buf[2], frame[1]);
+            if (fwrite(buf, sizeof(buf), 1, d->out.wav) == 1) {
+                d->out.wav_bytes += sizeof(buf);
+            }
+        }
+        head++;
+    }
+
+    /* Frames must be visible before the consumer sees the new head */
+    smp_wmb();
+    atomic_set(&d->out.ring_head, head);
+}
+
+/* The EP output is what reaches the codec. Until the EP produces output,
+ * e.g. because the title never starts it, the GP output of the frame is
+ * used instead. */
+static void out_end_frame(MCPXAPUState *d)
+{
+    if (!d->out.ep_output && d->out.gp_stage_len) {
+        out_push_fifo_data(d, d->out.gp_stage, d->out.gp_stage_len);
+    }
+    d->out.streaming = d->out.ep_output || d->out.gp_stage_len;
+    d->out.gp_stage_len = 0;
+    d->out.ep_output = false;
+}
+
+/* Linear interpolation from the ring, with the step nudged by how far the
+ * ring is from its target fill level so producer/consumer drift is
+ * absorbed without audible skips */
+static int out_resample(MCPXAPUState *d, int16_t (*buf)[2], int num_frames)
+{
+    unsigned int tail = d->out.ring_tail;
+    unsigned int available = atomic_read(&d->out.ring_head) - tail;
+    smp_rmb();
+
+    float error = ((float)available - OUT_TARGET_FRAMES) / OUT_TARGET_FRAMES;
+    float step = 1.0f + MAX(MIN(error, 1.0f), -1.0f) * OUT_MAX_RATE_ADJUST;
+    float pos = d->out.resample_pos;
+    int i;
+
+    for (i = 0; i < num_frames; i++) {
+        unsigned int index = (unsigned int)pos;
+        if (index + 1 >= available) {
+            break;
+        }
+        float frac = pos - index;
+        const int16_t *s0 = d->out.ring[(tail + index) & (OUT_RING_FRAMES - 1)];
+        const int16_t *s1 = d->out.ring[(tail + index + 1)
+                                        & (OUT_RING_FRAMES - 1)];
+        buf[i][0] = s0[0] + (s1[0] - s0[0]) * frac;
+        buf[i][1] = s0[1] + (s1[1] - s0[1]) * frac;
+        pos += step;
+    }
+
+    unsigned int consumed = MIN((unsigned int)pos, available);
+    d->out.resample_pos = pos - (unsigned int)pos;
+
+    /* Reads must complete before the producer may reuse the frames */
+    smp_mb();
+    atomic_set(&d->out.ring_tail, tail + consumed);
+
+    if (i < num_frames) {
+        d->out.underruns++;
+        memset(&buf[i], 0, (num_frames - i) * sizeof(buf[0]));
+    }
+    return num_frames;
+}
+
+static void out_audio_callback(void *opaque, int avail)
+{
+    MCPXAPUState *d = opaque;
+    int16_t buf[256][2];
+    int num_frames = avail / sizeof(buf[0]);
+
+    while (num_frames > 0) {
+        int n = out_resample(d, buf, MIN(num_frames, ARRAY_SIZE(buf)));
+        int written = AUD_write(d->out.voice, buf, n * sizeof(buf[0]));
+        if (written <= 0) {
+            break;
+        }
+        num_frames -= written / sizeof(buf[0]);
+    }
+}
+
+/* Number of SGE table entries fetched from guest memory at once */
+#define SGE_BATCH_SIZE 32
+
 static void scatter_gather_rw(MCPXAPUState *d,
                               hwaddr sge_base, unsigned int max_sge,
                               uint8_t *ptr, uint32_t addr, size_t len,
@@ -785,14 +1050,30 @@ static void scatter_gather_rw(MCPXAPUState *d,
     unsigned int page_entry = addr / TARGET_PAGE_SIZE;
     unsigned int offset_in_page = addr % TARGET_PAGE_SIZE;
     unsigned int bytes_to_copy = TARGET_PAGE_SIZE - offset_in_page;
+    uint32_t sge[SGE_BATCH_SIZE][2];
+    unsigned int num_sge = 0, sge_index = 0;
 
     while (len > 0) {
         assert(page_entry <= max_sge);
 
-        uint32_t prd_address = ldl_le_phys(&address_space_memory,
-                                           sge_base + page_entry * 8 + 0);
-        /* uint32_t prd_control = ldl_le_phys(&address_space_memory,
-                                            sge_base + page_entry * 8 + 4); */
+        /* Resolve the pages of the whole transfer in as few reads of the
+         * SGE table as possible */
+        if (sge_index == num_sge) {
+            unsigned int pages_left = DIV_ROUND_UP(offset_in_page + len,
+                                                   TARGET_PAGE_SIZE);
+            num_sge = MIN(pages_left, SGE_BATCH_SIZE);
+            if (max_sge - page_entry < num_sge) {
+                num_sge = max_sge - page_entry + 1;
+            }
+            sge_index = 0;
+            assert(sge_base + (page_entry + num_sge) * 8
+                       <= memory_region_size(d->ram));
+            memcpy(sge, &d->ram_ptr[sge_base + page_entry * 8], num_sge * 8);
+        }
+
+        uint32_t prd_address = le32_to_cpu(sge[sge_index][0]);
+        /* uint32_t prd_control = le32_to_cpu(sge[sge_index][1]); */
+        sge_index++;
 
         hwaddr paddr = prd_address + offset_in_page;
 
@@ -913,6 +1194,15 @@ static void gp_fifo_rw(void *opaque, uint8_t *ptr,
         d->regs[NV_PAPU_GPFADDR], d->regs[NV_PAPU_GPFMAXSGE],
         ptr, base, end, cur, len, dir);
 
+    if (dir && index == 0) {
+        size_t n = MIN(len, OUT_GP_STAGE_BYTES - d->out.gp_stage_len);
+        if (n < len) {
+            d->out.overruns++;
+        }
+        memcpy(&d->out.gp_stage[d->out.gp_stage_len], ptr, n);
+        d->out.gp_stage_len += n;
+    }
+
     SET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE, cur);
 }
 
@@ -952,6 +1242,11 @@ static void ep_fifo_rw(void *opaque, uint8_t *ptr,
         d->regs[NV_PAPU_EPFADDR], d->regs[NV_PAPU_EPFMAXSGE],
         ptr, base, end, cur, len, dir);
 
+    if (dir && index == 0) {
+        out_push_fifo_data(d, ptr, len);
+        d->out.ep_output = true;
+    }
+
     SET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE, cur);
 }
 
@@ -976,6 +1271,8 @@ static uint64_t gp_read(void *opaque,
     assert(size == 4);
     assert(addr % 4 == 0);
 
+    qemu_mutex_lock(&d->lock);
+
     uint64_t r = 0;
     switch (addr) {
     case NV_PAPU_GPXMEM ... NV_PAPU_GPXMEM + 0x1000 * 4 - 1: {
@@ -1002,6 +1299,9 @@ static uint64_t gp_read(void *opaque,
         r = d->gp.regs[addr];
         break;
     }
+
+    qemu_mutex_unlock(&d->lock);
+
     MCPX_DPRINTF("mcpx apu GP: read [0x%llx] -> 0x%llx\n", addr, r);
     return r;
 }
@@ -1016,6 +1316,8 @@ static void gp_write(void *opaque, hwaddr addr,
 
     MCPX_DPRINTF("mcpx apu GP: [0x%llx] = 0x%llx\n", addr, val);
 
+    qemu_mutex_lock(&d->lock);
+
     switch (addr) {
     case NV_PAPU_GPXMEM ... NV_PAPU_GPXMEM + 0x1000 * 4 - 1: {
         uint32_t xaddr = (addr - NV_PAPU_GPXMEM) / 4;
@@ -1045,6 +1347,8 @@ static void gp_write(void *opaque, hwaddr addr,
         d->gp.regs[addr] = val;
         break;
     }
+
+    qemu_mutex_unlock(&d->lock);
 }
 
 static const MemoryRegionOps gp_ops = {
@@ -1062,6 +1366,8 @@ static uint64_t ep_read(void *opaque,
     assert(size == 4);
     assert(addr % 4 == 0);
 
+    qemu_mutex_lock(&d->lock);
+
     uint64_t r = 0;
     switch (addr) {
     case NV_PAPU_EPXMEM ... NV_PAPU_EPXMEM + 0xC00 * 4 - 1: {
@@ -1083,6 +1389,9 @@ static uint64_t ep_read(void *opaque,
         r = d->ep.regs[addr];
         break;
     }
+
+    qemu_mutex_unlock(&d->lock);
+
     MCPX_DPRINTF("mcpx apu EP: read [0x%llx] -> 0x%llx\n", addr, r);
     return r;
 }
@@ -1097,6 +1406,8 @@ static void ep_write(void *opaque, hwaddr addr,
 
     MCPX_DPRINTF("mcpx apu EP: [0x%llx] = 0x%llx\n", addr, val);
 
+    qemu_mutex_lock(&d->lock);
+
     switch (addr) {
     case NV_PAPU_EPXMEM ... NV_PAPU_EPXMEM + 0xC00 * 4 - 1: {
         uint32_t xaddr = (addr - NV_PAPU_EPXMEM) / 4;
@@ -1121,6 +1432,8 @@ static void ep_write(void *opaque, hwaddr addr,
         d->ep.regs[addr] = val;
         break;
     }
+
+    qemu_mutex_unlock(&d->lock);
 }
 
 static const MemoryRegionOps ep_ops = {
@@ -1128,17 +1441,90 @@ static const MemoryRegionOps ep_ops = {
     .write = ep_write,
 };
 
-#if 0
 #include "adpcm_block.h"
 
-static hwaddr get_data_ptr(hwaddr sge_base, unsigned int max_sge, uint32_t addr) {
-    unsigned int entry = addr / TARGET_PAGE_SIZE;
-    assert(entry <= max_sge);
-    uint32_t prd_address = ldl_le_phys(&address_space_memory, sge_base + entry*4*2);
-    // uint32_t prd_control = ldl_le_phys(&address_space_memory, sge_base + entry*4*2 + 4);
-    MCPX_DPRINTF("Addr: 0x%08X, control: 0x%08X\n", prd_address, prd_control);
+/* Page of the voice SGE space currently mapped by voice_map_samples() */
+typedef struct VoiceSGEMap {
+    uint32_t page;
+    const uint8_t *ptr;
+} VoiceSGEMap;
+
+/* Return a host pointer to len bytes of sample data at addr in the voice
+ * SGE space. The SGE entry is only looked up when the voice moves to
+ * another page; data straddling pages is gathered into buf instead. */
+static const uint8_t *voice_map_samples(MCPXAPUState *d, VoiceSGEMap *map,
+                                        uint8_t *buf, uint32_t addr,
+                                        size_t len)
+{
+    uint32_t page = addr / TARGET_PAGE_SIZE;
+    uint32_t offset_in_page = addr % TARGET_PAGE_SIZE;
+
+    if (offset_in_page + len > TARGET_PAGE_SIZE) {
+        scatter_gather_rw(d, d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF,
+                          buf, addr, len, false);
+        return buf;
+    }
+
+    if (page != map->page) {
+        hwaddr prd_address = apu_ldl(d, d->regs[NV_PAPU_VPSGEADDR] + page * 8);
+        assert(prd_address + TARGET_PAGE_SIZE <= memory_region_size(d->ram));
+        map->page = page;
+        map->ptr = &d->ram_ptr[prd_address];
+    }
 
-    return prd_address + addr % TARGET_PAGE_SIZE;
+    return map->ptr + offset_in_page;
+}
+
+/* Decoded ADPCM block of a voice. Two blocks are kept per voice, so a
+ * frame straddling a block boundary doesn't evict the block it returns
+ * to on the next frame. */
+static const VoiceADPCMBlock *voice_get_adpcm_block(MCPXAPUState *d,
+                                                    unsigned int v,
+                                                    uint32_t ba,
+                                                    uint32_t block_index,
+                                                    bool stereo)
+{
+    static VoiceADPCMBlock uncached;
+    VoiceADPCMBlock *block = &uncached;
+    unsigned int block_size = stereo ? 72 : 36;
+    uint32_t data[72 / 4];
+
+    if (v < MCPX_HW_MAX_VOICES) {
+        block = &d->vp.adpcm_cache[v][block_index % 2];
+        if (block->valid && block->ba == ba
+            && block->block_index == block_index && block->stereo == stereo) {
+            return block;
+        }
+    }
+
+    scatter_gather_rw(d, d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF,
+                      (uint8_t *)data, ba + block_index * block_size,
+                      block_size, false);
+    if (stereo) {
+        adpcm_decode_stereo_block(block->samples[0], block->samples[1],
+                                  (uint8_t *)data, 0,
+                                  ADPCM_SAMPLES_PER_BLOCK - 1);
+    } else {
+        adpcm_decode_mono_block(block->samples[0], (uint8_t *)data, 0,
+                                ADPCM_SAMPLES_PER_BLOCK - 1);
+    }
+
+    block->ba = ba;
+    block->block_index = block_index;
+    block->stereo = stereo;
+    block->valid = true;
+    return block;
+}
+
+/* Fixed trip count so the compiler can vectorize the mix */
+static void mix_samples(int32_t mixbin[NUM_SAMPLES_PER_FRAME],
+                        const float samples[NUM_SAMPLES_PER_FRAME],
+                        float gain)
+{
+    int i;
+    for (i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+        mixbin[i] += (int32_t)(samples[i] * gain);
+    }
 }
 
 static float step_envelope(MCPXAPUState *d, unsigned int v, uint32_t reg_0, uint32_t reg_a, uint32_t rr_reg, uint32_t rr_mask, uint32_t lvl_reg, uint32_t lvl_mask, uint32_t count_mask, uint32_t cur_mask) {
@@ -1241,7 +1627,8 @@ static float step_envelope(MCPXAPUState *d, unsigned int v, uint32_t reg_0, uint
         count--;
         voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
         uint8_t lvl = voice_get_mask(d, v, lvl_reg, lvl_mask);
-        float value = count * lvl / (release_rate * 16);
+        //FIXME: [division by zero] Not tested on hardware
+        float value = release_rate ? count * lvl / (release_rate * 16) : 0.0f;
         if (count == 0) {
             //FIXME: What to do now?!
 #if 0 // Hack so we don't assert
@@ -1263,15 +1650,23 @@ static float step_envelope(MCPXAPUState *d, unsigned int v, uint32_t reg_0, uint
 
     return 0;
 }
-#endif
 
 static void process_voice(MCPXAPUState *d,
                           int32_t mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
                           uint32_t voice)
 {
-#if 0
     uint32_t v = voice;
-    int32_t samples[2][0x20] = {0};
+    VoiceSGEMap map = { .page = -1 };
+    float samples[2][NUM_SAMPLES_PER_FRAME] = { { 0 } };
+    uint32_t positions[NUM_SAMPLES_PER_FRAME];
+    unsigned int num_samples;
+    unsigned int i, j;
+
+    bool stream = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_DATA_TYPE);
+    if (stream) {
+        //FIXME: Stream voices are not supported yet
+        return;
+    }
 
     float ea_value = step_envelope(d, v, NV_PAVS_VOICE_CFG_ENV0, NV_PAVS_VOICE_CFG_ENVA, NV_PAVS_VOICE_TAR_LFO_ENV, NV_PAVS_VOICE_TAR_LFO_ENV_EA_RELEASERATE, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_EALVL, NV_PAVS_VOICE_CUR_ECNT_EACOUNT, NV_PAVS_VOICE_PAR_STATE_EACUR);
     float ef_value = step_envelope(d, v, NV_PAVS_VOICE_CFG_ENV1, NV_PAVS_VOICE_CFG_ENVF, NV_PAVS_VOICE_CFG_MISC, NV_PAVS_VOICE_CFG_MISC_EF_RELEASERATE, NV_PAVS_VOICE_PAR_NEXT, NV_PAVS_VOICE_PAR_NEXT_EFLVL, NV_PAVS_VOICE_CUR_ECNT_EFCOUNT, NV_PAVS_VOICE_PAR_STATE_EFCUR);
@@ -1285,9 +1680,6 @@ static void process_voice(MCPXAPUState *d,
     float rate = powf(2.0f, (p + pm * 32 * ef_value) / 4096.0f);
     MCPX_DPRINTF("Got %f\n", rate * 48000.0f);
 
-    float overdrive = 1.0f; //FIXME: This is just a hack because our APU runs too rarely
-
-    //NV_PAVS_VOICE_PAR_OFFSET_CBO
     bool stereo = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_STEREO);
     unsigned int channels = stereo ? 2 : 1;
     unsigned int sample_size = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE);
@@ -1295,11 +1687,8 @@ static void process_voice(MCPXAPUState *d,
     // B8, B16, ADPCM, B32
     unsigned int container_sizes[4] = { 1, 2, 0, 4 };
     unsigned int container_size_index = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE);
-    //FIXME: Move down, but currently debug code depends on this
     unsigned int container_size = container_sizes[container_size_index];
 
-    bool stream = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_DATA_TYPE);
-    assert(!stream);
     bool paused = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_PAUSED);
     bool loop = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_LOOP);
     uint32_t ebo = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_NEXT, NV_PAVS_VOICE_PAR_NEXT_EBO);
@@ -1313,172 +1702,142 @@ static void process_voice(MCPXAPUState *d,
     //FIXME: How will this behave if paused?
     voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_NEW_VOICE, 0);
 
-    for(unsigned int i = 0; i < 0x20; i++) {
-
-        uint32_t sample_pos = (uint32_t)(i * rate * overdrive);
+    /* Work out which source samples this frame reads before touching any
+     * sample data, so the data can be fetched in bulk */
+    for (num_samples = 0; num_samples < NUM_SAMPLES_PER_FRAME; num_samples++) {
+        uint32_t sample_pos = (uint32_t)(num_samples * rate);
 
         if ((cbo + sample_pos) > ebo) {
-          if (!loop) {
-            // Set to safe state
-            cbo = ebo; //FIXME: Will the hw do this?
-            //FIXME: Not sure if this happens.. needs a hwtest.
-            // Some RE also suggests that the voices will automaticly be removed from the list (!!!)
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE, 0);
-            break;
-          }
-          // Now go to loop start
-          //FIXME: Make sure this logic still works for very high sample_pos greater than ebo
-          cbo += sample_pos;
-          cbo %= ebo + 1;
-          cbo += lbo;
-          cbo -= sample_pos;
+            if (!loop) {
+                // Set to safe state
+                cbo = ebo; //FIXME: Will the hw do this?
+                //FIXME: Not sure if this happens.. needs a hwtest.
+                // Some RE also suggests that the voices will automaticly be removed from the list (!!!)
+                voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE, 0);
+                break;
+            }
+            // Now go to loop start
+            //FIXME: Make sure this logic still works for very high sample_pos greater than ebo
+            cbo += sample_pos;
+            cbo %= ebo + 1;
+            cbo += lbo;
+            cbo -= sample_pos;
         }
 
-        sample_pos += cbo;
-        assert(sample_pos <= ebo);
-
-        if (container_size_index == NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_ADPCM) {
-            //FIXME: Not sure how this behaves otherwise
-            assert(sample_size == NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S24);
-
-            unsigned int block_index = sample_pos / 65;
-            unsigned int block_position = sample_pos % 65;
-
-            MCPX_DPRINTF("ADPCM: %d + %d\n", block_index, block_position);
-
-            //FIXME: Remove this from the loop which collects required samples
-            //       We can always just grab one or two blocks to get all required samples
-            if (stereo) {
-                assert(samples_per_block == 2);
-                // There are 65 samples per 72 byte block
-                uint32_t block[72/4];
-                uint32_t linear_addr = ba + block_index * 72;
-                // FIXME: Only load block data which will be used
-                for(unsigned int word_index = 0; word_index < 18; word_index++) {
-                    hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF, linear_addr);
-                    block[word_index] = ldl_le_phys(&address_space_memory, addr);
-                    linear_addr += 4;
-                }
-                //FIXME: Used wrong sample format in my own decoder.. stupid me lol
-                int16_t tmp[2];
-                adpcm_decode_stereo_block(&tmp[0], &tmp[1], (uint8_t*)block, block_position, block_position);
-                samples[0][i] = tmp[0];
-                samples[1][i] = tmp[1];
-            } else {
-                assert(samples_per_block == 1);
-                // There are 65 samples per 36 byte block
-                uint32_t block[36/4];
-                uint32_t linear_addr = ba + block_index * 36;
-                for(unsigned int word_index = 0; word_index < 9; word_index++) {
-                    hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF, linear_addr);
-                    block[word_index] = ldl_le_phys(&address_space_memory, addr);
-                    linear_addr += 4;
-                }
-                //FIXME: Used wrong sample format in my own decoder.. stupid me lol
-                int16_t tmp;
-                adpcm_decode_mono_block(&tmp, (uint8_t*)block, block_position, block_position);
-                samples[0][i] = tmp;
-            }
+        positions[num_samples] = MIN(cbo + sample_pos, ebo);
+    }
 
-        } else {
-            unsigned int block_size = container_size;
-            block_size *= samples_per_block;
+    if (!paused) {
+        cbo += NUM_SAMPLES_PER_FRAME * rate;
+        voice_set_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_CBO, cbo);
+    }
+
+    if (paused || num_samples == 0) {
+        return;
+    }
+
+    if (container_size_index == NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_ADPCM) {
+        //FIXME: Not sure how this behaves otherwise
+        if (sample_size != NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S24
+            || samples_per_block != channels) {
+            return;
+        }
 
-            uint32_t linear_addr = ba + sample_pos * block_size;
-            hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF, linear_addr);
-            //FIXME: Handle reading accross pages?!
+        /* Each block is decoded once and kept until the voice leaves it */
+        const VoiceADPCMBlock *block = NULL;
+        for (i = 0; i < num_samples; i++) {
+            unsigned int block_index = positions[i] / ADPCM_SAMPLES_PER_BLOCK;
+            unsigned int block_position = positions[i] % ADPCM_SAMPLES_PER_BLOCK;
+
+            if (!block || block->block_index != block_index) {
+                block = voice_get_adpcm_block(d, v, ba, block_index, stereo);
+            }
+            for (j = 0; j < channels; j++) {
+                samples[j][i] = block->samples[j][block_position];
+            }
+        }
+    } else {
+        unsigned int block_size = container_size * samples_per_block;
 
-            MCPX_DPRINTF("Sampling from 0x%08X\n", addr);
+        for (i = 0; i < num_samples; i++) {
+            uint8_t buf[8];
+            const uint8_t *ptr = voice_map_samples(d, &map, buf,
+                ba + positions[i] * block_size, container_size * channels);
 
             // Get samples for this voice
-            for(unsigned int channel = 0; channel < channels; channel++) {
-                switch(sample_size) {
+            for (j = 0; j < channels; j++) {
+                switch (sample_size) {
                 case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_U8:
-                    samples[channel][i] = ldub_phys(&address_space_memory, addr);
+                    samples[j][i] = ldub_p(ptr);
                     break;
                 case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S16:
-                    samples[channel][i] = (int16_t)lduw_le_phys(&address_space_memory, addr);
+                    samples[j][i] = (int16_t)lduw_le_p(ptr);
                     break;
                 case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S24:
-                    samples[channel][i] = (int32_t)(ldl_le_phys(&address_space_memory, addr) << 8) >> 8;
+                    samples[j][i] = (int32_t)((uint32_t)ldl_le_p(ptr) << 8) >> 8;
                     break;
                 case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S32:
-                    samples[channel][i] = (int32_t)ldl_le_phys(&address_space_memory, addr);
+                    samples[j][i] = (int32_t)ldl_le_p(ptr);
                     break;
                 }
-             
+
                 // Advance cursor to second channel for stereo
-                addr += container_size;
+                ptr += container_size;
             }
         }
     }
 
     //FIXME: Decode voice volume and bins
+    uint32_t vbin = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, 0xFFFFFFFF);
+    uint32_t fmt = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, 0xFFFFFFFF);
+    uint32_t vola = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, 0xFFFFFFFF);
+    uint32_t volb = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, 0xFFFFFFFF);
+    uint32_t volc = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, 0xFFFFFFFF);
     int bin[8] = {
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V0BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V1BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V2BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V3BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V4BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V5BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_V6BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_V7BIN)
+      GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V0BIN),
+      GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V1BIN),
+      GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V2BIN),
+      GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V3BIN),
+      GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V4BIN),
+      GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V5BIN),
+      GET_MASK(fmt, NV_PAVS_VOICE_CFG_FMT_V6BIN),
+      GET_MASK(fmt, NV_PAVS_VOICE_CFG_FMT_V7BIN)
     };
     uint16_t vol[8] = {
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME0),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME1),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME2),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME3),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME4),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME5),
-      (voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME6_B11_8) << 8) |
-      (voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME6_B7_4) << 4) |
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME6_B3_0),
-      (voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME7_B11_8) << 8) |
-      (voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME7_B7_4) << 4) |
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME7_B3_0),
+      GET_MASK(vola, NV_PAVS_VOICE_TAR_VOLA_VOLUME0),
+      GET_MASK(vola, NV_PAVS_VOICE_TAR_VOLA_VOLUME1),
+      GET_MASK(volb, NV_PAVS_VOICE_TAR_VOLB_VOLUME2),
+      GET_MASK(volb, NV_PAVS_VOICE_TAR_VOLB_VOLUME3),
+      GET_MASK(volc, NV_PAVS_VOICE_TAR_VOLC_VOLUME4),
+      GET_MASK(volc, NV_PAVS_VOICE_TAR_VOLC_VOLUME5),
+      (GET_MASK(volc, NV_PAVS_VOICE_TAR_VOLC_VOLUME6_B11_8) << 8) |
+      (GET_MASK(volb, NV_PAVS_VOICE_TAR_VOLB_VOLUME6_B7_4) << 4) |
+      GET_MASK(vola, NV_PAVS_VOICE_TAR_VOLA_VOLUME6_B3_0),
+      (GET_MASK(volc, NV_PAVS_VOICE_TAR_VOLC_VOLUME7_B11_8) << 8) |
+      (GET_MASK(volb, NV_PAVS_VOICE_TAR_VOLB_VOLUME7_B7_4) << 4) |
+      GET_MASK(vola, NV_PAVS_VOICE_TAR_VOLA_VOLUME7_B3_0),
     };
 
-    if (paused) {
-      assert(sizeof(samples) == 0x20 * 4 * 2);
-      memset(samples, 0x00, sizeof(samples));
-    } else {
-      cbo += 0x20 * rate * overdrive;
-      voice_set_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_CBO, cbo);
-    }
-
-    // Apply the amplitude envelope
-    //FIXME: Figure out when exactly and how exactly this is actually done
-    for(unsigned int j = 0; j < channels; j++) {
-        for(unsigned int i = 0; i < 0x20; i++) {
-            samples[j][i] *= ea_value;
-        }
-    }
-
     //FIXME: If phase negations means to flip the signal upside down
     //       we should modify volume of bin6 and bin7 here.
 
-    // Mix samples into voice bins
-    for(unsigned int j = 0; j < 8; j++) {
-        MCPX_DPRINTF("Adding voice 0x%04X to bin %d [Rate %.2f, Volume 0x%03X] sample %d at %d [%.2fs]\n", v, bin[j], rate, vol[j], samples[0], cbo, cbo / (rate * 48000.0f));
-        for(unsigned int i = 0; i < 0x20; i++) {
-            //FIXME: how is the volume added?
-            //FIXME: What happens to the other channel? Is this behaviour correct?
-            mixbins[bin[j]][i] += (0xFFF - vol[j]) * samples[j % channels][i] / 0xFFF;
-        }
+    // Mix samples into voice bins, applying the amplitude envelope
+    //FIXME: Figure out when exactly and how exactly the envelope is applied
+    for (j = 0; j < 8; j++) {
+        MCPX_DPRINTF("Adding voice 0x%04X to bin %d [Rate %.2f, Volume 0x%03X] at %d\n", v, bin[j], rate, vol[j], cbo);
+        //FIXME: how is the volume added?
+        //FIXME: What happens to the other channel? Is this behaviour correct?
+        mix_samples(mixbins[bin[j]], samples[j % channels],
+                    ea_value * (0xFFF - vol[j]) / 0xFFF);
     }
-#endif
 }
 
-/* This routine must run at 1500 Hz */
-/* TODO: this should be on a thread so it waits on the voice lock */
-static void se_frame(void *opaque)
+/* This routine must run at 1500 Hz, called with the lock held */
+static void se_frame(MCPXAPUState *d)
 {
-    MCPXAPUState *d = opaque;
     int mixbin;
     int sample;
 
-    timer_mod(d->se.frame_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 10);
     MCPX_DPRINTF("mcpx frame ping\n");
 
     /* Buffer for all mixbins for this frame */
@@ -1529,27 +1888,106 @@ static void se_frame(void *opaque)
     /* Write VP results to the GP DSP MIXBUF */
     for (mixbin = 0; mixbin < NUM_MIXBINS; mixbin++) {
         for (sample = 0; sample < NUM_SAMPLES_PER_FRAME; sample++) {
-            dsp_write_memory(d->gp.dsp,
-                             'X', GP_DSP_MIXBUF_BASE + mixbin * 0x20 + sample,
-                             mixbins[mixbin][sample] & 0xFFFFFF);
+            mixbins[mixbin][sample] &= 0xFFFFFF;
         }
     }
+    dsp_write_memory_block(d->gp.dsp, 'X', GP_DSP_MIXBUF_BASE,
+                           (uint32_t *)mixbins, NUM_MIXBINS * NUM_SAMPLES_PER_FRAME);
 
     /* Kickoff DSP processing */
     if ((d->gp.regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPRST)
         && (d->gp.regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPDSPRST)) {
         dsp_start_frame(d->gp.dsp);
-
-        // hax
-        dsp_run(d->gp.dsp, 1000);
+        dsp_run(d->gp.dsp, DSP_CYCLES_PER_FRAME);
     }
     if ((d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPRST)
         && (d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPDSPRST)) {
         dsp_start_frame(d->ep.dsp);
+        dsp_run(d->ep.dsp, DSP_CYCLES_PER_FRAME);
+    }
+
+    out_end_frame(d);
+}
+
+static bool se_frames_enabled(MCPXAPUState *d)
+{
+    return GET_MASK(d->regs[NV_PAPU_SECTL], NV_PAPU_SECTL_XCNTMODE)
+               != NV_PAPU_SECTL_XCNTMODE_OFF;
+}
+
+/* Time until the next frame is due, 0 if it is due now. While output
+ * reaches the host, frames are produced as fast as the audio backend
+ * consumes them, holding the output ring at its target fill level. Without
+ * output they follow the host clock at 1500Hz. */
+static int64_t se_frame_wait_ns(MCPXAPUState *d, int64_t now)
+{
+    if (d->out.voice && d->out.streaming) {
+        unsigned int level = d->out.ring_head
+                             - atomic_read(&d->out.ring_tail);
+        if (level > OUT_TARGET_FRAMES) {
+            int64_t wait_ns = (int64_t)(level - OUT_TARGET_FRAMES)
+                              * SE_FRAME_NS / NUM_SAMPLES_PER_FRAME;
+            return MIN(wait_ns, SE_FRAME_NS);
+        }
+        d->se.next_frame_ns = now + SE_FRAME_NS;
+        return 0;
+    }
+
+    if (now - d->se.next_frame_ns > SE_FRAME_MAX_LAG_NS) {
+        d->se.next_frame_ns = now;
+    }
+    if (now < d->se.next_frame_ns) {
+        return d->se.next_frame_ns - now;
+    }
+    d->se.next_frame_ns += SE_FRAME_NS;
+    return 0;
+}
+
+static void se_vm_state_change(void *opaque, int running, RunState state)
+{
+    MCPXAPUState *d = opaque;
+
+    qemu_mutex_lock(&d->lock);
+    d->se.vm_running = running;
+    d->se.next_frame_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    qemu_cond_signal(&d->se.frame_cond);
+    qemu_mutex_unlock(&d->lock);
+}
+
+static void *se_frame_thread(void *arg)
+{
+    MCPXAPUState *d = arg;
+
+    qemu_mutex_lock(&d->lock);
+    while (!d->exiting) {
+        if (!d->se.vm_running || !se_frames_enabled(d)) {
+            qemu_cond_wait(&d->se.frame_cond, &d->lock);
+            continue;
+        }
+
+        int64_t wait_ns = se_frame_wait_ns(d,
+                              qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+        if (wait_ns > 0) {
+            qemu_mutex_unlock(&d->lock);
+            g_usleep(MAX(wait_ns / SCALE_US, 1));
+            qemu_mutex_lock(&d->lock);
+            continue;
+        }
 
-        // hax
-        // dsp_run(d->ep.dsp, 1000);
+        se_frame(d);
+
+        if (d->set_irq) {
+            qemu_mutex_unlock(&d->lock);
+            qemu_mutex_lock_iothread();
+            qemu_mutex_lock(&d->lock);
+            d->set_irq = false;
+            update_irq(d);
+            qemu_mutex_unlock_iothread();
+        }
     }
+    qemu_mutex_unlock(&d->lock);
+
+    return NULL;
 }
 
 static void mcpx_apu_realize(PCIDevice *dev, Error **errp)
@@ -1576,11 +2014,70 @@ static void mcpx_apu_realize(PCIDevice *dev, Error **errp)
     pci_register_bar(&d->dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &d->mmio);
 
 
-    d->se.frame_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, se_frame, d);
+    qemu_mutex_init(&d->lock);
+    qemu_cond_init(&d->se.frame_cond);
+
+    struct audsettings as = {
+        .freq = 48000,
+        .nchannels = 2,
+        .fmt = AUDIO_FORMAT_S16,
+        .endianness = AUDIO_HOST_ENDIANNESS,
+    };
+    AUD_register_card("mcpx-apu", &d->out.card);
+    d->out.voice = AUD_open_out(&d->out.card, NULL, "mcpx-apu.out", d,
+                                out_audio_callback, &as);
+    if (d->out.voice) {
+        AUD_set_active_out(d->out.voice, 1);
+    }
+    if (d->out.wav_path) {
+        out_wav_open(d);
+        d->out.wav_exit.notify = out_wav_exit_notify;
+        qemu_add_exit_notifier(&d->out.wav_exit);
+    }
+    object_property_add_uint64_ptr(OBJECT(d), "audio-underruns",
+                                   &d->out.underruns, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "audio-overruns",
+                                   &d->out.overruns, NULL);
+
     d->gp.dsp = dsp_init(d, gp_scratch_rw, gp_fifo_rw);
     d->ep.dsp = dsp_init(d, ep_scratch_rw, ep_fifo_rw);
+
+    d->se.vm_running = runstate_is_running();
+    d->se.vmstate = qemu_add_vm_change_state_handler(se_vm_state_change, d);
+    qemu_thread_create(&d->se.frame_thread, "mcpx.se_frame_thread",
+                       se_frame_thread, d, QEMU_THREAD_JOINABLE);
+}
+
+static void mcpx_apu_exitfn(PCIDevice *dev)
+{
+    MCPXAPUState *d = MCPX_APU_DEVICE(dev);
+
+    qemu_mutex_lock(&d->lock);
+    d->exiting = true;
+    qemu_cond_broadcast(&d->se.frame_cond);
+    qemu_mutex_unlock(&d->lock);
+    qemu_thread_join(&d->se.frame_thread);
+    qemu_del_vm_change_state_handler(d->se.vmstate);
+
+    if (d->out.voice) {
+        AUD_close_out(&d->out.card, d->out.voice);
+    }
+    AUD_remove_card(&d->out.card);
+    out_wav_close(d);
+    if (d->out.wav_exit.notify) {
+        qemu_remove_exit_notifier(&d->out.wav_exit);
+    }
+
+    dsp_destroy(d->gp.dsp);
+    dsp_destroy(d->ep.dsp);
 }
 
+static Property mcpx_apu_properties[] = {
+    /* Dumps the host output stream, before resampling */
+    DEFINE_PROP_STRING("wav-capture", MCPXAPUState, out.wav_path),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void mcpx_apu_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -1591,8 +2088,10 @@ static void mcpx_apu_class_init(ObjectClass *klass, void *data)
     k->revision = 210;
     k->class_id = PCI_CLASS_MULTIMEDIA_AUDIO;
     k->realize = mcpx_apu_realize;
+    k->exit = mcpx_apu_exitfn;
 
     dc->desc = "MCPX Audio Processing Unit";
+    dc->props = mcpx_apu_properties;
 }
 
 static const TypeInfo mcpx_apu_info = {
@@ -46,6 +46,12 @@
 struct _GloContext;
 typedef struct _GloContext GloContext;
 
+/* Select the context backend before the first context is created: NULL for
+ * the platform default, or "egl" on Linux with OpenGL display support for a
+ * headless EGL display on @rendernode (NULL to pick one). Returns false if
+ * @name isn't available. */
+bool glo_set_backend(const char *name, const char *rendernode);
+
 /* Change current context */
 void glo_set_current(GloContext *context);
 
@@ -62,5 +68,16 @@ void glo_context_destroy(GloContext *context);
 void glo_readpixels(GLenum gl_format, GLenum gl_type,
                     unsigned int bytes_per_pixel, unsigned int stride,
                     unsigned int width, unsigned int height, void *data);
- 
+
+#if !defined(__APPLE__) && !defined(_WIN32)
+/* Headless EGL contexts, used by the GLX backend when asked to or when there
+ * is no X display */
+struct _GloEGLContext;
+typedef struct _GloEGLContext GloEGLContext;
+
+GloEGLContext *glo_egl_context_create(const char *rendernode);
+void glo_egl_set_current(GloEGLContext *context);
+void glo_egl_context_destroy(GloEGLContext *context);
+#endif
+
 #endif /* GLOFFSCREEN_H_ */
@@ -35,6 +35,11 @@ struct _GloContext {
   CGLContextObj     cglContext;
 };
 
+bool glo_set_backend(const char *name, const char *rendernode)
+{
+    return name == NULL || !strcmp(name, "cgl");
+}
+
 /* Create an OpenGL context for a certain pixel format. formatflags are from 
  * the GLO_ constants */
 GloContext *glo_context_create(void)
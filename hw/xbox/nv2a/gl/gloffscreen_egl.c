@@ -0,0 +1,142 @@
+/*
+ *  Offscreen OpenGL abstraction layer - EGL (headless) specific
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu/osdep.h"
+#include "qemu/drm.h"
+#include "qemu/error-report.h"
+#include "ui/console.h"
+#include "ui/egl-helpers.h"
+
+#include "gloffscreen.h"
+
+/* Contexts render into framebuffer objects only, so they are made current
+ * without a surface. The display is opened with the EGL helpers of the UI,
+ * but kept here rather than in qemu_egl_display, which belongs to the UI: a
+ * Mesa surfaceless display, or a GBM device on a DRM render node when one is
+ * named or surfaceless isn't available. Neither needs a display server. */
+
+struct _GloEGLContext {
+    EGLContext egl_context;
+};
+
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLConfig egl_config;
+
+static bool glo_egl_init(const char *rendernode)
+{
+    struct gbm_device *gbm_dev;
+    int fd;
+
+    if (!rendernode &&
+        qemu_egl_open_dpy_surfaceless(DISPLAYGL_MODE_CORE,
+                                      &egl_display, &egl_config) == 0) {
+        goto done;
+    }
+    egl_display = EGL_NO_DISPLAY;
+
+    fd = qemu_drm_rendernode_open(rendernode);
+    if (fd == -1) {
+        error_report("gloffscreen: no drm render node available");
+        return false;
+    }
+
+    gbm_dev = gbm_create_device(fd);
+    if (!gbm_dev) {
+        error_report("gloffscreen: gbm_create_device failed");
+        close(fd);
+        return false;
+    }
+
+    if (qemu_egl_open_dpy_mesa((EGLNativeDisplayType)gbm_dev,
+                               DISPLAYGL_MODE_CORE,
+                               &egl_display, &egl_config) != 0) {
+        /* qemu_egl_open_dpy_mesa reports error */
+        egl_display = EGL_NO_DISPLAY;
+        gbm_device_destroy(gbm_dev);
+        close(fd);
+        return false;
+    }
+
+done:
+    if (!epoxy_has_egl_extension(egl_display, "EGL_KHR_surfaceless_context")) {
+        error_report("gloffscreen: EGL_KHR_surfaceless_context not supported");
+        egl_display = EGL_NO_DISPLAY;
+        return false;
+    }
+
+    printf("gloffscreen: EGL_VERSION = %s\n",
+           eglQueryString(egl_display, EGL_VERSION));
+    printf("gloffscreen: EGL_VENDOR = %s\n",
+           eglQueryString(egl_display, EGL_VENDOR));
+    return true;
+}
+
+/* Create an OpenGL context */
+GloEGLContext *glo_egl_context_create(const char *rendernode)
+{
+    static const EGLint context_attribute_list[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+
+    if (egl_display == EGL_NO_DISPLAY && !glo_egl_init(rendernode)) {
+        return NULL;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        error_report("gloffscreen: eglBindAPI failed");
+        return NULL;
+    }
+
+    GloEGLContext *context = g_new0(GloEGLContext, 1);
+    context->egl_context = eglCreateContext(egl_display, egl_config,
+                                            EGL_NO_CONTEXT,
+                                            context_attribute_list);
+    if (context->egl_context == EGL_NO_CONTEXT) {
+        error_report("gloffscreen: eglCreateContext failed");
+        g_free(context);
+        return NULL;
+    }
+    glo_egl_set_current(context);
+
+    /* Get rid of possible errors from within GL wrapper or glo */
+    while(glGetError() != GL_NO_ERROR);
+
+    return context;
+}
+
+/* Set current context */
+void glo_egl_set_current(GloEGLContext *context)
+{
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   context ? context->egl_context : EGL_NO_CONTEXT);
+}
+
+/* Destroy a previously created OpenGL context */
+void glo_egl_context_destroy(GloEGLContext *context)
+{
+    if (!context) { return; }
+    glo_egl_set_current(NULL);
+    eglDestroyContext(egl_display, context->egl_context);
+    g_free(context);
+}
@@ -22,9 +22,7 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
+#include "qemu/osdep.h"
 
 #include "gloffscreen.h"
 #include <X11/Xlib.h>
@@ -32,9 +30,27 @@
 struct _GloContext {
     GLXDrawable     glx_drawable;
     GLXContext      glx_context;
+    GloEGLContext  *egl_context;
 };
 
 static Display* x_display;
+static bool use_egl;
+static const char *egl_rendernode;
+
+bool glo_set_backend(const char *name, const char *rendernode)
+{
+    if (name == NULL || !strcmp(name, "glx")) {
+        use_egl = false;
+#ifdef CONFIG_OPENGL
+    } else if (!strcmp(name, "egl")) {
+        use_egl = true;
+#endif
+    } else {
+        return false;
+    }
+    egl_rendernode = rendernode;
+    return true;
+}
 
 
 /* Create an OpenGL context */
@@ -43,15 +59,39 @@ GloContext *glo_context_create(void)
 
     static bool initialized = false;
 
-    if (!initialized) {    
-        x_display = XOpenDisplay(0);     
+    if (!initialized && !use_egl) {
+        x_display = XOpenDisplay(0);
+#ifdef CONFIG_OPENGL
+        if (x_display == NULL) {
+            printf("gloffscreen: no X display, using EGL\n");
+            use_egl = true;
+        }
+#endif
+    }
+
+#ifdef CONFIG_OPENGL
+    if (use_egl) {
+        if (initialized) {
+            printf("gloffscreen already inited\n");
+            exit(EXIT_FAILURE);
+        }
+        GloEGLContext *egl_context = glo_egl_context_create(egl_rendernode);
+        if (egl_context == NULL) { return NULL; }
+        GloContext *context = (GloContext *)calloc(1, sizeof(GloContext));
+        context->egl_context = egl_context;
+        initialized = true;
+        return context;
+    }
+#endif
+
+    if (!initialized) {
         printf("gloffscreen: GLX_VERSION = %s\n", glXGetClientString(x_display, GLX_VERSION));
         printf("gloffscreen: GLX_VENDOR = %s\n", glXGetClientString(x_display, GLX_VENDOR));
     } else {
         printf("gloffscreen already inited\n");
         exit(EXIT_FAILURE);
     }
-    GloContext *context = (GloContext *)malloc(sizeof(GloContext));
+    GloContext *context = (GloContext *)calloc(1, sizeof(GloContext));
 
     int fb_attribute_list[] = {
         GLX_RENDER_TYPE, GLX_RGBA_BIT,
@@ -115,6 +155,12 @@ GloContext *glo_context_create(void)
 /* Set current context */
 void glo_set_current(GloContext *context)
 {
+#ifdef CONFIG_OPENGL
+    if (use_egl) {
+        glo_egl_set_current(context ? context->egl_context : NULL);
+        return;
+    }
+#endif
     if (context == NULL) {
         glXMakeCurrent(x_display, None, NULL);
     } else {
@@ -126,6 +172,13 @@ void glo_set_current(GloContext *context)
 void glo_context_destroy(GloContext *context)
 {
     if (!context) { return; }
+#ifdef CONFIG_OPENGL
+    if (context->egl_context) {
+        glo_egl_context_destroy(context->egl_context);
+        free(context);
+        return;
+    }
+#endif
     glo_set_current(NULL);
     glXDestroyContext(x_display, context->glx_context);
 }
@@ -154,6 +154,11 @@ static void glo_kill(void) {
     UnregisterClass(GLO_WINDOW_CLASS, glo.hInstance);
 }
 
+bool glo_set_backend(const char *name, const char *rendernode)
+{
+    return name == NULL || !strcmp(name, "wgl");
+}
+
 GloContext *glo_context_create(void) {
     if (!glo_inited)
       glo_init();
@@ -49,20 +49,35 @@ struct lru *lru_init(
     assert(lru != NULL);
 
     lru->active = NULL;
+    lru->tail = NULL;
     lru->free = NULL;
+    memset(lru->buckets, 0, sizeof(lru->buckets));
 
     lru->obj_init = obj_init;
     lru->obj_deinit = obj_deinit;
     lru->obj_key_compare = obj_key_compare;
 
+    lru->size = 0;
+    lru->budget = 0;
+
     lru->num_free = 0;
+    lru->num_active = 0;
     lru->num_collisions = 0;
     lru->num_hit = 0;
     lru->num_miss = 0;
+    lru->num_evictions = 0;
 
     return lru;
 }
 
+/*
+ * Set the total object size to evict down to, 0 for no limit
+ */
+void lru_set_budget(struct lru *lru, size_t budget)
+{
+    lru->budget = budget;
+}
+
 /*
  * Add a node to the free list
  */
@@ -74,96 +89,120 @@ struct lru_node *lru_add_free(struct lru *lru, struct lru_node *node)
     return node;
 }
 
+static struct lru_node **lru_bucket(struct lru *lru, uint64_t hash)
+{
+    return &lru->buckets[hash & (LRU_NUM_BUCKETS - 1)];
+}
+
+/*
+ * Unlink node from the active list
+ */
+static void lru_unlink(struct lru *lru, struct lru_node *node)
+{
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        lru->active = node->next;
+    }
+
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        lru->tail = node->prev;
+    }
+}
+
+/*
+ * Add node to the front of the active list
+ */
+static void lru_push_front(struct lru *lru, struct lru_node *node)
+{
+    node->prev = NULL;
+    node->next = lru->active;
+    if (lru->active != NULL) {
+        lru->active->prev = node;
+    } else {
+        lru->tail = node;
+    }
+    lru->active = node;
+}
+
+/*
+ * Deinit an active node and return it to the free list
+ */
+static void lru_release(struct lru *lru, struct lru_node *node)
+{
+    struct lru_node **link;
+
+    /* Remove from the bucket chain */
+    for (link = lru_bucket(lru, node->hash); *link != node;
+         link = &(*link)->bucket_next) {
+        assert(*link != NULL);
+    }
+    *link = node->bucket_next;
+
+    lru_unlink(lru, node);
+    lru->num_active--;
+    lru->size -= node->size;
+
+    lru->obj_deinit(node);
+    lru_add_free(lru, node);
+}
+
 /*
  * Lookup object in cache:
  * - If found, object is promoted to front of RU list and returned
  * - If not found,
  *   - If cache is full, evict LRU, deinit object and add it to free list
  *   - Allocate object from free list, init, move to front of RU list
+ *   - Evict LRU objects until the active objects fit the budget
  */
 struct lru_node *lru_lookup(struct lru *lru, uint64_t hash, void *key)
 {
-    struct lru_node *prev, *node;
+    struct lru_node **bucket, *node;
 
     assert(lru != NULL);
     assert((lru->active != NULL) || (lru->free != NULL));
 
-    /* Walk through the cache in order of recent use */
-    prev = NULL;
-    node = lru->active;
-
     lru_dprintf("Looking for hash %016lx...\n", hash);
 
-    if (node != NULL) {
-        do {
-            lru_dprintf("  %016lx\n", node->hash);
-
-            /* Fast hash compare */
-            if (node->hash == hash) {
-                /* Detailed key comparison */
-                if (lru->obj_key_compare(node, key) == 0) {
-                    lru_dprintf("Hit, node=%p!\n", node);
-                    lru->num_hit++;
-
-                    if (prev == NULL) {
-                        /* Node is already at the front of the RU list */
-                        return node;
-                    }
-
-                    /* Unlink and promote node */
-                    lru_dprintf("Promoting node %p\n", node);
-                    prev->next = node->next;
-                    node->next = lru->active;
-                    lru->active = node;
-                    return node;
-                }
-
-                /* Hash collision! Get a better hashing function... */
-                lru_dprintf("Hash collision detected!\n");
-                lru->num_collisions++;
-            }
+    bucket = lru_bucket(lru, hash);
+    for (node = *bucket; node != NULL; node = node->bucket_next) {
+        lru_dprintf("  %016lx\n", node->hash);
+
+        /* Fast hash compare */
+        if (node->hash != hash) {
+            continue;
+        }
+
+        /* Detailed key comparison */
+        if (lru->obj_key_compare(node, key) == 0) {
+            lru_dprintf("Hit, node=%p!\n", node);
+            lru->num_hit++;
 
-            if (node->next == NULL) {
-                /* No more nodes left to look at after this... Stop here as we
-                 * may need to evict this final (last recently used) node.
-                 */
-                break;
+            if (node != lru->active) {
+                /* Unlink and promote node */
+                lru_dprintf("Promoting node %p\n", node);
+                lru_unlink(lru, node);
+                lru_push_front(lru, node);
             }
+            return node;
+        }
 
-            prev = node;
-            node = node->next;
-        } while (1);
+        /* Hash collision! Get a better hashing function... */
+        lru_dprintf("Hash collision detected!\n");
+        lru->num_collisions++;
     }
 
     lru_dprintf("Miss\n");
     lru->num_miss++;
 
-    /* Reached the end of the active list.
-     *
-     * `node` points to:
-     * - NULL if there are no active objects in the cache, or
-     * - the last object in the RU list
-     *
-     * `prev` points to:
-     * - NULL if there are <= 1 active objects in the cache, or
-     * - the second to last object in the RU list
-     */
-
     if (lru->free == NULL) {
-        /* No free nodes left, must evict a node. `node` is LRU. */
-        assert(node != NULL); /* Sanity check: there must be an active object */
-        lru_dprintf("Evicting %p\n", node);
-
-        if (prev == NULL) {
-            /* This was the only node */
-            lru->active = NULL;
-        } else {
-            /* Unlink node */
-            prev->next = node->next;
-        }
-
-        lru->obj_deinit(node);
-        lru_add_free(lru, node);
+        /* No free nodes left, must evict the LRU node */
+        assert(lru->tail != NULL); /* Sanity check: there must be an active object */
+        lru_dprintf("Evicting %p\n", lru->tail);
+        lru->num_evictions++;
+        lru_release(lru, lru->tail);
     }
 
     /* Allocate a node from the free list */
@@ -172,11 +211,24 @@ struct lru_node *lru_lookup(struct lru *lru, uint64_t hash, void *key)
     lru->free = node->next;
     lru->num_free--;
 
-    /* Initialize, promote, and return the node */
+    /* Initialize, index, and promote the node */
+    node->size = 0;
     lru->obj_init(node, key);
     node->hash = hash;
-    node->next = lru->active;
-    lru->active = node;
+    node->bucket_next = *bucket;
+    *bucket = node;
+    lru_push_front(lru, node);
+    lru->num_active++;
+    lru->size += node->size;
+
+    /* Make room for it, keeping it even if it is over budget on its own */
+    while (lru->budget != 0 && lru->size > lru->budget
+           && lru->tail != node) {
+        lru_dprintf("Evicting %p (over budget)\n", lru->tail);
+        lru->num_evictions++;
+        lru_release(lru, lru->tail);
+    }
+
     return node;
 }
 
@@ -185,17 +237,7 @@ struct lru_node *lru_lookup(struct lru *lru, uint64_t hash, void *key)
  */
 void lru_flush(struct lru *lru)
 {
-    struct lru_node *node, *next;
-
-    node = lru->active;
-    next = NULL;
-
-    while (node != NULL) {
-        next = node->next;
-        lru->obj_deinit(node);
-        lru_add_free(lru, node);
-        node = next;
+    while (lru->active != NULL) {
+        lru_release(lru, lru->active);
     }
-
-    lru->active = NULL;
 }
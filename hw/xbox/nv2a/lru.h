@@ -4,15 +4,21 @@
  * - Designed for pre-allocated array of objects which are accessed frequently
  * - Objects are identified by a hash and an opaque `key` data structure
  * - Lookups are first done by hash, then confirmed by callback compare function
- * - Two singly linked lists are maintained: a free list and an active list
+ * - Objects are indexed by a hash table of singly linked bucket chains, so
+ *   lookup, promotion and eviction take constant time
+ * - A free list and a doubly linked active list (most recently used first)
+ *   are maintained
  * - On cache miss, object is created from free list or by evicting the LRU
  * - When created, a callback function is called to fully initialize the object
+ * - Objects may report their size, in which case the LRU is also evicted until
+ *   the total size of the active objects fits in an optional budget
  *
  * Setup
  * -----
  * - Create an object data structure, embed in it `struct lru_node`
  * - Create an init, deinit, and compare function
  * - Call `lru_init`
+ * - Optionally call `lru_set_budget`
  * - Allocate a number of these objects
  * - For each object, call `lru_add_free` to populate entries in the cache
  *
@@ -21,16 +27,18 @@
  * - Initialize custom key data structure (will be used for comparison)
  * - Create 64b hash of the object and/or key
  * - Call `lru_lookup` with the hash and key
- *   - The active list is searched, the compare callback will be called if an
- *     object with matching hash is found
+ *   - The bucket of the hash is searched, the compare callback will be called
+ *     if an object with matching hash is found
  *   - If object is found in the cache, it will be moved to the front of the
  *     active list and returned
  *   - If object is not found in the cache:
  *     - If no free items are available, the LRU will be evicted, deinit
  *       callback will be called
  *     - An object is popped from the free list and the init callback is called
- *       on the object
- *     - The object is added to the front of the active list and returned
+ *       on the object, which may set `size` in its node
+ *     - The object is added to the front of the active list
+ *     - While over budget, the LRU is evicted (never the new object)
+ *     - The object is returned
  *
  * ---
  *
@@ -61,6 +69,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#define LRU_NUM_BUCKETS 1024 /* Must be a power of two */
+
 struct lru_node;
 
 typedef struct lru_node *(*lru_obj_init_func)(struct lru_node *obj, void *key);
@@ -68,23 +78,35 @@ typedef struct lru_node *(*lru_obj_deinit_func)(struct lru_node *obj);
 typedef int              (*lru_obj_key_compare_func)(struct lru_node *obj, void *key);
 
 struct lru {
-	struct lru_node *active; /* Singly-linked list tracking recently active */
+	struct lru_node *active; /* Doubly-linked list, most recently used first */
+	struct lru_node *tail;   /* Least recently used active object */
 	struct lru_node *free;   /* Singly-linked list tracking available objects */
+	struct lru_node *buckets[LRU_NUM_BUCKETS];
 
 	lru_obj_init_func         obj_init;
 	lru_obj_deinit_func       obj_deinit;
 	lru_obj_key_compare_func  obj_key_compare;
 
+	size_t size;   /* Total size of the active objects */
+	size_t budget; /* Evict down to this size, 0 for no limit */
+
 	size_t num_free;
-	size_t num_collisions;
-	size_t num_hit;
-	size_t num_miss;
+	size_t num_active;
+
+	/* Statistics */
+	uint64_t num_collisions;
+	uint64_t num_hit;
+	uint64_t num_miss;
+	uint64_t num_evictions;
 };
 
 /* This should be embedded in the object structure */
 struct lru_node {
 	uint64_t hash;
-	struct lru_node *next;
+	size_t size;                   /* Set by obj_init, 0 if unknown */
+	struct lru_node *next;         /* Active or free list */
+	struct lru_node *prev;         /* Active list */
+	struct lru_node *bucket_next;  /* Hash bucket chain */
 };
 
 struct lru *lru_init(
@@ -94,6 +116,7 @@ struct lru *lru_init(
 	lru_obj_key_compare_func obj_key_compare
 	);
 
+void lru_set_budget(struct lru *lru, size_t budget);
 struct lru_node *lru_add_free(struct lru *lru, struct lru_node *node);
 struct lru_node *lru_lookup(struct lru *lru, uint64_t hash, void *key);
 void lru_flush(struct lru *lru);
@@ -24,6 +24,9 @@
 #include "qemu/osdep.h"
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "qemu/host-utils.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 
@@ -35,6 +38,7 @@
 #include "cpu.h"
 
 #include "swizzle.h"
+#include "s3tc.h"
 
 #include "hw/xbox/nv2a/nv2a_int.h"
 
@@ -99,21 +103,139 @@ static void update_irq(NV2AState *d)
     }
 }
 
+/* True while PFIFO has work left that a polling guest may be waiting on */
+static bool pfifo_busy(NV2AState *d)
+{
+    return atomic_read(&d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET])
+               != atomic_read(&d->pfifo.regs[NV_PFIFO_CACHE1_DMA_PUT])
+           || !(atomic_read(&d->pfifo.regs[NV_PFIFO_CACHE1_STATUS])
+                & NV_PFIFO_CACHE1_STATUS_LOW_MARK)
+           || atomic_read(&d->pgraph.queue.head)
+               != atomic_read(&d->pgraph.queue.tail);
+}
+
+/* Wake a vCPU sleeping in nv2a_spin_wait() */
+static void nv2a_spin_kick(NV2AState *d)
+{
+    if (atomic_xchg(&d->spin.waiting, false)) {
+        qemu_sem_post(&d->spin.progress);
+    }
+}
+
+/* Run from the vCPU loop with the BQL held, outside any MMIO dispatch, so
+ * the BQL can be dropped while sleeping: the puller may need it to make
+ * the progress we wait for. */
+static void nv2a_spin_wait(CPUState *cpu, run_on_cpu_data data)
+{
+    NV2AState *d = data.host_ptr;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    qemu_mutex_unlock_iothread();
+
+    atomic_set(&d->spin.waiting, true);
+    if (pfifo_busy(d)) {
+        qemu_sem_timedwait(&d->spin.progress, NV2A_SPIN_WAIT_MS);
+    }
+    atomic_set(&d->spin.waiting, false);
+
+    qemu_mutex_lock_iothread();
+
+    d->spin.wait_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    atomic_set(&d->spin.wait_queued, false);
+}
+
+/* Called for guest reads of registers commonly polled while waiting for
+ * the GPU. Once the guest has read the same value often enough in a row,
+ * each further read kicks the vCPU out of the translated code and puts it
+ * to sleep in nv2a_spin_wait() until PFIFO makes progress or a short
+ * timeout expires, instead of letting it spin. The read itself returns
+ * right away, so the value is never stale. Must be called without
+ * pfifo.lock held. */
+static void nv2a_spin_check(NV2AState *d, NV2APollState *s,
+                            hwaddr addr, uint64_t value)
+{
+    if (addr != s->addr || value != s->value || !pfifo_busy(d)) {
+        s->addr = addr;
+        s->value = value;
+        s->count = 0;
+        return;
+    }
+
+    if (s->count < NV2A_SPIN_THRESHOLD) {
+        s->count++;
+        if (s->count < NV2A_SPIN_THRESHOLD) {
+            return;
+        }
+        d->spin.loops++;
+    }
+
+    if (current_cpu && !atomic_xchg(&d->spin.wait_queued, true)) {
+        async_run_on_cpu(current_cpu, nv2a_spin_wait, RUN_ON_CPU_HOST_PTR(d));
+    }
+}
+
+/* Drop everything cached from the RAMIN page containing address if the
+ * guest wrote to it. Called with ramin_cache.lock held. */
+static void ramin_cache_check_page(NV2AState *d, hwaddr address)
+{
+    hwaddr page = address & TARGET_PAGE_MASK;
+    int i;
+
+    if (!memory_region_get_dirty(&d->ramin, page, TARGET_PAGE_SIZE,
+                                 DIRTY_MEMORY_NV2A)) {
+        return;
+    }
+    if (!memory_region_test_and_clear_dirty(&d->ramin, page, TARGET_PAGE_SIZE,
+                                            DIRTY_MEMORY_NV2A)) {
+        return;
+    }
+
+    for (i = 0; i < NV2A_RAMIN_CACHE_SIZE; i++) {
+        if ((d->ramin_cache.ramht[i].address & TARGET_PAGE_MASK) == page) {
+            d->ramin_cache.ramht[i].valid = false;
+        }
+        if ((d->ramin_cache.dma[i].address & TARGET_PAGE_MASK) == page) {
+            d->ramin_cache.dma[i].valid = false;
+        }
+    }
+}
+
 static DMAObject nv_dma_load(NV2AState *d, hwaddr dma_obj_address)
 {
     assert(dma_obj_address < memory_region_size(&d->ramin));
 
+    DMAObjectCacheEntry *cached =
+        &d->ramin_cache.dma[(dma_obj_address >> 4) % NV2A_RAMIN_CACHE_SIZE];
+    DMAObject dma;
+
+    qemu_mutex_lock(&d->ramin_cache.lock);
+
+    ramin_cache_check_page(d, dma_obj_address);
+    if (cached->valid && cached->address == dma_obj_address) {
+        dma = cached->dma;
+        qemu_mutex_unlock(&d->ramin_cache.lock);
+        return dma;
+    }
+
     uint32_t *dma_obj = (uint32_t *)(d->ramin_ptr + dma_obj_address);
     uint32_t flags = ldl_le_p(dma_obj);
     uint32_t limit = ldl_le_p(dma_obj + 1);
     uint32_t frame = ldl_le_p(dma_obj + 2);
 
-    return (DMAObject){
+    dma = (DMAObject){
         .dma_class  = GET_MASK(flags, NV_DMA_CLASS),
         .dma_target = GET_MASK(flags, NV_DMA_TARGET),
         .address    = (frame & NV_DMA_ADDRESS) | GET_MASK(flags, NV_DMA_ADJUST),
         .limit      = limit,
     };
+
+    cached->valid = true;
+    cached->address = dma_obj_address;
+    cached->dma = dma;
+
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+
+    return dma;
 }
 
 static void *nv_dma_map(NV2AState *d, hwaddr dma_obj_address, hwaddr *len)
@@ -406,7 +528,12 @@ static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
     d->vram_ptr = memory_region_get_ram_ptr(d->vram);
     d->ramin_ptr = memory_region_get_ram_ptr(&d->ramin);
 
+    /* guest writes to RAMIN invalidate the decoded object caches */
+    memory_region_set_log(&d->ramin, true, DIRTY_MEMORY_NV2A);
+    memory_region_set_dirty(&d->ramin, 0, memory_region_size(&d->ramin));
+
     memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A);
+    memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_VERTEX);
     memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
 
     /* hacky. swap out vga's vram */
@@ -419,6 +546,11 @@ static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
 
     pgraph_init(d);
 
+    /* fire up pgraph */
+    qemu_thread_create(&d->pgraph.render_thread, "nv2a.render_thread",
+                       pgraph_render_thread,
+                       d, QEMU_THREAD_JOINABLE);
+
     /* fire up puller */
     qemu_thread_create(&d->pfifo.puller_thread, "nv2a.puller_thread",
                        pfifo_puller_thread,
@@ -437,6 +569,12 @@ static void nv2a_realize(PCIDevice *dev, Error **errp)
 
     d = NV2A_DEVICE(dev);
 
+    if (!glo_set_backend(d->pgraph.gl_backend, d->pgraph.gl_rendernode)) {
+        error_setg(errp, "nv2a: gl-backend '%s' is not available",
+                   d->pgraph.gl_backend);
+        return;
+    }
+
     /* setting subsystem ids again, see comment in nv2a_class_init() */
     pci_set_word(dev->config + PCI_SUBSYSTEM_VENDOR_ID, 0);
     pci_set_word(dev->config + PCI_SUBSYSTEM_ID, 0);
@@ -479,6 +617,40 @@ static void nv2a_realize(PCIDevice *dev, Error **errp)
                                     &d->block_mmio[i]);
     }
 
+    qemu_mutex_init(&d->ramin_cache.lock);
+
+    qemu_sem_init(&d->spin.progress, 0);
+    object_property_add_uint64_ptr(OBJECT(d), "spin-loops",
+                                   &d->spin.loops, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "spin-wait-ns",
+                                   &d->spin.wait_ns, NULL);
+
+    object_property_add_uint64_ptr(OBJECT(d), "texture-cache-hits",
+                                   &d->pgraph.texture_cache.num_hit, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "texture-cache-misses",
+                                   &d->pgraph.texture_cache.num_miss, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "texture-cache-collisions",
+                                   &d->pgraph.texture_cache.num_collisions,
+                                   NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "texture-cache-evictions",
+                                   &d->pgraph.texture_cache.num_evictions,
+                                   NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "surface-uploads-elided",
+                                   &d->pgraph.surface_uploads_elided, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "palette-uploads",
+                                   &d->pgraph.palette_uploads, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "texture-decode-ns",
+                                   &d->pgraph.texture_decode_ns, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "texture-upload-ns",
+                                   &d->pgraph.texture_upload_ns, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "memory-buffer-upload-bytes",
+                                   &d->pgraph.memory_buffer_upload_bytes,
+                                   NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "memory-buffer-frame-bytes",
+                                   &d->pgraph.memory_buffer_frame_bytes, NULL);
+    object_property_add_uint64_ptr(OBJECT(d), "pgraph-queue-full-waits",
+                                   &d->pgraph.queue.full_waits, NULL);
+
     qemu_mutex_init(&d->pfifo.lock);
     qemu_cond_init(&d->pfifo.puller_cond);
     qemu_cond_init(&d->pfifo.pusher_cond);
@@ -495,12 +667,27 @@ static void nv2a_exitfn(PCIDevice *dev)
 
     qemu_cond_broadcast(&d->pfifo.puller_cond);
     qemu_cond_broadcast(&d->pfifo.pusher_cond);
+    qemu_event_set(&d->pgraph.queue.not_full);
+    qemu_event_set(&d->pgraph.queue.not_empty);
     qemu_thread_join(&d->pfifo.puller_thread);
     qemu_thread_join(&d->pfifo.pusher_thread);
+    qemu_thread_join(&d->pgraph.render_thread);
+
+    qemu_sem_destroy(&d->spin.progress);
 
     pgraph_destroy(&d->pgraph);
 }
 
+static Property nv2a_properties[] = {
+    DEFINE_PROP_UINT32("texture-cache-mb", NV2AState,
+                       pgraph.texture_cache_mb, 256),
+    DEFINE_PROP_UINT32("texture-decode-threads", NV2AState,
+                       pgraph.texture_workers.num_threads, 4),
+    DEFINE_PROP_STRING("gl-backend", NV2AState, pgraph.gl_backend),
+    DEFINE_PROP_STRING("gl-rendernode", NV2AState, pgraph.gl_rendernode),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void nv2a_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -519,6 +706,7 @@ static void nv2a_class_init(ObjectClass *klass, void *data)
     k->exit      = nv2a_exitfn;
 
     dc->desc = "GeForce NV2A Integrated Graphics";
+    dc->props = nv2a_properties;
 }
 
 static const TypeInfo nv2a_info = {
@@ -71,6 +71,44 @@ typedef struct DMAObject {
     hwaddr limit;
 } DMAObject;
 
+typedef struct RAMHTEntry {
+    uint32_t handle;
+    hwaddr instance;
+    enum FIFOEngine engine;
+    unsigned int channel_id : 5;
+    bool valid;
+} RAMHTEntry;
+
+/* Number of entries in each of the direct-mapped RAMIN object caches */
+#define NV2A_RAMIN_CACHE_SIZE 64
+
+typedef struct RAMHTCacheEntry {
+    bool valid;
+    uint32_t handle;
+    uint32_t ramht; /* NV_PFIFO_RAMHT at the time of the lookup */
+    unsigned int channel_id;
+    hwaddr address; /* of the entry in RAMIN */
+    RAMHTEntry entry;
+} RAMHTCacheEntry;
+
+/* Consecutive reads of a register without the value changing, after
+ * which the guest is considered to be spinning on it */
+#define NV2A_SPIN_THRESHOLD 64
+/* Longest a spinning vCPU is put to sleep for per read */
+#define NV2A_SPIN_WAIT_MS 1
+
+typedef struct NV2APollState {
+    hwaddr addr;
+    uint64_t value;
+    unsigned int count;
+} NV2APollState;
+
+typedef struct DMAObjectCacheEntry {
+    bool valid;
+    hwaddr address;
+    DMAObject dma;
+} DMAObjectCacheEntry;
+
 typedef struct VertexAttribute {
     bool dma_select;
     hwaddr offset;
@@ -106,6 +144,7 @@ typedef struct Surface {
     bool draw_dirty;
     bool buffer_dirty;
     bool write_enabled_cache;
+    bool clear_pending; /* a full clear follows, see NV097_CLEAR_SURFACE */
     unsigned int pitch;
 
     hwaddr offset;
@@ -123,6 +162,7 @@ typedef struct SurfaceShape {
 
 typedef struct TextureShape {
     bool cubemap;
+    enum PshTexDecode decode;
     unsigned int dimensionality;
     unsigned int color_format;
     unsigned int levels;
@@ -140,12 +180,100 @@ typedef struct TextureBinding {
 
 typedef struct TextureKey {
     struct lru_node node;
+    struct PGRAPHState *pg;
     TextureShape state;
     uint8_t *texture_data;
     uint8_t *palette_data;
     TextureBinding *binding;
 } TextureKey;
 
+/* Sampling state of a texture unit, shared by every texture sampled with
+ * it. Only GL enums and the border color, so it hashes without padding. */
+typedef struct SamplerKey {
+    GLenum min_filter;
+    GLenum mag_filter;
+    GLenum wrap_s, wrap_t, wrap_r;
+    uint32_t border_color;
+} SamplerKey;
+
+/* Most jobs a texture upload is split into: 6 faces of up to 16 levels */
+#define NV2A_TEXTURE_MAX_UPLOAD_JOBS (6 * 16)
+/* Smaller textures are prepared on the puller thread alone */
+#define NV2A_TEXTURE_WORKER_MIN_SIZE (64 * 1024)
+
+/* One mip level of one face, unswizzled and converted into the staging
+ * buffer by a texture worker, then copied to the texture by the puller */
+typedef struct TextureUploadJob {
+    GLenum gl_target;
+    int level;
+    unsigned int width, height, depth;
+    unsigned int row_length; /* GL_UNPACK_ROW_LENGTH, 0 if tightly packed */
+    const uint8_t *src;
+    size_t offset, size; /* Location in the staging buffer */
+} TextureUploadJob;
+
+typedef struct TextureWorkers {
+    uint32_t num_threads;
+    QemuThread *threads;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    bool exiting;
+
+    /* Batch being prepared */
+    const TextureShape *shape;
+    const uint8_t *palette_data;
+    const TextureUploadJob *jobs;
+    uint8_t *staging;
+    unsigned int num_jobs, next_job, jobs_done;
+} TextureWorkers;
+
+/* Methods pulled from CACHE1, waiting for the render thread */
+#define NV2A_PGRAPH_QUEUE_SIZE 4096
+/* Most methods run per acquisition of the PGRAPH lock */
+#define NV2A_PGRAPH_QUEUE_BATCH 64
+
+/* A method with its object handle already looked up in RAMHT */
+typedef struct PGRAPHCommand {
+    unsigned int subchannel;
+    unsigned int method; /* 0 binds an object of channel_id */
+    uint32_t parameter;
+    unsigned int channel_id;
+} PGRAPHCommand;
+
+/* What the puller resolves for a NV097_SET_BEGIN_END while decoding, so the
+ * render thread doesn't have to derive it from the registers again */
+typedef struct PGRAPHDrawPacket {
+    /* Begin: changes whenever a method that can reach ShaderState is
+     * decoded, and with the primitive mode */
+    uint64_t shader_key;
+    /* Begin: hash of the methods that define each texture stage */
+    uint64_t texture_keys[NV2A_MAX_TEXTURES];
+    /* End: vertex indices used by DRAW_ARRAYS and ARRAY_ELEMENT */
+    uint32_t min_index, max_index;
+} PGRAPHDrawPacket;
+
+/* Method state tracked by the puller to build draw packets */
+typedef struct PGRAPHDecodeState {
+    uint64_t shader_generation;
+    uint32_t shader_stage_program;
+    uint32_t texture_methods[NV2A_MAX_TEXTURES][16];
+    uint32_t min_index, max_index;
+} PGRAPHDecodeState;
+
+/* Single producer (the puller), single consumer (the render thread) */
+typedef struct PGRAPHCommandQueue {
+    PGRAPHCommand entries[NV2A_PGRAPH_QUEUE_SIZE];
+    /* Only filled in for NV097_SET_BEGIN_END */
+    PGRAPHDrawPacket draws[NV2A_PGRAPH_QUEUE_SIZE];
+    PGRAPHDecodeState decode; /* Only used by the puller */
+    unsigned int head; /* Next to run, only written by the render thread */
+    unsigned int tail; /* Next free, only written by the puller */
+    QemuEvent not_empty;
+    QemuEvent not_full;
+    uint64_t full_waits;
+} PGRAPHCommandQueue;
+
 typedef struct KelvinState {
     hwaddr object_instance;
 } KelvinState;
@@ -171,6 +299,10 @@ typedef struct ImageBlitState {
 typedef struct PGRAPHState {
     QemuMutex lock;
 
+    /* Owns the GL context and runs the methods queued by the puller */
+    QemuThread render_thread;
+    PGRAPHCommandQueue queue;
+
     uint32_t pending_interrupts;
     uint32_t enabled_interrupts;
     QemuCond interrupt_cond;
@@ -185,6 +317,7 @@ typedef struct PGRAPHState {
 
     hwaddr dma_color, dma_zeta;
     Surface surface_color, surface_zeta;
+    uint64_t surface_uploads_elided;
     unsigned int surface_type;
     SurfaceShape surface_shape;
     SurfaceShape last_surface_shape;
@@ -192,17 +325,42 @@ typedef struct PGRAPHState {
     hwaddr dma_a, dma_b;
     struct lru texture_cache;
     struct TextureKey *texture_cache_entries;
+    uint32_t texture_cache_mb; /* Host memory budget, 0 for no limit */
+    TextureWorkers texture_workers;
+    GLuint gl_texture_pbo;
+    size_t texture_pbo_size;
+    uint64_t texture_decode_ns;
+    uint64_t texture_upload_ns;
+    bool texture_storage; /* ARB_texture_storage */
+    GHashTable *sampler_cache;
+    GLuint texture_sampler[NV2A_MAX_TEXTURES];
     bool texture_dirty[NV2A_MAX_TEXTURES];
     TextureBinding *texture_binding[NV2A_MAX_TEXTURES];
+    enum PshTexDecode texture_decode[NV2A_MAX_TEXTURES];
+    GLuint gl_palette_texture[NV2A_MAX_TEXTURES];
+    uint64_t palette_hash[NV2A_MAX_TEXTURES];
+    uint64_t palette_uploads;
 
     GHashTable *shader_cache;
     ShaderBinding *shader_binding;
+    unsigned int shader_window_clip_count;
+
+    /* Packet of the NV097_SET_BEGIN_END being run, NULL for other methods */
+    const PGRAPHDrawPacket *draw_packet;
+    /* Keys of the last packet the shader and each texture stage were bound
+     * from. Dropped on any register write, which can bypass the methods. */
+    bool shader_key_valid;
+    uint64_t shader_key;
+    bool texture_key_valid[NV2A_MAX_TEXTURES];
+    uint64_t texture_key[NV2A_MAX_TEXTURES];
 
     bool texture_matrix_enable[NV2A_MAX_TEXTURES];
 
     /* FIXME: Move to NV_PGRAPH_BUMPMAT... */
     float bump_env_matrix[NV2A_MAX_TEXTURES - 1][4]; /* 3 allowed stages with 2x2 matrix each */
 
+    char *gl_backend;    /* gloffscreen backend, NULL for the default */
+    char *gl_rendernode; /* DRM render node for the EGL backend */
     GloContext *gl_context;
     GLuint gl_framebuffer;
     GLuint gl_color_buffer, gl_zeta_buffer;
@@ -255,15 +413,29 @@ typedef struct PGRAPHState {
     unsigned int inline_buffer_length;
 
     unsigned int draw_arrays_length;
-    unsigned int draw_arrays_max_count;
     /* FIXME: Unknown size, possibly endless, 1000 will do for now */
     GLint gl_draw_arrays_start[1000];
     GLsizei gl_draw_arrays_count[1000];
 
     GLuint gl_element_buffer;
+
+    /* Triangle indices for filled quads [0] and quad strips [1] */
+    GLuint gl_quad_index_buffer[2];
+    unsigned int quad_index_buffer_vertices[2];
+    uint32_t *quad_elements;
+    unsigned int quad_elements_size;
     GLuint gl_memory_buffer;
+    uint64_t memory_buffer_upload_bytes;
+    uint64_t memory_buffer_frame_start; /* upload_bytes at the last flip */
+    uint64_t memory_buffer_frame_bytes; /* Uploaded during the last frame */
     GLuint gl_vertex_array;
 
+    /* VRAM pages written by the CPU in the current epoch, and in the
+     * previous one since they were last uploaded */
+    unsigned long *vram_epoch_dirty;
+    unsigned long *vram_epoch_carry;
+    hwaddr vram_epoch_start, vram_epoch_end;
+
     uint32_t regs[0x2000];
 } PGRAPHState;
 
@@ -282,6 +454,14 @@ typedef struct NV2AState {
     MemoryRegion ramin;
     uint8_t *ramin_ptr;
 
+    /* Objects decoded from RAMIN. Entries are dropped once the guest
+     * writes to the page they were read from. */
+    struct {
+        QemuMutex lock;
+        RAMHTCacheEntry ramht[NV2A_RAMIN_CACHE_SIZE];
+        DMAObjectCacheEntry dma[NV2A_RAMIN_CACHE_SIZE];
+    } ramin_cache;
+
     MemoryRegion mmio;
     MemoryRegion block_mmio[NV_NUM_BLOCKS];
 
@@ -305,6 +485,17 @@ typedef struct NV2AState {
         uint32_t regs[0x1000];
     } pvideo;
 
+    /* Guest busy-waiting on the GPU */
+    struct {
+        NV2APollState user;
+        NV2APollState ptimer;
+        bool wait_queued;
+        bool waiting;
+        QemuSemaphore progress;
+        uint64_t loops;
+        uint64_t wait_ns;
+    } spin;
+
     struct {
         uint32_t pending_interrupts;
         uint32_t enabled_interrupts;
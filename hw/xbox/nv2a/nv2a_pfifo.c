@@ -19,15 +19,10 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
-typedef struct RAMHTEntry {
-    uint32_t handle;
-    hwaddr instance;
-    enum FIFOEngine engine;
-    unsigned int channel_id : 5;
-    bool valid;
-} RAMHTEntry;
-
 static void pfifo_run_pusher(NV2AState *d);
+static void pfifo_queue_method(NV2AState *d, unsigned int subchannel, unsigned int method, uint32_t parameter, unsigned int channel_id);
+static void pfifo_decode_method(PGRAPHDecodeState *s, unsigned int method, uint32_t parameter, PGRAPHDrawPacket *draw);
+static bool pfifo_method_reaches_shader(unsigned int method);
 static uint32_t ramht_hash(NV2AState *d, uint32_t handle);
 static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle);
 
@@ -49,6 +44,14 @@ uint64_t pfifo_read(void *opaque, hwaddr addr, unsigned int size)
     case NV_PFIFO_RUNOUT_STATUS:
         r = NV_PFIFO_RUNOUT_STATUS_LOW_MARK; /* low mark empty */
         break;
+    case NV_PFIFO_CACHE1_STATUS:
+        r = d->pfifo.regs[addr];
+        /* Methods pulled but not yet run by PGRAPH still count */
+        if (atomic_read(&d->pgraph.queue.head)
+                != atomic_read(&d->pgraph.queue.tail)) {
+            r &= ~NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+        }
+        break;
     default:
         r = d->pfifo.regs[addr];
         break;
@@ -153,19 +156,8 @@ static void pfifo_run_puller(NV2AState *d)
             SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, entry.engine);
             // NV2A_DPRINTF("engine_reg1 %d 0x%x\n", subchannel, *engine_reg);
 
-
-            // TODO: this is fucked
-            qemu_mutex_lock(&d->pgraph.lock);
-            //make pgraph busy
-            qemu_mutex_unlock(&d->pfifo.lock);
-
-            pgraph_context_switch(d, entry.channel_id);
-            pgraph_wait_fifo_access(d);
-            pgraph_method(d, subchannel, 0, entry.instance);
-
-            // make pgraph not busy
-            qemu_mutex_unlock(&d->pgraph.lock);
-            qemu_mutex_lock(&d->pfifo.lock);
+            pfifo_queue_method(d, subchannel, 0, entry.instance,
+                               entry.channel_id);
 
         } else if (method >= 0x100) {
             // method passed to engine
@@ -186,21 +178,13 @@ static void pfifo_run_puller(NV2AState *d)
             assert(engine == ENGINE_GRAPHICS);
             SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, engine);
 
-            // TODO: this is fucked
-            qemu_mutex_lock(&d->pgraph.lock);
-            //make pgraph busy
-            qemu_mutex_unlock(&d->pfifo.lock);
-
-            pgraph_wait_fifo_access(d);
-            pgraph_method(d, subchannel, method, parameter);
-
-            // make pgraph not busy
-            qemu_mutex_unlock(&d->pgraph.lock);
-            qemu_mutex_lock(&d->pfifo.lock);
+            pfifo_queue_method(d, subchannel, method, parameter, 0);
         } else {
             assert(false);
         }
 
+        nv2a_spin_kick(d);
+
     }
 }
 
@@ -208,8 +192,6 @@ static void* pfifo_puller_thread(void *arg)
 {
     NV2AState *d = (NV2AState *)arg;
 
-    glo_set_current(d->pgraph.gl_context);
-
     qemu_mutex_lock(&d->pfifo.lock);
     while (true) {
         pfifo_run_puller(d);
@@ -224,6 +206,287 @@ static void* pfifo_puller_thread(void *arg)
     return NULL;
 }
 
+/* The puller only decodes methods: it resolves object handles and hands
+ * the methods to the render thread, which owns the GL context. It keeps
+ * draining CACHE1, so the pusher keeps parsing the push buffer, while PGRAPH
+ * waits on the driver, and only stops when the queue is full. Everything
+ * that makes PGRAPH visible to the guest (interrupts, semaphores, reports
+ * and surface readbacks) happens on the render thread in method order.
+ *
+ * Called with pfifo.lock held, which is dropped while the queue is full. */
+static void pfifo_queue_method(NV2AState *d, unsigned int subchannel,
+                               unsigned int method, uint32_t parameter,
+                               unsigned int channel_id)
+{
+    PGRAPHCommandQueue *q = &d->pgraph.queue;
+    unsigned int tail = q->tail;
+
+    while (tail - atomic_load_acquire(&q->head) == NV2A_PGRAPH_QUEUE_SIZE) {
+        if (d->exiting) {
+            return;
+        }
+        qemu_event_reset(&q->not_full);
+        if (tail - atomic_load_acquire(&q->head) == NV2A_PGRAPH_QUEUE_SIZE) {
+            q->full_waits++;
+            qemu_mutex_unlock(&d->pfifo.lock);
+            qemu_event_wait(&q->not_full);
+            qemu_mutex_lock(&d->pfifo.lock);
+        }
+    }
+
+    q->entries[tail % NV2A_PGRAPH_QUEUE_SIZE] = (PGRAPHCommand) {
+        .subchannel = subchannel,
+        .method = method,
+        .parameter = parameter,
+        .channel_id = channel_id,
+    };
+    pfifo_decode_method(&q->decode, method, parameter,
+                        &q->draws[tail % NV2A_PGRAPH_QUEUE_SIZE]);
+    atomic_store_release(&q->tail, tail + 1);
+    qemu_event_set(&q->not_empty);
+}
+
+/* Track the methods a draw depends on as they are queued, and resolve them
+ * into the packet of each NV097_SET_BEGIN_END. Object classes aren't
+ * tracked: methods of other classes never reach the 3D state, so at worst
+ * they change a key for nothing. */
+static void pfifo_decode_method(PGRAPHDecodeState *s, unsigned int method,
+                                uint32_t parameter, PGRAPHDrawPacket *draw)
+{
+    int i;
+
+    if (pfifo_method_reaches_shader(method)) {
+        s->shader_generation++;
+    }
+
+    switch (method) {
+    case NV097_SET_SHADER_STAGE_PROGRAM:
+        s->shader_stage_program = parameter;
+        break;
+    case NV097_SET_TEXTURE_OFFSET ...
+            NV097_SET_TEXTURE_OFFSET + NV2A_MAX_TEXTURES * 64 - 4:
+        i = (method - NV097_SET_TEXTURE_OFFSET) / 64;
+        s->texture_methods[i][(method % 64) / 4] = parameter;
+        break;
+    case NV097_ARRAY_ELEMENT16:
+        s->min_index = MIN(s->min_index, MIN(parameter & 0xFFFF,
+                                             parameter >> 16));
+        s->max_index = MAX(s->max_index, MAX(parameter & 0xFFFF,
+                                             parameter >> 16));
+        break;
+    case NV097_ARRAY_ELEMENT32:
+        s->min_index = MIN(s->min_index, parameter);
+        s->max_index = MAX(s->max_index, parameter);
+        break;
+    case NV097_DRAW_ARRAYS: {
+        unsigned int start = GET_MASK(parameter, NV097_DRAW_ARRAYS_START_INDEX);
+        unsigned int count = GET_MASK(parameter, NV097_DRAW_ARRAYS_COUNT)+1;
+        s->min_index = MIN(s->min_index, start);
+        s->max_index = MAX(s->max_index, start + count - 1);
+        break;
+    }
+    case NV097_SET_BEGIN_END:
+        if (parameter == NV097_SET_BEGIN_END_OP_END) {
+            draw->min_index = s->min_index;
+            draw->max_index = s->max_index;
+            break;
+        }
+
+        /* The primitive mode is part of ShaderState too */
+        draw->shader_key = s->shader_generation << 4 | (parameter & 0xF);
+        for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+            /* Whether a stage is decoded by the shader depends on the
+             * stage program */
+            draw->texture_keys[i] =
+                fnv_hash((const uint8_t *)s->texture_methods[i],
+                         sizeof(s->texture_methods[i]))
+                ^ s->shader_stage_program;
+        }
+        s->min_index = (uint32_t)-1;
+        s->max_index = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Methods that can't change any register ShaderState is built from: vertex
+ * data, constants and uniforms, fixed function state and the like. Every
+ * other method moves the shader key on. */
+static bool pfifo_method_reaches_shader(unsigned int method)
+{
+    switch (method) {
+    case NV097_NO_OPERATION:
+    case NV097_WAIT_FOR_IDLE:
+    case NV097_SET_FLIP_READ:
+    case NV097_SET_FLIP_WRITE:
+    case NV097_SET_FLIP_MODULO:
+    case NV097_FLIP_INCREMENT_WRITE:
+    case NV097_FLIP_STALL:
+    case NV097_SET_BEGIN_END:
+    case NV097_ARRAY_ELEMENT16:
+    case NV097_ARRAY_ELEMENT32:
+    case NV097_DRAW_ARRAYS:
+    case NV097_INLINE_ARRAY:
+    case NV097_SET_VERTEX3F ...
+            NV097_SET_VERTEX3F + 8:
+    case NV097_SET_VERTEX4F ...
+            NV097_SET_VERTEX4F + 12:
+    case NV097_SET_VERTEX_DATA2F_M ...
+            NV097_SET_VERTEX_DATA2F_M + 0x7c:
+    case NV097_SET_VERTEX_DATA4F_M ...
+            NV097_SET_VERTEX_DATA4F_M + 0xfc:
+    case NV097_SET_VERTEX_DATA2S ...
+            NV097_SET_VERTEX_DATA2S + 0x3c:
+    case NV097_SET_VERTEX_DATA4UB ...
+            NV097_SET_VERTEX_DATA4UB + 0x3c:
+    case NV097_SET_VERTEX_DATA4S_M ...
+            NV097_SET_VERTEX_DATA4S_M + 0x7c:
+    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT ...
+            NV097_SET_VERTEX_DATA_ARRAY_FORMAT + 0x3c:
+    case NV097_SET_VERTEX_DATA_ARRAY_OFFSET ...
+            NV097_SET_VERTEX_DATA_ARRAY_OFFSET + 0x3c:
+    case NV097_SET_TRANSFORM_CONSTANT ...
+            NV097_SET_TRANSFORM_CONSTANT + 0x7c:
+    case NV097_SET_TRANSFORM_CONSTANT_LOAD:
+    case NV097_SET_PROJECTION_MATRIX ...
+            NV097_SET_PROJECTION_MATRIX + 0x3c:
+    case NV097_SET_MODEL_VIEW_MATRIX ...
+            NV097_SET_MODEL_VIEW_MATRIX + 0xfc:
+    case NV097_SET_INVERSE_MODEL_VIEW_MATRIX ...
+            NV097_SET_INVERSE_MODEL_VIEW_MATRIX + 0xfc:
+    case NV097_SET_COMPOSITE_MATRIX ...
+            NV097_SET_COMPOSITE_MATRIX + 0x3c:
+    case NV097_SET_TEXTURE_MATRIX ...
+            NV097_SET_TEXTURE_MATRIX + 0xfc:
+    case NV097_SET_TEXGEN_PLANE_S ...
+            NV097_SET_TEXGEN_PLANE_S + 0xfc:
+    case NV097_SET_FOG_PARAMS ...
+            NV097_SET_FOG_PARAMS + 8:
+    case NV097_SET_FOG_PLANE ...
+            NV097_SET_FOG_PLANE + 12:
+    case NV097_SET_FOG_COLOR:
+    case NV097_SET_SCENE_AMBIENT_COLOR ...
+            NV097_SET_SCENE_AMBIENT_COLOR + 8:
+    case NV097_SET_MATERIAL_EMISSION ...
+            NV097_SET_MATERIAL_EMISSION + 8:
+    case NV097_SET_BACK_LIGHT_AMBIENT_COLOR ...
+            NV097_SET_BACK_LIGHT_SPECULAR_COLOR + 0x1C8:
+    case NV097_SET_LIGHT_AMBIENT_COLOR ...
+            NV097_SET_LIGHT_LOCAL_ATTENUATION + 0x38C:
+    case NV097_SET_EYE_POSITION ...
+            NV097_SET_EYE_POSITION + 12:
+    case NV097_SET_EYE_DIRECTION ...
+            NV097_SET_EYE_DIRECTION + 8:
+    case NV097_SET_EYE_VECTOR ...
+            NV097_SET_EYE_VECTOR + 8:
+    case NV097_SET_VIEWPORT_OFFSET ...
+            NV097_SET_VIEWPORT_OFFSET + 12:
+    case NV097_SET_VIEWPORT_SCALE ...
+            NV097_SET_VIEWPORT_SCALE + 12:
+    case NV097_SET_COMBINER_FACTOR0 ...
+            NV097_SET_COMBINER_FACTOR0 + 28:
+    case NV097_SET_COMBINER_FACTOR1 ...
+            NV097_SET_COMBINER_FACTOR1 + 28:
+    case NV097_SET_SPECULAR_FOG_FACTOR ...
+            NV097_SET_SPECULAR_FOG_FACTOR + 4:
+    case NV097_SET_ALPHA_REF:
+    case NV097_SET_BLEND_ENABLE:
+    case NV097_SET_BLEND_FUNC_SFACTOR:
+    case NV097_SET_BLEND_FUNC_DFACTOR:
+    case NV097_SET_BLEND_COLOR:
+    case NV097_SET_BLEND_EQUATION:
+    case NV097_SET_COLOR_MASK:
+    case NV097_SET_DEPTH_TEST_ENABLE:
+    case NV097_SET_DEPTH_FUNC:
+    case NV097_SET_DEPTH_MASK:
+    case NV097_SET_STENCIL_TEST_ENABLE:
+    case NV097_SET_STENCIL_MASK:
+    case NV097_SET_STENCIL_FUNC:
+    case NV097_SET_STENCIL_FUNC_REF:
+    case NV097_SET_STENCIL_FUNC_MASK:
+    case NV097_SET_STENCIL_OP_FAIL:
+    case NV097_SET_STENCIL_OP_ZFAIL:
+    case NV097_SET_STENCIL_OP_ZPASS:
+    case NV097_SET_CULL_FACE_ENABLE:
+    case NV097_SET_CULL_FACE:
+    case NV097_SET_FRONT_FACE:
+    case NV097_SET_DITHER_ENABLE:
+    case NV097_SET_POLY_OFFSET_POINT_ENABLE:
+    case NV097_SET_POLY_OFFSET_LINE_ENABLE:
+    case NV097_SET_POLY_OFFSET_FILL_ENABLE:
+    case NV097_SET_POLYGON_OFFSET_SCALE_FACTOR:
+    case NV097_SET_POLYGON_OFFSET_BIAS:
+    case NV097_SET_CLIP_MIN:
+    case NV097_SET_CLIP_MAX:
+    case NV097_SET_TEXTURE_OFFSET:
+    case NV097_SET_TEXTURE_OFFSET + 64:
+    case NV097_SET_TEXTURE_OFFSET + 128:
+    case NV097_SET_TEXTURE_OFFSET + 192:
+    case NV097_SET_SEMAPHORE_OFFSET:
+    case NV097_BACK_END_WRITE_SEMAPHORE_RELEASE:
+    case NV097_SET_ZPASS_PIXEL_COUNT_ENABLE:
+    case NV097_CLEAR_REPORT_VALUE:
+    case NV097_GET_REPORT:
+    case NV097_SET_ZSTENCIL_CLEAR_VALUE:
+    case NV097_SET_COLOR_CLEAR_VALUE:
+    case NV097_SET_CLEAR_RECT_HORIZONTAL:
+    case NV097_SET_CLEAR_RECT_VERTICAL:
+    case NV097_CLEAR_SURFACE:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static void* pgraph_render_thread(void *arg)
+{
+    NV2AState *d = (NV2AState *)arg;
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHCommandQueue *q = &pg->queue;
+
+    glo_set_current(pg->gl_context);
+
+    while (!d->exiting) {
+        unsigned int head = q->head;
+        unsigned int tail = atomic_load_acquire(&q->tail);
+
+        if (head == tail) {
+            qemu_event_reset(&q->not_empty);
+            if (atomic_load_acquire(&q->tail) == head && !d->exiting) {
+                qemu_event_wait(&q->not_empty);
+            }
+            continue;
+        }
+
+        unsigned int n = MIN(tail - head, NV2A_PGRAPH_QUEUE_BATCH);
+
+        qemu_mutex_lock(&pg->lock);
+        for (; n > 0; n--) {
+            PGRAPHCommand cmd = q->entries[head % NV2A_PGRAPH_QUEUE_SIZE];
+
+            if (cmd.method == 0) {
+                pgraph_context_switch(d, cmd.channel_id);
+            }
+            pgraph_wait_fifo_access(d);
+            pg->draw_packet = cmd.method == NV097_SET_BEGIN_END
+                ? &q->draws[head % NV2A_PGRAPH_QUEUE_SIZE] : NULL;
+            pgraph_method(d, cmd.subchannel, cmd.method, cmd.parameter);
+            pg->draw_packet = NULL;
+
+            atomic_store_release(&q->head, ++head);
+            qemu_event_set(&q->not_full);
+        }
+        qemu_mutex_unlock(&pg->lock);
+
+        nv2a_spin_kick(d);
+    }
+
+    glo_set_current(NULL);
+
+    return NULL;
+}
+
 static void pfifo_run_pusher(NV2AState *d)
 {
     uint32_t *push0 = &d->pfifo.regs[NV_PFIFO_CACHE1_PUSH0];
@@ -420,6 +683,8 @@ static void pfifo_run_pusher(NV2AState *d)
         }
     }
 
+    nv2a_spin_kick(d);
+
     // NV2A_DPRINTF("DMA pusher done: max 0x%" HWADDR_PRIx ", 0x%" HWADDR_PRIx " - 0x%" HWADDR_PRIx "\n",
     //      dma_len, control->dma_get, control->dma_put);
 
@@ -477,28 +742,63 @@ static uint32_t ramht_hash(NV2AState *d, uint32_t handle)
 
 static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle)
 {
+    uint32_t ramht = d->pfifo.regs[NV_PFIFO_RAMHT];
+    unsigned int channel_id = GET_MASK(d->pfifo.regs[NV_PFIFO_CACHE1_PUSH1],
+                                       NV_PFIFO_CACHE1_PUSH1_CHID);
+    RAMHTCacheEntry *cached =
+        &d->ramin_cache.ramht[(handle ^ (handle >> 16) ^ channel_id)
+                              % NV2A_RAMIN_CACHE_SIZE];
+    RAMHTEntry entry;
+
+    qemu_mutex_lock(&d->ramin_cache.lock);
+
+    if (cached->valid) {
+        ramin_cache_check_page(d, cached->address);
+    }
+    if (cached->valid && cached->handle == handle && cached->ramht == ramht
+        && cached->channel_id == channel_id) {
+        entry = cached->entry;
+        qemu_mutex_unlock(&d->ramin_cache.lock);
+        return entry;
+    }
+
     hwaddr ramht_size =
-        1 << (GET_MASK(d->pfifo.regs[NV_PFIFO_RAMHT], NV_PFIFO_RAMHT_SIZE)+12);
+        1 << (GET_MASK(ramht, NV_PFIFO_RAMHT_SIZE)+12);
 
     uint32_t hash = ramht_hash(d, handle);
     assert(hash * 8 < ramht_size);
 
     hwaddr ramht_address =
-        GET_MASK(d->pfifo.regs[NV_PFIFO_RAMHT],
-                 NV_PFIFO_RAMHT_BASE_ADDRESS) << 12;
+        GET_MASK(ramht, NV_PFIFO_RAMHT_BASE_ADDRESS) << 12;
 
     assert(ramht_address + hash * 8 < memory_region_size(&d->ramin));
 
+    /* Pick up writes made before the entry is read */
+    ramin_cache_check_page(d, ramht_address + hash * 8);
+
     uint8_t *entry_ptr = d->ramin_ptr + ramht_address + hash * 8;
 
     uint32_t entry_handle = ldl_le_p((uint32_t*)entry_ptr);
     uint32_t entry_context = ldl_le_p((uint32_t*)(entry_ptr + 4));
 
-    return (RAMHTEntry){
+    entry = (RAMHTEntry){
         .handle = entry_handle,
         .instance = (entry_context & NV_RAMHT_INSTANCE) << 4,
         .engine = (entry_context & NV_RAMHT_ENGINE) >> 16,
         .channel_id = (entry_context & NV_RAMHT_CHID) >> 24,
         .valid = entry_context & NV_RAMHT_STATUS,
     };
+
+    *cached = (RAMHTCacheEntry){
+        .valid = true,
+        .handle = handle,
+        .ramht = ramht,
+        .channel_id = channel_id,
+        .address = ramht_address + hash * 8,
+        .entry = entry,
+    };
+
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+
+    return entry;
 }
@@ -274,24 +274,49 @@ static void pgraph_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta);
 static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color);
 static void pgraph_update_surface(NV2AState *d, bool upload, bool color_write, bool zeta_write);
 static void pgraph_bind_textures(NV2AState *d);
+static void pgraph_set_texture_key(PGRAPHState *pg, int stage);
+static enum PshTexDecode pgraph_texture_decode(PGRAPHState *pg, int stage);
+static void pgraph_upload_palette(PGRAPHState *pg, int stage, const uint8_t *palette_data, unsigned int palette_length);
 static void pgraph_apply_anti_aliasing_factor(PGRAPHState *pg, unsigned int *width, unsigned int *height);
 static void pgraph_get_surface_dimensions(PGRAPHState *pg, unsigned int *width, unsigned int *height);
 static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size, bool f);
+static void pgraph_update_memory_buffer_ranges(NV2AState *d, hwaddr *start, hwaddr *end, unsigned int num_ranges);
+static void pgraph_memory_buffer_upload(NV2AState *d, hwaddr addr, hwaddr end);
+static void pgraph_vram_upload_dirty(NV2AState *d, hwaddr addr, hwaddr end);
+static void pgraph_vram_dirty_epoch_end(NV2AState *d);
 static void pgraph_bind_vertex_attributes(NV2AState *d, unsigned int num_elements, bool inline_data, unsigned int inline_stride);
 static unsigned int pgraph_bind_inline_array(NV2AState *d);
+static bool pgraph_draws_quads(PGRAPHState *pg);
+static unsigned int pgraph_quad_index_count(PGRAPHState *pg, unsigned int vertex_count);
+static unsigned int pgraph_quad_indices(PGRAPHState *pg, uint32_t *out, const uint32_t *elements, unsigned int vertex_count);
+static unsigned int pgraph_bind_quad_index_buffer(PGRAPHState *pg, unsigned int vertex_count);
+static void pgraph_draw_arrays(PGRAPHState *pg, GLint first, GLsizei count);
 static float convert_f16_to_float(uint16_t f16);
 static float convert_f24_to_float(uint32_t f24);
 static uint8_t cliptobyte(int x);
 static void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix, uint8_t *r, uint8_t *g, uint8_t* b);
+static ColorFormatInfo texture_color_format(const TextureShape *s);
 static uint8_t* convert_texture_data(const TextureShape s, const uint8_t *data, const uint8_t *palette_data, unsigned int width, unsigned int height, unsigned int depth, unsigned int row_pitch, unsigned int slice_pitch);
-static void upload_gl_texture(GLenum gl_target, const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
-static TextureBinding* generate_texture(const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
+static bool texture_needs_conversion(const TextureShape *s);
+static unsigned int texture_upload_bytes_per_pixel(const TextureShape *s);
+static unsigned int texture_upload_plan(const TextureShape *s, GLenum gl_target, const uint8_t *texture_data, TextureUploadJob *jobs, size_t *staging_size);
+static void texture_upload_job_run(const TextureShape *s, const uint8_t *palette_data, const TextureUploadJob *job, uint8_t *staging);
+static void texture_upload_job_submit(const TextureShape *s, const TextureUploadJob *job, bool immutable);
+static void texture_workers_init(TextureWorkers *w);
+static void texture_workers_destroy(TextureWorkers *w);
+static void texture_workers_run(TextureWorkers *w, const TextureShape *s, const uint8_t *palette_data, const TextureUploadJob *jobs, unsigned int num_jobs, uint8_t *staging, size_t staging_size);
+static void pgraph_upload_texture(PGRAPHState *pg, const TextureShape *s, const uint8_t *palette_data, const TextureUploadJob *jobs, unsigned int num_jobs, size_t staging_size, bool immutable);
+static TextureBinding* generate_texture(PGRAPHState *pg, const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
 static void texture_binding_destroy(gpointer data);
 static struct lru_node *texture_cache_entry_init(struct lru_node *obj, void *key);
 static struct lru_node *texture_cache_entry_deinit(struct lru_node *obj);
 static int texture_cache_entry_compare(struct lru_node *obj, void *key);
 static guint shader_hash(gconstpointer key);
 static gboolean shader_equal(gconstpointer a, gconstpointer b);
+static GLenum pgraph_texture_wrap(unsigned int addr, bool linear);
+static void pgraph_bind_sampler(PGRAPHState *pg, int unit, const SamplerKey *key);
+static guint sampler_hash(gconstpointer key);
+static gboolean sampler_equal(gconstpointer a, gconstpointer b);
 static unsigned int kelvin_map_stencil_op(uint32_t parameter);
 static unsigned int kelvin_map_polygon_mode(uint32_t parameter);
 static unsigned int kelvin_map_texgen(uint32_t parameter, unsigned int channel);
@@ -354,6 +379,13 @@ uint64_t pgraph_read(void *opaque, hwaddr addr, unsigned int size)
     case NV_PGRAPH_INTR_EN:
         r = pg->enabled_interrupts;
         break;
+    case NV_PGRAPH_STATUS:
+        /* Busy until the render thread has run every queued method */
+        r = pg->regs[addr];
+        if (atomic_read(&pg->queue.head) != atomic_read(&pg->queue.tail)) {
+            r |= NV_PGRAPH_STATUS_STATE;
+        }
+        break;
     case NV_PGRAPH_RDI_DATA: {
         unsigned int select = GET_MASK(pg->regs[NV_PGRAPH_RDI_INDEX],
                                        NV_PGRAPH_RDI_INDEX_SELECT);
@@ -453,6 +485,10 @@ void pgraph_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
     }
     default:
         pg->regs[addr] = val;
+        /* The puller only sees methods, so the keys of its draw packets
+         * don't account for registers written directly */
+        pg->shader_key_valid = false;
+        memset(pg->texture_key_valid, 0, sizeof(pg->texture_key_valid));
         break;
     }
 
@@ -713,6 +749,12 @@ static void pgraph_method(NV2AState *d,
             GET_MASK(pg->regs[NV_PGRAPH_SURFACE],
                           NV_PGRAPH_SURFACE_WRITE_3D));
 
+        pgraph_vram_dirty_epoch_end(d);
+
+        pg->memory_buffer_frame_bytes =
+            pg->memory_buffer_upload_bytes - pg->memory_buffer_frame_start;
+        pg->memory_buffer_frame_start = pg->memory_buffer_upload_bytes;
+
         NV2A_GL_DFRAME_TERMINATOR();
 
         break;
@@ -1783,8 +1825,11 @@ static void pgraph_method(NV2AState *d,
                                 & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE;
 
         if (parameter == NV097_SET_BEGIN_END_OP_END) {
+            /* Vertex range of the batch, worked out by the puller */
+            const PGRAPHDrawPacket *draw = pg->draw_packet;
 
             assert(pg->shader_binding);
+            assert(draw);
 
             if (pg->draw_arrays_length) {
 
@@ -1794,12 +1839,28 @@ static void pgraph_method(NV2AState *d,
                 assert(pg->inline_array_length == 0);
                 assert(pg->inline_elements_length == 0);
 
-                pgraph_bind_vertex_attributes(d, pg->draw_arrays_max_count,
+                pgraph_bind_vertex_attributes(d, draw->max_index + 1,
                                               false, 0);
-                glMultiDrawArrays(pg->shader_binding->gl_primitive_mode,
-                                  pg->gl_draw_arrays_start,
-                                  pg->gl_draw_arrays_count,
-                                  pg->draw_arrays_length);
+                if (pgraph_draws_quads(pg)) {
+                    GLsizei counts[ARRAY_SIZE(pg->gl_draw_arrays_count)];
+                    const GLvoid *offsets[ARRAY_SIZE(pg->gl_draw_arrays_count)];
+
+                    pgraph_bind_quad_index_buffer(pg, draw->max_index + 1);
+                    for (i = 0; i < pg->draw_arrays_length; i++) {
+                        counts[i] = pgraph_quad_index_count(
+                            pg, pg->gl_draw_arrays_count[i]);
+                        offsets[i] = NULL;
+                    }
+                    glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts,
+                                                  GL_UNSIGNED_INT, offsets,
+                                                  pg->draw_arrays_length,
+                                                  pg->gl_draw_arrays_start);
+                } else {
+                    glMultiDrawArrays(pg->shader_binding->gl_primitive_mode,
+                                      pg->gl_draw_arrays_start,
+                                      pg->gl_draw_arrays_count,
+                                      pg->draw_arrays_length);
+                }
             } else if (pg->inline_buffer_length) {
 
                 NV2A_GL_DPRINTF(false, "Inline Buffer");
@@ -1835,8 +1896,7 @@ static void pgraph_method(NV2AState *d,
 
                 }
 
-                glDrawArrays(pg->shader_binding->gl_primitive_mode,
-                             0, pg->inline_buffer_length);
+                pgraph_draw_arrays(pg, 0, pg->inline_buffer_length);
             } else if (pg->inline_array_length) {
 
                 NV2A_GL_DPRINTF(false, "Inline Array");
@@ -1846,8 +1906,7 @@ static void pgraph_method(NV2AState *d,
                 assert(pg->inline_elements_length == 0);
 
                 unsigned int index_count = pgraph_bind_inline_array(d);
-                glDrawArrays(pg->shader_binding->gl_primitive_mode,
-                             0, index_count);
+                pgraph_draw_arrays(pg, 0, index_count);
             } else if (pg->inline_elements_length) {
 
                 NV2A_GL_DPRINTF(false, "Inline Elements");
@@ -1856,24 +1915,38 @@ static void pgraph_method(NV2AState *d,
                 assert(pg->inline_buffer_length == 0);
                 assert(pg->inline_array_length == 0);
 
-                uint32_t max_element = 0;
-                uint32_t min_element = (uint32_t)-1;
-                for (i=0; i<pg->inline_elements_length; i++) {
-                    max_element = MAX(pg->inline_elements[i], max_element);
-                    min_element = MIN(pg->inline_elements[i], min_element);
-                }
+                uint32_t max_element = draw->max_index;
+                uint32_t min_element = draw->min_index;
 
                 pgraph_bind_vertex_attributes(d, max_element+1, false, 0);
 
+                GLenum mode = pg->shader_binding->gl_primitive_mode;
+                uint32_t *elements = pg->inline_elements;
+                unsigned int elements_length = pg->inline_elements_length;
+                if (pgraph_draws_quads(pg)) {
+                    unsigned int n = pgraph_quad_index_count(pg,
+                                                             elements_length);
+                    if (n > pg->quad_elements_size) {
+                        pg->quad_elements = g_renew(uint32_t,
+                                                    pg->quad_elements, n);
+                        pg->quad_elements_size = n;
+                    }
+                    pgraph_quad_indices(pg, pg->quad_elements, elements,
+                                        elements_length);
+                    mode = GL_TRIANGLES;
+                    elements = pg->quad_elements;
+                    elements_length = n;
+                }
+
                 glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pg->gl_element_buffer);
                 glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                             pg->inline_elements_length*4,
-                             pg->inline_elements,
+                             elements_length*4,
+                             elements,
                              GL_DYNAMIC_DRAW);
 
-                glDrawRangeElements(pg->shader_binding->gl_primitive_mode,
+                glDrawRangeElements(mode,
                                     min_element, max_element,
-                                    pg->inline_elements_length,
+                                    elements_length,
                                     GL_UNSIGNED_INT,
                                     (void*)0);
 
@@ -2050,7 +2123,6 @@ static void pgraph_method(NV2AState *d,
             pg->inline_array_length = 0;
             pg->inline_buffer_length = 0;
             pg->draw_arrays_length = 0;
-            pg->draw_arrays_max_count = 0;
 
             /* Visibility testing */
             if (pg->zpass_pixel_count_enable) {
@@ -2191,8 +2263,6 @@ static void pgraph_method(NV2AState *d,
         unsigned int start = GET_MASK(parameter, NV097_DRAW_ARRAYS_START_INDEX);
         unsigned int count = GET_MASK(parameter, NV097_DRAW_ARRAYS_COUNT)+1;
 
-        pg->draw_arrays_max_count = MAX(pg->draw_arrays_max_count, start + count);
-
         assert(pg->draw_arrays_length < ARRAY_SIZE(pg->gl_draw_arrays_start));
 
         /* Attempt to connect primitives */
@@ -2462,9 +2532,6 @@ static void pgraph_method(NV2AState *d,
 
             glClearColor(red, green, blue, alpha);
         }
-        pgraph_update_surface(d, true, write_color, write_zeta);
-
-        glEnable(GL_SCISSOR_TEST);
 
         unsigned int xmin = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTX],
                 NV_PGRAPH_CLEARRECTX_XMIN);
@@ -2475,6 +2542,31 @@ static void pgraph_method(NV2AState *d,
         unsigned int ymax = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTY],
                 NV_PGRAPH_CLEARRECTY_YMAX);
 
+        /* A clear of the whole surface that writes every channel makes
+         * uploading it from VRAM first pointless */
+        unsigned int surface_width, surface_height;
+        pgraph_get_surface_dimensions(pg, &surface_width, &surface_height);
+        bool full_clear = xmin == 0 && ymin == 0
+                          && xmax + 1 >= surface_width
+                          && ymax + 1 >= surface_height;
+        pg->surface_color.clear_pending = full_clear
+            && (parameter & (NV097_CLEAR_SURFACE_R | NV097_CLEAR_SURFACE_G
+                             | NV097_CLEAR_SURFACE_B | NV097_CLEAR_SURFACE_A))
+               == (NV097_CLEAR_SURFACE_R | NV097_CLEAR_SURFACE_G
+                   | NV097_CLEAR_SURFACE_B | NV097_CLEAR_SURFACE_A);
+        pg->surface_zeta.clear_pending = full_clear
+            && (parameter & NV097_CLEAR_SURFACE_Z)
+            && ((parameter & NV097_CLEAR_SURFACE_STENCIL)
+                || pg->surface_shape.zeta_format
+                    != NV097_SET_SURFACE_FORMAT_ZETA_Z24S8);
+
+        pgraph_update_surface(d, true, write_color, write_zeta);
+
+        pg->surface_color.clear_pending = false;
+        pg->surface_zeta.clear_pending = false;
+
+        glEnable(GL_SCISSOR_TEST);
+
         unsigned int scissor_x = xmin;
         unsigned int scissor_y = pg->surface_shape.clip_height - ymax - 1;
 
@@ -2722,6 +2814,8 @@ static void pgraph_init(NV2AState *d)
     qemu_cond_init(&pg->interrupt_cond);
     qemu_cond_init(&pg->fifo_access_cond);
     qemu_cond_init(&pg->flip_3d);
+    qemu_event_init(&pg->queue.not_empty, false);
+    qemu_event_init(&pg->queue.not_full, false);
 
     /* fire up opengl */
 
@@ -2736,6 +2830,8 @@ static void pgraph_init(NV2AState *d)
     assert(glo_check_extension("GL_EXT_texture_compression_s3tc"));
     /*  Internal RGB565 texture format */
     assert(glo_check_extension("GL_ARB_ES2_compatibility"));
+    /* Immutable texture storage, uploads fall back to glTexImage without */
+    pg->texture_storage = glo_check_extension("GL_ARB_texture_storage");
 
     GLint max_vertex_attributes;
     glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &max_vertex_attributes);
@@ -2758,12 +2854,14 @@ static void pgraph_init(NV2AState *d)
 
     //glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
 
-    // Initialize texture cache
-    const size_t texture_cache_size = 512;
+    // Initialize texture cache, mostly bounded by its memory budget
+    const size_t texture_cache_size = 4096;
     lru_init(&pg->texture_cache,
         &texture_cache_entry_init,
         &texture_cache_entry_deinit,
         &texture_cache_entry_compare);
+    lru_set_budget(&pg->texture_cache,
+                   (size_t)pg->texture_cache_mb * 1024 * 1024);
     pg->texture_cache_entries = malloc(texture_cache_size * sizeof(struct TextureKey));
     assert(pg->texture_cache_entries != NULL);
     for (i = 0; i < texture_cache_size; i++) {
@@ -2771,6 +2869,21 @@ static void pgraph_init(NV2AState *d)
     }
 
     pg->shader_cache = g_hash_table_new(shader_hash, shader_equal);
+    pg->sampler_cache = g_hash_table_new_full(sampler_hash, sampler_equal,
+                                              g_free, NULL);
+
+    /* Palettes of decoded textures stay bound past the texture units */
+    glGenTextures(NV2A_MAX_TEXTURES, pg->gl_palette_texture);
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        glActiveTexture(GL_TEXTURE0 + NV2A_MAX_TEXTURES + i);
+        glBindTexture(GL_TEXTURE_1D, pg->gl_palette_texture[i]);
+        glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, 256, 0,
+                     GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAX_LEVEL, 0);
+    }
+    glActiveTexture(GL_TEXTURE0);
 
 
     for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
@@ -2779,6 +2892,11 @@ static void pgraph_init(NV2AState *d)
     }
     glGenBuffers(1, &pg->gl_inline_array_buffer);
     glGenBuffers(1, &pg->gl_element_buffer);
+    glGenBuffers(2, pg->gl_quad_index_buffer);
+
+    glGenBuffers(1, &pg->gl_texture_pbo);
+    pg->texture_pbo_size = 0;
+    texture_workers_init(&pg->texture_workers);
 
     glGenBuffers(1, &pg->gl_memory_buffer);
     glBindBuffer(GL_ARRAY_BUFFER, pg->gl_memory_buffer);
@@ -2793,6 +2911,13 @@ static void pgraph_init(NV2AState *d)
     assert(glGetError() == GL_NO_ERROR);
 
     glo_set_current(NULL);
+
+    pg->vram_epoch_dirty =
+        bitmap_new(memory_region_size(d->vram) >> TARGET_PAGE_BITS);
+    pg->vram_epoch_carry =
+        bitmap_new(memory_region_size(d->vram) >> TARGET_PAGE_BITS);
+    pg->vram_epoch_start = memory_region_size(d->vram);
+    pg->vram_epoch_end = 0;
 }
 
 static void pgraph_destroy(PGRAPHState *pg)
@@ -2801,6 +2926,8 @@ static void pgraph_destroy(PGRAPHState *pg)
     qemu_cond_destroy(&pg->interrupt_cond);
     qemu_cond_destroy(&pg->fifo_access_cond);
     qemu_cond_destroy(&pg->flip_3d);
+    qemu_event_destroy(&pg->queue.not_empty);
+    qemu_event_destroy(&pg->queue.not_full);
 
     glo_set_current(pg->gl_context);
 
@@ -2817,10 +2944,26 @@ static void pgraph_destroy(PGRAPHState *pg)
     // Clear out texture cache
     lru_flush(&pg->texture_cache);
     free(pg->texture_cache_entries);
+    glDeleteTextures(NV2A_MAX_TEXTURES, pg->gl_palette_texture);
+    glDeleteBuffers(1, &pg->gl_texture_pbo);
+
+    GHashTableIter iter;
+    gpointer sampler;
+    g_hash_table_iter_init(&iter, pg->sampler_cache);
+    while (g_hash_table_iter_next(&iter, NULL, &sampler)) {
+        GLuint gl_sampler = GPOINTER_TO_UINT(sampler);
+        glDeleteSamplers(1, &gl_sampler);
+    }
+    g_hash_table_destroy(pg->sampler_cache);
+    texture_workers_destroy(&pg->texture_workers);
 
     glo_set_current(NULL);
 
     glo_context_destroy(pg->gl_context);
+
+    g_free(pg->vram_epoch_dirty);
+    g_free(pg->vram_epoch_carry);
+    g_free(pg->quad_elements);
 }
 
 static void pgraph_shader_update_constants(PGRAPHState *pg,
@@ -3008,7 +3151,8 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
     }
 }
 
-static void pgraph_bind_shaders(PGRAPHState *pg)
+/* Build ShaderState from the registers and find or generate its program */
+static ShaderBinding *pgraph_lookup_shader(PGRAPHState *pg)
 {
     int i, j;
 
@@ -3021,12 +3165,6 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
     int program_start = GET_MASK(pg->regs[NV_PGRAPH_CSV0_C],
                                  NV_PGRAPH_CSV0_C_CHEOPS_PROGRAM_START);
 
-    NV2A_GL_DGROUP_BEGIN("%s (VP: %s FFP: %s)", __func__,
-                         vertex_program ? "yes" : "no",
-                         fixed_function ? "yes" : "no");
-
-    ShaderBinding* old_binding = pg->shader_binding;
-
     ShaderState state = {
         .psh = (PshState){
             /* register combier stuff */
@@ -3073,6 +3211,14 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
                                                               NV_PGRAPH_SETUPRASTER_BACKFACEMODE),
     };
 
+    /* Filled quads are drawn as triangles, so they can share programs */
+    if ((state.primitive_mode == PRIM_TYPE_QUADS
+         || state.primitive_mode == PRIM_TYPE_QUAD_STRIP)
+        && state.polygon_front_mode == POLY_MODE_FILL
+        && state.polygon_back_mode == POLY_MODE_FILL) {
+        state.primitive_mode = PRIM_TYPE_TRIANGLES;
+    }
+
     state.program_length = 0;
     memset(state.program_data, 0, sizeof(state.program_data));
 
@@ -3207,19 +3353,59 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
         }
         state.psh.alphakill[i] = pg->regs[NV_PGRAPH_TEXCTL0_0 + i*4]
                                & NV_PGRAPH_TEXCTL0_0_ALPHAKILLEN;
+
+        state.psh.tex_decode[i] = pgraph_texture_decode(pg, i);
+        state.psh.tex_decode_linear[i] = false;
+        if (state.psh.tex_decode[i] != TEX_DECODE_NONE) {
+            unsigned int mag_filter =
+                GET_MASK(pg->regs[NV_PGRAPH_TEXFILTER0 + i*4],
+                         NV_PGRAPH_TEXFILTER0_MAG);
+            state.psh.tex_decode_linear[i] =
+                pgraph_texture_mag_filter_map[mag_filter] == GL_LINEAR;
+        }
     }
 
+    pg->shader_window_clip_count = state.psh.window_clip_count;
+
     ShaderBinding* cached_shader = (ShaderBinding*)g_hash_table_lookup(pg->shader_cache, &state);
     if (cached_shader) {
-        pg->shader_binding = cached_shader;
-    } else {
-        pg->shader_binding = generate_shaders(state);
+        return cached_shader;
+    }
+
+    ShaderBinding *binding = generate_shaders(state);
+
+    /* cache it */
+    ShaderState *cache_state = (ShaderState *)g_malloc(sizeof(*cache_state));
+    memcpy(cache_state, &state, sizeof(*cache_state));
+    g_hash_table_insert(pg->shader_cache, cache_state, (gpointer)binding);
+
+    return binding;
+}
+
+static void pgraph_bind_shaders(PGRAPHState *pg)
+{
+    int i;
+
+    bool vertex_program = GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
+                                   NV_PGRAPH_CSV0_D_MODE) == 2;
 
-        /* cache it */
-        ShaderState *cache_state = (ShaderState *)g_malloc(sizeof(*cache_state));
-        memcpy(cache_state, &state, sizeof(*cache_state));
-        g_hash_table_insert(pg->shader_cache, cache_state,
-                            (gpointer)pg->shader_binding);
+    bool fixed_function = GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
+                                   NV_PGRAPH_CSV0_D_MODE) == 0;
+
+    NV2A_GL_DGROUP_BEGIN("%s (VP: %s FFP: %s)", __func__,
+                         vertex_program ? "yes" : "no",
+                         fixed_function ? "yes" : "no");
+
+    ShaderBinding* old_binding = pg->shader_binding;
+    const PGRAPHDrawPacket *draw = pg->draw_packet;
+
+    /* The key only moves on when a method ShaderState is built from was
+     * decoded, so the same key means the same program */
+    if (!draw || !pg->shader_key_valid || !pg->shader_binding
+        || draw->shader_key != pg->shader_key) {
+        pg->shader_binding = pgraph_lookup_shader(pg);
+        pg->shader_key_valid = draw != NULL;
+        pg->shader_key = draw ? draw->shader_key : 0;
     }
 
     bool binding_changed = (pg->shader_binding != old_binding);
@@ -3227,7 +3413,7 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
     glUseProgram(pg->shader_binding->gl_program);
 
     /* Clipping regions */
-    for (i = 0; i < state.psh.window_clip_count; i++) {
+    for (i = 0; i < pg->shader_window_clip_count; i++) {
         if (pg->shader_binding->clip_region_loc[i] == -1) {
             continue;
         }
@@ -3298,6 +3484,54 @@ static void pgraph_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta)
     pg->surface_zeta.draw_dirty |= zeta;
 }
 
+/* (Re)create the GL texture backing a surface and attach it */
+static void pgraph_surface_create_buffer(bool color, GLuint *gl_buffer,
+                                         GLenum gl_attachment,
+                                         GLenum gl_internal_format,
+                                         GLenum gl_format, GLenum gl_type,
+                                         unsigned int width,
+                                         unsigned int height,
+                                         const uint8_t *data)
+{
+    if (!color) {
+        /* need to clear the depth_stencil and depth attachment for zeta */
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               GL_DEPTH_ATTACHMENT,
+                               GL_TEXTURE_2D,
+                               0, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               GL_DEPTH_STENCIL_ATTACHMENT,
+                               GL_TEXTURE_2D,
+                               0, 0);
+    }
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER,
+                           gl_attachment,
+                           GL_TEXTURE_2D,
+                           0, 0);
+
+    if (*gl_buffer) {
+        glDeleteTextures(1, gl_buffer);
+        *gl_buffer = 0;
+    }
+
+    glGenTextures(1, gl_buffer);
+    glBindTexture(GL_TEXTURE_2D, *gl_buffer);
+
+    glTexImage2D(GL_TEXTURE_2D, 0, gl_internal_format,
+                 width, height, 0,
+                 gl_format, gl_type,
+                 data);
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER,
+                           gl_attachment,
+                           GL_TEXTURE_2D,
+                           *gl_buffer, 0);
+
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER)
+        == GL_FRAMEBUFFER_COMPLETE);
+}
+
 static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
     PGRAPHState *pg = &d->pgraph;
 
@@ -3403,7 +3637,19 @@ static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
                                                surface->pitch * height,
                                                DIRTY_MEMORY_NV2A);
     }
-    if (upload && dirty) {
+    if (upload && dirty && surface->clear_pending) {
+        /* The whole surface is about to be cleared, so there is no point in
+         * uploading it: just make a fresh renderbuffer. */
+        pgraph_surface_create_buffer(color, gl_buffer, gl_attachment,
+                                     gl_internal_format, gl_format, gl_type,
+                                     width, height, NULL);
+        surface->buffer_dirty = false;
+        pg->surface_uploads_elided++;
+
+        NV2A_GL_DPRINTF(true, "elide_surface_upload %s 0x%" HWADDR_PRIx,
+                        color ? "color" : "zeta",
+                        dma.address + surface->offset);
+    } else if (upload && dirty) {
         /* surface modified (or moved) by the cpu.
          * copy it into the opengl renderbuffer */
         assert(!surface->draw_dirty);
@@ -3418,31 +3664,6 @@ static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
                            bytes_per_pixel);
         }
 
-        if (!color) {
-            /* need to clear the depth_stencil and depth attachment for zeta */
-            glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                   GL_DEPTH_ATTACHMENT,
-                                   GL_TEXTURE_2D,
-                                   0, 0);
-            glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                   GL_DEPTH_STENCIL_ATTACHMENT,
-                                   GL_TEXTURE_2D,
-                                   0, 0);
-        }
-
-        glFramebufferTexture2D(GL_FRAMEBUFFER,
-                               gl_attachment,
-                               GL_TEXTURE_2D,
-                               0, 0);
-
-        if (*gl_buffer) {
-            glDeleteTextures(1, gl_buffer);
-            *gl_buffer = 0;
-        }
-
-        glGenTextures(1, gl_buffer);
-        glBindTexture(GL_TEXTURE_2D, *gl_buffer);
-
         /* This is VRAM so we can't do this inplace! */
         uint8_t *flipped_buf = (uint8_t*)g_malloc(width * height * bytes_per_pixel);
         unsigned int irow;
@@ -3453,21 +3674,12 @@ static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
                    width * bytes_per_pixel);
         }
 
-        glTexImage2D(GL_TEXTURE_2D, 0, gl_internal_format,
-                     width, height, 0,
-                     gl_format, gl_type,
-                     flipped_buf);
+        pgraph_surface_create_buffer(color, gl_buffer, gl_attachment,
+                                     gl_internal_format, gl_format, gl_type,
+                                     width, height, flipped_buf);
 
         g_free(flipped_buf);
 
-        glFramebufferTexture2D(GL_FRAMEBUFFER,
-                               gl_attachment,
-                               GL_TEXTURE_2D,
-                               *gl_buffer, 0);
-
-        assert(glCheckFramebufferStatus(GL_FRAMEBUFFER)
-            == GL_FRAMEBUFFER_COMPLETE);
-
         if (color) {
             pgraph_update_memory_buffer(d, dma.address + surface->offset,
                                         surface->pitch * height, true);
@@ -3596,11 +3808,24 @@ static void pgraph_bind_textures(NV2AState *d)
 {
     int i;
     PGRAPHState *pg = &d->pgraph;
+    const PGRAPHDrawPacket *draw = pg->draw_packet;
 
     NV2A_GL_DGROUP_BEGIN("%s", __func__);
 
     for (i=0; i<NV2A_MAX_TEXTURES; i++) {
 
+        /* Same stage methods as the last bind: the sampler still fits,
+         * and the texture too unless it was set again */
+        if (draw && pg->texture_key_valid[i]
+            && draw->texture_keys[i] == pg->texture_key[i]
+            && !pg->texture_dirty[i] && pg->texture_binding[i]) {
+            glActiveTexture(GL_TEXTURE0 + i);
+            glBindTexture(pg->texture_binding[i]->gl_target,
+                          pg->texture_binding[i]->gl_texture);
+            continue;
+        }
+        pg->texture_key_valid[i] = false;
+
         uint32_t ctl_0 = pg->regs[NV_PGRAPH_TEXCTL0_0 + i*4];
         uint32_t ctl_1 = pg->regs[NV_PGRAPH_TEXCTL1_0 + i*4];
         uint32_t fmt = pg->regs[NV_PGRAPH_TEXFMT0 + i*4];
@@ -3674,6 +3899,8 @@ static void pgraph_bind_textures(NV2AState *d)
         assert(!(filter & NV_PGRAPH_TEXFILTER0_GSIGNED));
         assert(!(filter & NV_PGRAPH_TEXFILTER0_BSIGNED));
 
+        enum PshTexDecode decode = pgraph_texture_decode(pg, i);
+
         glActiveTexture(GL_TEXTURE0 + i);
         if (!enabled) {
             glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
@@ -3684,9 +3911,54 @@ static void pgraph_bind_textures(NV2AState *d)
             continue;
         }
 
-        if (!pg->texture_dirty[i] && pg->texture_binding[i]) {
+        assert(color_format < ARRAY_SIZE(kelvin_color_format_map));
+        ColorFormatInfo f = kelvin_color_format_map[color_format];
+
+        if (f.linear) {
+            /* somtimes games try to set mipmap min filters on linear textures.
+             * this could indicate a bug... */
+            switch (min_filter) {
+            case NV_PGRAPH_TEXFILTER0_MIN_BOX_NEARESTLOD:
+            case NV_PGRAPH_TEXFILTER0_MIN_BOX_TENT_LOD:
+                min_filter = NV_PGRAPH_TEXFILTER0_MIN_BOX_LOD0;
+                break;
+            case NV_PGRAPH_TEXFILTER0_MIN_TENT_NEARESTLOD:
+            case NV_PGRAPH_TEXFILTER0_MIN_TENT_TENT_LOD:
+                min_filter = NV_PGRAPH_TEXFILTER0_MIN_TENT_LOD0;
+                break;
+            }
+        }
+
+        /* Filter, address and border color methods don't dirty the
+         * texture, so the sampler is looked up on every bind */
+        SamplerKey sampler_key = {
+            .min_filter = pgraph_texture_min_filter_map[min_filter],
+            .mag_filter = pgraph_texture_mag_filter_map[mag_filter],
+            .wrap_s = pgraph_texture_wrap(addru, f.linear),
+            .wrap_t = dimensionality > 1
+                          ? pgraph_texture_wrap(addrv, f.linear) : GL_REPEAT,
+            .wrap_r = dimensionality > 2
+                          ? pgraph_texture_wrap(addrp, f.linear) : GL_REPEAT,
+        };
+        if (decode != TEX_DECODE_NONE) {
+            /* Indices and chroma pairs must not be blended, the shader
+             * filters the decoded texels instead */
+            sampler_key.min_filter =
+                (sampler_key.min_filter == GL_NEAREST
+                 || sampler_key.min_filter == GL_LINEAR)
+                    ? GL_NEAREST : GL_NEAREST_MIPMAP_NEAREST;
+            sampler_key.mag_filter = GL_NEAREST;
+        }
+        if (border_source == NV_PGRAPH_TEXFMT0_BORDER_SOURCE_COLOR) {
+            sampler_key.border_color = border_color;
+        }
+        pgraph_bind_sampler(pg, i, &sampler_key);
+
+        if (!pg->texture_dirty[i] && pg->texture_binding[i]
+            && pg->texture_decode[i] == decode) {
             glBindTexture(pg->texture_binding[i]->gl_target,
                           pg->texture_binding[i]->gl_texture);
+            pgraph_set_texture_key(pg, i);
             continue;
         }
 
@@ -3701,8 +3973,6 @@ static void pgraph_bind_textures(NV2AState *d)
                      min_mipmap_level, max_mipmap_level, levels,
                      lod_bias);
 
-        assert(color_format < ARRAY_SIZE(kelvin_color_format_map));
-        ColorFormatInfo f = kelvin_color_format_map[color_format];
         if (f.bytes_per_pixel == 0) {
             fprintf(stderr, "nv2a: unimplemented texture color format 0x%x\n",
                     color_format);
@@ -3722,46 +3992,20 @@ static void pgraph_bind_textures(NV2AState *d)
 
             /* FIXME: What about 3D mipmaps? */
             levels = MIN(levels, max_mipmap_level + 1);
-            if (f.gl_format != 0) {
-                /* Discard mipmap levels that would be smaller than 1x1.
-                 * FIXME: Is this actually needed?
-                 *
-                 * >> Level 0: 32 x 4
-                 *    Level 1: 16 x 2
-                 *    Level 2: 8 x 1
-                 *    Level 3: 4 x 1
-                 *    Level 4: 2 x 1
-                 *    Level 5: 1 x 1
-                 */
-                levels = MIN(levels, MAX(log_width, log_height) + 1);
-            } else {
-                /* OpenGL requires DXT textures to always have a width and
-                 * height a multiple of 4. The Xbox and DirectX handles DXT
-                 * textures smaller than 4 by padding the reset of the block.
-                 *
-                 * See:
-                 * https://msdn.microsoft.com/en-us/library/windows/desktop/bb204843(v=vs.85).aspx
-                 * https://msdn.microsoft.com/en-us/library/windows/desktop/bb694531%28v=vs.85%29.aspx#Virtual_Size
-                 *
-                 * Work around this for now by discarding mipmap levels that
-                 * would result in too-small textures. A correct solution
-                 * will be to decompress these levels manually, or add texture
-                 * sampling logic.
-                 *
-                 * >> Level 0: 64 x 8
-                 *    Level 1: 32 x 4
-                 *    Level 2: 16 x 2 << Ignored
-                 * >> Level 0: 16 x 16
-                 *    Level 1: 8 x 8
-                 *    Level 2: 4 x 4 << OK!
-                 */
-                if (log_width < 2 || log_height < 2) {
-                    /* Base level is smaller than 4x4... */
-                    levels = 1;
-                } else {
-                    levels = MIN(levels, MIN(log_width, log_height) - 1);
-                }
-            }
+
+            /* Discard mipmap levels that would be smaller than 1x1.
+             * FIXME: Is this actually needed?
+             *
+             * >> Level 0: 32 x 4
+             *    Level 1: 16 x 2
+             *    Level 2: 8 x 1
+             *    Level 3: 4 x 1
+             *    Level 4: 2 x 1
+             *    Level 5: 1 x 1
+             *
+             * DXT levels smaller than a block are kept too, see s3tc.h.
+             */
+            levels = MIN(levels, MAX(log_width, log_height) + 1);
             assert(levels > 0);
         }
 
@@ -3787,6 +4031,10 @@ static void pgraph_bind_textures(NV2AState *d)
 
         NV2A_DPRINTF(" - 0x%tx\n", texture_data - d->vram_ptr);
 
+        if (decode == TEX_DECODE_PALETTE) {
+            pgraph_upload_palette(pg, i, palette_data, palette_length);
+        }
+
         size_t length = 0;
         if (f.linear) {
             assert(cubemap == false);
@@ -3813,11 +4061,7 @@ static void pgraph_bind_textures(NV2AState *d)
                         block_size = 16;
                     }
 
-                    for (level = 0; level < levels; level++) {
-                        w = MAX(w, 4); h = MAX(h, 4);
-                        length += w/4 * h/4 * block_size;
-                        w /= 2; h /= 2;
-                    }
+                    length = s3tc_layout(w, h, levels, block_size, NULL);
                 }
                 if (cubemap) {
                     assert(dimensionality == 2);
@@ -3832,6 +4076,7 @@ static void pgraph_bind_textures(NV2AState *d)
 
         TextureShape state = {
             .cubemap = cubemap,
+            .decode = decode,
             .dimensionality = dimensionality,
             .color_format = color_format,
             .levels = levels,
@@ -3844,10 +4089,14 @@ static void pgraph_bind_textures(NV2AState *d)
         };
 
 #ifdef USE_TEXTURE_CACHE
-        uint64_t texture_hash = fast_hash(texture_data, length, 5003)
-                              ^ fnv_hash(palette_data, palette_length);
+        /* Decoded textures don't depend on the palette contents */
+        uint64_t texture_hash = fast_hash(texture_data, length, 5003);
+        if (decode != TEX_DECODE_PALETTE) {
+            texture_hash ^= fnv_hash(palette_data, palette_length);
+        }
 
         TextureKey key = {
+            .pg = pg,
             .state = state,
             .texture_data = texture_data,
             .palette_data = palette_data,
@@ -3859,70 +4108,77 @@ static void pgraph_bind_textures(NV2AState *d)
         TextureBinding *binding = key_out->binding;
         binding->refcnt++;
 #else
-        TextureBinding *binding = generate_texture(state,
+        TextureBinding *binding = generate_texture(pg, state,
                                                    texture_data, palette_data);
 #endif
 
         glBindTexture(binding->gl_target, binding->gl_texture);
 
-
-        if (f.linear) {
-            /* somtimes games try to set mipmap min filters on linear textures.
-             * this could indicate a bug... */
-            switch (min_filter) {
-            case NV_PGRAPH_TEXFILTER0_MIN_BOX_NEARESTLOD:
-            case NV_PGRAPH_TEXFILTER0_MIN_BOX_TENT_LOD:
-                min_filter = NV_PGRAPH_TEXFILTER0_MIN_BOX_LOD0;
-                break;
-            case NV_PGRAPH_TEXFILTER0_MIN_TENT_NEARESTLOD:
-            case NV_PGRAPH_TEXFILTER0_MIN_TENT_TENT_LOD:
-                min_filter = NV_PGRAPH_TEXFILTER0_MIN_TENT_LOD0;
-                break;
-            }
-        }
-
-        glTexParameteri(binding->gl_target, GL_TEXTURE_MIN_FILTER,
-            pgraph_texture_min_filter_map[min_filter]);
-        glTexParameteri(binding->gl_target, GL_TEXTURE_MAG_FILTER,
-            pgraph_texture_mag_filter_map[mag_filter]);
-
-        /* Texture wrapping */
-        assert(addru < ARRAY_SIZE(pgraph_texture_addr_map));
-        glTexParameteri(binding->gl_target, GL_TEXTURE_WRAP_S,
-            pgraph_texture_addr_map[addru]);
-        if (dimensionality > 1) {
-            assert(addrv < ARRAY_SIZE(pgraph_texture_addr_map));
-            glTexParameteri(binding->gl_target, GL_TEXTURE_WRAP_T,
-                pgraph_texture_addr_map[addrv]);
-        }
-        if (dimensionality > 2) {
-            assert(addrp < ARRAY_SIZE(pgraph_texture_addr_map));
-            glTexParameteri(binding->gl_target, GL_TEXTURE_WRAP_R,
-                pgraph_texture_addr_map[addrp]);
-        }
-
-        /* FIXME: Only upload if necessary? [s, t or r = GL_CLAMP_TO_BORDER] */
-        if (border_source == NV_PGRAPH_TEXFMT0_BORDER_SOURCE_COLOR) {
-            GLfloat gl_border_color[] = {
-                /* FIXME: Color channels might be wrong order */
-                ((border_color >> 16) & 0xFF) / 255.0f, /* red */
-                ((border_color >> 8) & 0xFF) / 255.0f,  /* green */
-                (border_color & 0xFF) / 255.0f,         /* blue */
-                ((border_color >> 24) & 0xFF) / 255.0f  /* alpha */
-            };
-            glTexParameterfv(binding->gl_target, GL_TEXTURE_BORDER_COLOR,
-                gl_border_color);
-        }
-
         if (pg->texture_binding[i]) {
             texture_binding_destroy(pg->texture_binding[i]);
         }
         pg->texture_binding[i] = binding;
+        pg->texture_decode[i] = decode;
         pg->texture_dirty[i] = false;
+        pgraph_set_texture_key(pg, i);
     }
     NV2A_GL_DGROUP_END();
 }
 
+/* Remember which draw packet key the stage was bound from */
+static void pgraph_set_texture_key(PGRAPHState *pg, int stage)
+{
+    if (pg->draw_packet) {
+        pg->texture_key[stage] = pg->draw_packet->texture_keys[stage];
+        pg->texture_key_valid[stage] = true;
+    }
+}
+
+/* Paletted and YUV textures sampled by a plain 2D projection are uploaded
+ * as they are and expanded by the fragment shader. Other texture modes
+ * still get the CPU conversion. */
+static enum PshTexDecode pgraph_texture_decode(PGRAPHState *pg, int stage)
+{
+    uint32_t fmt = pg->regs[NV_PGRAPH_TEXFMT0 + stage*4];
+
+    if (!(pg->regs[NV_PGRAPH_TEXCTL0_0 + stage*4]
+              & NV_PGRAPH_TEXCTL0_0_ENABLE)
+        || !psh_stage_is_project2d(pg->regs[NV_PGRAPH_SHADERPROG], stage)) {
+        return TEX_DECODE_NONE;
+    }
+
+    switch (GET_MASK(fmt, NV_PGRAPH_TEXFMT0_COLOR)) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+        if (GET_MASK(fmt, NV_PGRAPH_TEXFMT0_CUBEMAPENABLE)
+            || GET_MASK(fmt, NV_PGRAPH_TEXFMT0_DIMENSIONALITY) != 2) {
+            return TEX_DECODE_NONE;
+        }
+        return TEX_DECODE_PALETTE;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8:
+        return TEX_DECODE_YUY2;
+    default:
+        return TEX_DECODE_NONE;
+    }
+}
+
+static void pgraph_upload_palette(PGRAPHState *pg, int stage,
+                                  const uint8_t *palette_data,
+                                  unsigned int palette_length)
+{
+    uint64_t hash = fnv_hash(palette_data, palette_length * 4);
+    if (hash == pg->palette_hash[stage]) {
+        return;
+    }
+    pg->palette_hash[stage] = hash;
+    pg->palette_uploads++;
+
+    glActiveTexture(GL_TEXTURE0 + NV2A_MAX_TEXTURES + stage);
+    glBindTexture(GL_TEXTURE_1D, pg->gl_palette_texture[stage]);
+    glTexSubImage1D(GL_TEXTURE_1D, 0, 0, palette_length,
+                    GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, palette_data);
+    glActiveTexture(GL_TEXTURE0 + stage);
+}
+
 static void pgraph_apply_anti_aliasing_factor(PGRAPHState *pg,
                                               unsigned int *width,
                                               unsigned int *height)
@@ -3957,6 +4213,87 @@ static void pgraph_get_surface_dimensions(PGRAPHState *pg,
     }
 }
 
+/* Vertex data is checked for CPU writes once per draw, often page by page
+ * of the same buffers, and every check that found a page dirty used to walk
+ * the whole TLB to make the next CPU write to it take the notdirty slow path
+ * again. Instead, a dirty page stays dirty until the end of the epoch (the
+ * next flip) without being re-armed, so the CPU only takes the slow path on
+ * its first write to a page per frame, and the pages are re-armed with a
+ * single walk at the flip. Writes made after the last check of an epoch are
+ * caught by the carry bit in the next one.
+ *
+ * The mirror has a dirty client of its own, so leaving its pages unarmed
+ * does not hide CPU writes from the DIRTY_MEMORY_NV2A checks of surfaces:
+ * those clear their bits exactly and re-arm the TLB for what they clear.
+ *
+ * The dirty bitmap is read once for the whole range, and only the runs of
+ * dirty pages in it are uploaded. */
+static void pgraph_vram_upload_dirty(NV2AState *d, hwaddr addr, hwaddr end)
+{
+    PGRAPHState *pg = &d->pgraph;
+    hwaddr run_start = 0;
+    bool in_run = false;
+    hwaddr page_addr;
+
+    DirtyBitmapSnapshot *snap =
+        memory_region_snapshot_and_clear_dirty_deferred(
+            d->vram, addr, end - addr, DIRTY_MEMORY_NV2A_VERTEX);
+    for (page_addr = addr; page_addr < end; page_addr += TARGET_PAGE_SIZE) {
+        if (memory_region_snapshot_get_dirty(d->vram, snap, page_addr,
+                                             TARGET_PAGE_SIZE)) {
+            set_bit(page_addr >> TARGET_PAGE_BITS, pg->vram_epoch_dirty);
+            pg->vram_epoch_start = MIN(pg->vram_epoch_start, page_addr);
+            pg->vram_epoch_end = MAX(pg->vram_epoch_end,
+                                     page_addr + TARGET_PAGE_SIZE);
+        }
+    }
+    g_free(snap);
+
+    for (page_addr = addr; page_addr < end; page_addr += TARGET_PAGE_SIZE) {
+        unsigned long page = page_addr >> TARGET_PAGE_BITS;
+        bool carry = test_and_clear_bit(page, pg->vram_epoch_carry);
+
+        if (carry || test_bit(page, pg->vram_epoch_dirty)) {
+            if (!in_run) {
+                run_start = page_addr;
+                in_run = true;
+            }
+        } else if (in_run) {
+            pgraph_memory_buffer_upload(d, run_start, page_addr);
+            in_run = false;
+        }
+    }
+    if (in_run) {
+        pgraph_memory_buffer_upload(d, run_start, end);
+    }
+}
+
+static void pgraph_vram_dirty_epoch_end(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    hwaddr vram_size = memory_region_size(d->vram);
+    unsigned long pages = vram_size >> TARGET_PAGE_BITS;
+
+    if (pg->vram_epoch_start >= pg->vram_epoch_end) {
+        return;
+    }
+
+    memory_region_rearm_dirty(d->vram, pg->vram_epoch_start,
+                              pg->vram_epoch_end - pg->vram_epoch_start);
+    bitmap_or(pg->vram_epoch_carry, pg->vram_epoch_carry,
+              pg->vram_epoch_dirty, pages);
+    bitmap_zero(pg->vram_epoch_dirty, pages);
+
+    pg->vram_epoch_start = vram_size;
+    pg->vram_epoch_end = 0;
+}
+
+static void pgraph_memory_buffer_upload(NV2AState *d, hwaddr addr, hwaddr end)
+{
+    glBufferSubData(GL_ARRAY_BUFFER, addr, end - addr, d->vram_ptr + addr);
+    d->pgraph.memory_buffer_upload_bytes += end - addr;
+}
+
 static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size,
                                         bool f)
 {
@@ -3965,11 +4302,48 @@ static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size,
     hwaddr end = TARGET_PAGE_ALIGN(addr + size);
     addr &= TARGET_PAGE_MASK;
     assert(end < memory_region_size(d->vram));
-    if (f || memory_region_test_and_clear_dirty(d->vram,
-                                                addr,
-                                                end - addr,
-                                                DIRTY_MEMORY_NV2A)) {
-        glBufferSubData(GL_ARRAY_BUFFER, addr, end - addr, d->vram_ptr + addr);
+    if (f) {
+        pgraph_memory_buffer_upload(d, addr, end);
+    } else {
+        pgraph_vram_upload_dirty(d, addr, end);
+    }
+}
+
+/* Attributes interleaved in one vertex buffer cover the same pages, so the
+ * page aligned ranges of a draw are merged first and each page is checked
+ * and uploaded once. */
+static void pgraph_update_memory_buffer_ranges(NV2AState *d, hwaddr *start,
+                                               hwaddr *end,
+                                               unsigned int num_ranges)
+{
+    unsigned int i, j, num_merged = 0;
+
+    glBindBuffer(GL_ARRAY_BUFFER, d->pgraph.gl_memory_buffer);
+
+    /* Insertion sort by start, there is at most one range per attribute */
+    for (i = 1; i < num_ranges; i++) {
+        hwaddr s = start[i], e = end[i];
+        for (j = i; j > 0 && start[j - 1] > s; j--) {
+            start[j] = start[j - 1];
+            end[j] = end[j - 1];
+        }
+        start[j] = s;
+        end[j] = e;
+    }
+
+    /* Merge overlapping and adjacent ranges */
+    for (i = 0; i < num_ranges; i++) {
+        if (num_merged && start[i] <= end[num_merged - 1]) {
+            end[num_merged - 1] = MAX(end[num_merged - 1], end[i]);
+        } else {
+            start[num_merged] = start[i];
+            end[num_merged] = end[i];
+            num_merged++;
+        }
+    }
+
+    for (i = 0; i < num_merged; i++) {
+        pgraph_vram_upload_dirty(d, start[i], end[i]);
     }
 }
 
@@ -3980,6 +4354,9 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
 {
     int i, j;
     PGRAPHState *pg = &d->pgraph;
+    hwaddr range_start[NV2A_VERTEXSHADER_ATTRIBUTES];
+    hwaddr range_end[NV2A_VERTEXSHADER_ATTRIBUTES];
+    unsigned int num_ranges = 0;
 
     if (inline_data) {
         NV2A_GL_DGROUP_BEGIN("%s (num_elements: %d inline stride: %d)",
@@ -4072,9 +4449,13 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
                                       (void*)(uintptr_t)attribute->inline_array_offset);
             } else {
                 hwaddr addr = data - d->vram_ptr;
-                pgraph_update_memory_buffer(d, addr,
-                                            num_elements * attribute->stride,
-                                            false);
+                range_start[num_ranges] = addr & TARGET_PAGE_MASK;
+                range_end[num_ranges] =
+                    TARGET_PAGE_ALIGN(addr + num_elements * attribute->stride);
+                assert(range_end[num_ranges] < memory_region_size(d->vram));
+                num_ranges++;
+
+                glBindBuffer(GL_ARRAY_BUFFER, pg->gl_memory_buffer);
                 glVertexAttribPointer(i,
                     attribute->gl_count,
                     attribute->gl_type,
@@ -4089,6 +4470,11 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
             glVertexAttrib4fv(i, attribute->inline_value);
         }
     }
+
+    if (num_ranges) {
+        pgraph_update_memory_buffer_ranges(d, range_start, range_end,
+                                           num_ranges);
+    }
     NV2A_GL_DGROUP_END();
 }
 
@@ -4127,6 +4513,87 @@ static unsigned int pgraph_bind_inline_array(NV2AState *d)
     return index_count;
 }
 
+/* Filled quads and quad strips are drawn as indexed triangles rather than
+ * through a geometry shader. Each quad is split along the same diagonal the
+ * geometry shader used. */
+static bool pgraph_draws_quads(PGRAPHState *pg)
+{
+    return (pg->primitive_mode == PRIM_TYPE_QUADS
+            || pg->primitive_mode == PRIM_TYPE_QUAD_STRIP)
+        && pg->shader_binding->gl_primitive_mode == GL_TRIANGLES;
+}
+
+static unsigned int pgraph_quad_index_count(PGRAPHState *pg,
+                                            unsigned int vertex_count)
+{
+    if (pg->primitive_mode == PRIM_TYPE_QUADS) {
+        return vertex_count / 4 * 6;
+    }
+    return vertex_count < 4 ? 0 : (vertex_count - 2) / 2 * 6;
+}
+
+/* Write the triangle indices for vertex_count vertices, looked up in
+ * elements unless it is NULL, and return their number */
+static unsigned int pgraph_quad_indices(PGRAPHState *pg, uint32_t *out,
+                                        const uint32_t *elements,
+                                        unsigned int vertex_count)
+{
+    static const uint8_t quad[6] = { 0, 1, 3, 3, 1, 2 };
+    static const uint8_t quad_strip[6] = { 0, 1, 2, 2, 1, 3 };
+    bool strip = pg->primitive_mode == PRIM_TYPE_QUAD_STRIP;
+    const uint8_t *pattern = strip ? quad_strip : quad;
+    unsigned int n = pgraph_quad_index_count(pg, vertex_count);
+    unsigned int i, j, base;
+
+    for (i = 0, base = 0; i < n; i += 6, base += strip ? 2 : 4) {
+        for (j = 0; j < 6; j++) {
+            uint32_t v = base + pattern[j];
+            out[i + j] = elements ? elements[v] : v;
+        }
+    }
+
+    return n;
+}
+
+/* Bind the index buffer for up to vertex_count consecutive vertices of the
+ * current quad primitive. The buffers are shared by all draws (with a base
+ * vertex) and only ever grow. */
+static unsigned int pgraph_bind_quad_index_buffer(PGRAPHState *pg,
+                                                  unsigned int vertex_count)
+{
+    int strip = pg->primitive_mode == PRIM_TYPE_QUAD_STRIP;
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pg->gl_quad_index_buffer[strip]);
+
+    if (vertex_count > pg->quad_index_buffer_vertices[strip]) {
+        unsigned int vertices = MAX(pow2ceil(vertex_count), 1024);
+        uint32_t *indices = g_new(uint32_t,
+                                  pgraph_quad_index_count(pg, vertices));
+        unsigned int n = pgraph_quad_indices(pg, indices, NULL, vertices);
+
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, n * sizeof(uint32_t), indices,
+                     GL_STATIC_DRAW);
+        g_free(indices);
+        pg->quad_index_buffer_vertices[strip] = vertices;
+    }
+
+    return pgraph_quad_index_count(pg, vertex_count);
+}
+
+static void pgraph_draw_arrays(PGRAPHState *pg, GLint first, GLsizei count)
+{
+    if (pgraph_draws_quads(pg)) {
+        GLsizei index_count = pgraph_bind_quad_index_buffer(pg, count);
+        if (index_count) {
+            glDrawElementsBaseVertex(GL_TRIANGLES, index_count,
+                                     GL_UNSIGNED_INT, (void *)0, first);
+        }
+        return;
+    }
+
+    glDrawArrays(pg->shader_binding->gl_primitive_mode, first, count);
+}
+
 /* 16 bit to [0.0, F16_MAX = 511.9375] */
 static float convert_f16_to_float(uint16_t f16) {
     if (f16 == 0x0000) { return 0.0; }
@@ -4164,6 +4631,30 @@ static void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix,
     *b = cliptobyte((298 * c + 516 * d + 128) >> 8);
 }
 
+/* Host format of a texture as uploaded, before any shader decoding */
+static ColorFormatInfo texture_color_format(const TextureShape *s)
+{
+    ColorFormatInfo f = kelvin_color_format_map[s->color_format];
+
+    switch (s->decode) {
+    case TEX_DECODE_PALETTE:
+        f.gl_internal_format = GL_R8;
+        f.gl_format = GL_RED;
+        f.gl_type = GL_UNSIGNED_BYTE;
+        break;
+    case TEX_DECODE_YUY2:
+        /* Two pixels per texel */
+        f.bytes_per_pixel = 4;
+        f.gl_internal_format = GL_RGBA8;
+        f.gl_format = GL_RGBA;
+        f.gl_type = GL_UNSIGNED_BYTE;
+        break;
+    default:
+        break;
+    }
+    return f;
+}
+
 static uint8_t* convert_texture_data(const TextureShape s,
                                      const uint8_t *data,
                                      const uint8_t *palette_data,
@@ -4173,7 +4664,10 @@ static uint8_t* convert_texture_data(const TextureShape s,
                                      unsigned int row_pitch,
                                      unsigned int slice_pitch)
 {
-    if (s.color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8) {
+    if (s.decode != TEX_DECODE_NONE) {
+        return NULL;
+    } else if (s.color_format
+                   == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8) {
         assert(depth == 1); /* FIXME */
         uint8_t* converted_data = (uint8_t*)g_malloc(width * height * 4);
         int x, y;
@@ -4224,148 +4718,398 @@ static uint8_t* convert_texture_data(const TextureShape s,
     }
 }
 
-static void upload_gl_texture(GLenum gl_target,
-                              const TextureShape s,
-                              const uint8_t *texture_data,
-                              const uint8_t *palette_data)
+static bool texture_needs_conversion(const TextureShape *s)
 {
-    ColorFormatInfo f = kelvin_color_format_map[s.color_format];
+    if (s->decode != TEX_DECODE_NONE) {
+        return false;
+    }
+    switch (s->color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Bytes per pixel of the data handed to GL, see convert_texture_data */
+static unsigned int texture_upload_bytes_per_pixel(const TextureShape *s)
+{
+    if (!texture_needs_conversion(s)) {
+        return texture_color_format(s).bytes_per_pixel;
+    }
+    return s->color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5 ? 3 : 4;
+}
+
+/* Split the upload of one image (the texture or one cubemap face) into a
+ * job per mip level, laid out in the staging buffer from *staging_size */
+static unsigned int texture_upload_plan(const TextureShape *s,
+                                        GLenum gl_target,
+                                        const uint8_t *texture_data,
+                                        TextureUploadJob *jobs,
+                                        size_t *staging_size)
+{
+    ColorFormatInfo f = texture_color_format(s);
+    unsigned int bytes_per_pixel = texture_upload_bytes_per_pixel(s);
+    unsigned int width = s->width, height = s->height, depth = s->depth;
+    unsigned int num_jobs = 0;
+    int level;
+
+    assert(gl_target != GL_TEXTURE_1D);
+
+    if (gl_target == GL_TEXTURE_RECTANGLE) {
+        TextureUploadJob *job = &jobs[num_jobs++];
 
-    switch(gl_target) {
-    case GL_TEXTURE_1D:
-        assert(false);
-        break;
-    case GL_TEXTURE_RECTANGLE: {
         /* Can't handle strides unaligned to pixels */
-        assert(s.pitch % f.bytes_per_pixel == 0);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH,
-                      s.pitch / f.bytes_per_pixel);
+        assert(s->pitch % f.bytes_per_pixel == 0);
 
-        uint8_t *converted = convert_texture_data(s, texture_data,
-                                                  palette_data,
-                                                  s.width, s.height, 1,
-                                                  s.pitch, 0);
+        *job = (TextureUploadJob) {
+            .gl_target = gl_target,
+            .width = s->decode == TEX_DECODE_YUY2 ? (width + 1) / 2 : width,
+            .height = height,
+            .depth = 1,
+            .src = texture_data,
+            .offset = *staging_size,
+        };
+        if (texture_needs_conversion(s)) {
+            job->size = width * height * bytes_per_pixel;
+        } else {
+            job->row_length = s->pitch / f.bytes_per_pixel;
+            job->size = s->pitch * height;
+        }
+        *staging_size = QEMU_ALIGN_UP(*staging_size + job->size, 16);
+        return num_jobs;
+    }
 
-        glTexImage2D(gl_target, 0, f.gl_internal_format,
-                     s.width, s.height, 0,
-                     f.gl_format, f.gl_type,
-                     converted ? converted : texture_data);
+    if (gl_target != GL_TEXTURE_3D) {
+        depth = 1;
+    }
 
-        if (converted) {
-          g_free(converted);
+    if (f.gl_format == 0) { /* compressed */
+        S3TCLevel levels[NV2A_TEXTURE_MAX_UPLOAD_JOBS];
+        unsigned int block_size;
+        if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+            block_size = 8;
+        } else {
+            block_size = 16;
         }
 
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-        break;
+        /* Take the level sizes and offsets from s3tc_layout as they are,
+         * so they are the ones tests/test-nv2a-s3tc checks */
+        assert(s->levels <= ARRAY_SIZE(levels));
+        s3tc_layout(width, height, s->levels, block_size, levels);
+
+        for (level = 0; level < s->levels; level++) {
+            TextureUploadJob *job = &jobs[num_jobs++];
+
+            *job = (TextureUploadJob) {
+                .gl_target = gl_target,
+                .level = level,
+                .width = levels[level].width,
+                .height = levels[level].height,
+                .depth = MAX(depth >> level, 1),
+                .src = texture_data + levels[level].offset,
+                .offset = *staging_size,
+                .size = levels[level].size,
+            };
+            *staging_size = QEMU_ALIGN_UP(*staging_size + job->size, 16);
+        }
+        return num_jobs;
     }
-    case GL_TEXTURE_2D:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_X:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_X:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_Y:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_Y:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_Z:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_Z: {
 
-        unsigned int width = s.width, height = s.height;
+    for (level = 0; level < s->levels; level++) {
+        TextureUploadJob *job = &jobs[num_jobs++];
+        size_t length;
+
+        width = MAX(width, 1); height = MAX(height, 1);
+        depth = MAX(depth, 1);
+
+        length = width * height * depth * f.bytes_per_pixel;
+        job->size = width * height * depth * bytes_per_pixel;
+
+        job->gl_target = gl_target;
+        job->level = level;
+        job->width = width;
+        job->height = height;
+        job->depth = depth;
+        job->row_length = 0;
+        job->src = texture_data;
+        job->offset = *staging_size;
+        *staging_size = QEMU_ALIGN_UP(*staging_size + job->size, 16);
+
+        texture_data += length;
+        width /= 2;
+        height /= 2;
+        depth /= 2;
+    }
 
-        int level;
-        for (level = 0; level < s.levels; level++) {
-            if (f.gl_format == 0) { /* compressed */
+    return num_jobs;
+}
 
-                width = MAX(width, 4); height = MAX(height, 4);
+/* Unswizzle and convert one job into its place in the staging buffer.
+ * Runs on the texture workers, so must not touch GL or PGRAPH state. */
+static void texture_upload_job_run(const TextureShape *s,
+                                   const uint8_t *palette_data,
+                                   const TextureUploadJob *job,
+                                   uint8_t *staging)
+{
+    ColorFormatInfo f = texture_color_format(s);
+    uint8_t *dst = staging + job->offset;
+    bool convert = texture_needs_conversion(s);
 
-                unsigned int block_size;
-                if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
-                    block_size = 8;
-                } else {
-                    block_size = 16;
-                }
+    if (f.gl_format == 0 || (job->gl_target == GL_TEXTURE_RECTANGLE
+                             && !convert)) {
+        memcpy(dst, job->src, job->size);
+        return;
+    }
 
-                glCompressedTexImage2D(gl_target, level, f.gl_internal_format,
-                                       width, height, 0,
-                                       width/4 * height/4 * block_size,
-                                       texture_data);
+    if (job->gl_target == GL_TEXTURE_RECTANGLE) {
+        uint8_t *converted = convert_texture_data(*s, job->src, palette_data,
+                                                  s->width, s->height, 1,
+                                                  s->pitch, 0);
+        memcpy(dst, converted, job->size);
+        g_free(converted);
+        return;
+    }
 
-                texture_data += width/4 * height/4 * block_size;
-            } else {
+    unsigned int row_pitch = job->width * f.bytes_per_pixel;
+    unsigned int slice_pitch = row_pitch * job->height;
+    uint8_t *unswizzled = convert ? g_malloc(slice_pitch * job->depth) : dst;
 
-                width = MAX(width, 1); height = MAX(height, 1);
+    if (job->gl_target == GL_TEXTURE_3D) {
+        unswizzle_box(job->src, job->width, job->height, job->depth,
+                      unswizzled, row_pitch, slice_pitch, f.bytes_per_pixel);
+    } else {
+        unswizzle_rect(job->src, job->width, job->height,
+                       unswizzled, row_pitch, f.bytes_per_pixel);
+    }
 
-                unsigned int pitch = width * f.bytes_per_pixel;
-                uint8_t *unswizzled = (uint8_t*)g_malloc(height * pitch);
-                unswizzle_rect(texture_data, width, height,
-                               unswizzled, pitch, f.bytes_per_pixel);
+    if (convert) {
+        uint8_t *converted = convert_texture_data(*s, unswizzled,
+                                                  palette_data,
+                                                  job->width, job->height,
+                                                  job->depth,
+                                                  row_pitch, slice_pitch);
+        memcpy(dst, converted, job->size);
+        g_free(converted);
+        g_free(unswizzled);
+    }
+}
 
-                uint8_t *converted = convert_texture_data(s, unswizzled,
-                                                          palette_data,
-                                                          width, height, 1,
-                                                          pitch, 0);
+/* Copy a prepared job from the bound staging buffer to the texture. With
+ * immutable storage the levels are already allocated and only filled. */
+static void texture_upload_job_submit(const TextureShape *s,
+                                      const TextureUploadJob *job,
+                                      bool immutable)
+{
+    ColorFormatInfo f = texture_color_format(s);
+    const GLvoid *data = (const GLvoid *)(uintptr_t)job->offset;
+
+    if (immutable) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, job->row_length);
+        if (job->gl_target == GL_TEXTURE_3D) {
+            assert(f.gl_format != 0); /* FIXME: compressed not supported yet */
+            glTexSubImage3D(job->gl_target, job->level, 0, 0, 0,
+                            job->width, job->height, job->depth,
+                            f.gl_format, f.gl_type, data);
+        } else if (f.gl_format == 0) {
+            glCompressedTexSubImage2D(job->gl_target, job->level, 0, 0,
+                                      job->width, job->height,
+                                      f.gl_internal_format,
+                                      job->size, data);
+        } else {
+            glTexSubImage2D(job->gl_target, job->level, 0, 0,
+                            job->width, job->height,
+                            f.gl_format, f.gl_type, data);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        return;
+    }
 
-                glTexImage2D(gl_target, level, f.gl_internal_format,
-                             width, height, 0,
-                             f.gl_format, f.gl_type,
-                             converted ? converted : unswizzled);
+    switch (job->gl_target) {
+    case GL_TEXTURE_RECTANGLE:
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, job->row_length);
+        glTexImage2D(job->gl_target, 0, f.gl_internal_format,
+                     job->width, job->height, 0,
+                     f.gl_format, f.gl_type, data);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        break;
+    case GL_TEXTURE_3D:
+        assert(f.gl_format != 0); /* FIXME: compressed not supported yet */
+        assert(f.linear == false);
+        glTexImage3D(job->gl_target, job->level, f.gl_internal_format,
+                     job->width, job->height, job->depth, 0,
+                     f.gl_format, f.gl_type, data);
+        break;
+    default:
+        if (f.gl_format == 0) {
+            glCompressedTexImage2D(job->gl_target, job->level,
+                                   f.gl_internal_format,
+                                   job->width, job->height, 0,
+                                   job->size, data);
+        } else {
+            glTexImage2D(job->gl_target, job->level, f.gl_internal_format,
+                         job->width, job->height, 0,
+                         f.gl_format, f.gl_type, data);
+        }
+        break;
+    }
+}
 
-                if (converted) {
-                    g_free(converted);
-                }
-                g_free(unswizzled);
+/* Take jobs off the current batch until none are left. Called with the
+ * workers lock held, which is dropped while a job runs. */
+static void texture_workers_drain(TextureWorkers *w)
+{
+    while (w->next_job < w->num_jobs) {
+        const TextureShape *s = w->shape;
+        const uint8_t *palette_data = w->palette_data;
+        const TextureUploadJob *job = &w->jobs[w->next_job++];
+        uint8_t *staging = w->staging;
+
+        qemu_mutex_unlock(&w->lock);
+        texture_upload_job_run(s, palette_data, job, staging);
+        qemu_mutex_lock(&w->lock);
+
+        if (++w->jobs_done == w->num_jobs) {
+            qemu_cond_signal(&w->done_cond);
+        }
+    }
+}
 
-                texture_data += width * height * f.bytes_per_pixel;
-            }
+static void *texture_worker_thread(void *arg)
+{
+    TextureWorkers *w = (TextureWorkers *)arg;
 
-            width /= 2;
-            height /= 2;
+    qemu_mutex_lock(&w->lock);
+    while (!w->exiting) {
+        if (w->next_job < w->num_jobs) {
+            texture_workers_drain(w);
+        } else {
+            qemu_cond_wait(&w->work_cond, &w->lock);
         }
+    }
+    qemu_mutex_unlock(&w->lock);
 
-        break;
+    return NULL;
+}
+
+static void texture_workers_init(TextureWorkers *w)
+{
+    int i;
+
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->work_cond);
+    qemu_cond_init(&w->done_cond);
+
+    w->threads = g_new0(QemuThread, w->num_threads);
+    for (i = 0; i < w->num_threads; i++) {
+        qemu_thread_create(&w->threads[i], "nv2a.texture_worker",
+                           texture_worker_thread, w, QEMU_THREAD_JOINABLE);
     }
-    case GL_TEXTURE_3D: {
+}
+
+static void texture_workers_destroy(TextureWorkers *w)
+{
+    int i;
 
-        unsigned int width = s.width, height = s.height, depth = s.depth;
+    qemu_mutex_lock(&w->lock);
+    w->exiting = true;
+    qemu_cond_broadcast(&w->work_cond);
+    qemu_mutex_unlock(&w->lock);
 
-        assert(f.gl_format != 0); /* FIXME: compressed not supported yet */
-        assert(f.linear == false);
+    for (i = 0; i < w->num_threads; i++) {
+        qemu_thread_join(&w->threads[i]);
+    }
+    g_free(w->threads);
 
-        int level;
-        for (level = 0; level < s.levels; level++) {
-
-            unsigned int row_pitch = width * f.bytes_per_pixel;
-            unsigned int slice_pitch = row_pitch * height;
-            uint8_t *unswizzled = (uint8_t*)g_malloc(slice_pitch * depth);
-            unswizzle_box(texture_data, width, height, depth, unswizzled,
-                           row_pitch, slice_pitch, f.bytes_per_pixel);
-
-            uint8_t *converted = convert_texture_data(s, unswizzled,
-                                                      palette_data,
-                                                      width, height, depth,
-                                                      row_pitch, slice_pitch);
-
-            glTexImage3D(gl_target, level, f.gl_internal_format,
-                         width, height, depth, 0,
-                         f.gl_format, f.gl_type,
-                         converted ? converted : unswizzled);
-
-            if (converted) {
-                g_free(converted);
-            }
-            g_free(unswizzled);
+    qemu_cond_destroy(&w->done_cond);
+    qemu_cond_destroy(&w->work_cond);
+    qemu_mutex_destroy(&w->lock);
+}
 
-            texture_data += width * height * depth * f.bytes_per_pixel;
+/* Prepare all jobs into the staging buffer, the calling thread helps out */
+static void texture_workers_run(TextureWorkers *w,
+                                const TextureShape *s,
+                                const uint8_t *palette_data,
+                                const TextureUploadJob *jobs,
+                                unsigned int num_jobs,
+                                uint8_t *staging,
+                                size_t staging_size)
+{
+    int i;
 
-            width /= 2;
-            height /= 2;
-            depth /= 2;
+    if (w->num_threads == 0 || num_jobs == 1
+        || staging_size < NV2A_TEXTURE_WORKER_MIN_SIZE) {
+        for (i = 0; i < num_jobs; i++) {
+            texture_upload_job_run(s, palette_data, &jobs[i], staging);
         }
-        break;
+        return;
     }
-    default:
-        assert(false);
-        break;
+
+    qemu_mutex_lock(&w->lock);
+    w->shape = s;
+    w->palette_data = palette_data;
+    w->jobs = jobs;
+    w->staging = staging;
+    w->next_job = 0;
+    w->jobs_done = 0;
+    w->num_jobs = num_jobs;
+    qemu_cond_broadcast(&w->work_cond);
+
+    texture_workers_drain(w);
+    while (w->jobs_done < w->num_jobs) {
+        qemu_cond_wait(&w->done_cond, &w->lock);
+    }
+    w->num_jobs = 0;
+    w->next_job = 0;
+    qemu_mutex_unlock(&w->lock);
+}
+
+static void pgraph_upload_texture(PGRAPHState *pg,
+                                  const TextureShape *s,
+                                  const uint8_t *palette_data,
+                                  const TextureUploadJob *jobs,
+                                  unsigned int num_jobs,
+                                  size_t staging_size,
+                                  bool immutable)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int i;
+
+    /* Orphan the previous contents so the map doesn't wait on the GPU */
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pg->gl_texture_pbo);
+    if (staging_size > pg->texture_pbo_size) {
+        pg->texture_pbo_size = pow2ceil(staging_size);
+    }
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, pg->texture_pbo_size, NULL,
+                 GL_STREAM_DRAW);
+    uint8_t *staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+                                        0, staging_size,
+                                        GL_MAP_WRITE_BIT
+                                        | GL_MAP_INVALIDATE_BUFFER_BIT);
+    assert(staging != NULL);
+
+    texture_workers_run(&pg->texture_workers, s, palette_data,
+                        jobs, num_jobs, staging, staging_size);
+
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    int64_t decoded = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    pg->texture_decode_ns += decoded - start;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (i = 0; i < num_jobs; i++) {
+        texture_upload_job_submit(s, &jobs[i], immutable);
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    pg->texture_upload_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - decoded;
 }
 
-static TextureBinding* generate_texture(const TextureShape s,
+static TextureBinding* generate_texture(PGRAPHState *pg,
+                                        const TextureShape s,
                                         const uint8_t *texture_data,
                                         const uint8_t *palette_data)
 {
@@ -4412,6 +5156,12 @@ static TextureBinding* generate_texture(const TextureShape s,
                    s.dimensionality, s.cubemap ? " (Cubemap)" : "",
                    s.width, s.height, s.depth);
 
+    TextureUploadJob jobs[NV2A_TEXTURE_MAX_UPLOAD_JOBS];
+    unsigned int num_jobs = 0;
+    size_t staging_size = 0;
+
+    assert(s.levels <= NV2A_TEXTURE_MAX_UPLOAD_JOBS / 6);
+
     if (gl_target == GL_TEXTURE_CUBE_MAP) {
 
         ColorFormatInfo f = kelvin_color_format_map[s.color_format];
@@ -4425,35 +5175,50 @@ static TextureBinding* generate_texture(const TextureShape s,
         size_t length = 0;
         unsigned int w = s.width, h = s.height;
         int level;
-        for (level = 0; level < s.levels; level++) {
-            if (f.gl_format == 0) {
-                length += w/4 * h/4 * block_size;
-            } else {
+        if (f.gl_format == 0) {
+            length = s3tc_layout(w, h, s.levels, block_size, NULL);
+        } else {
+            for (level = 0; level < s.levels; level++) {
                 length += w * h * f.bytes_per_pixel;
+                w /= 2;
+                h /= 2;
             }
-
-            w /= 2;
-            h /= 2;
         }
 
         length = (length + NV2A_CUBEMAP_FACE_ALIGNMENT - 1) & ~(NV2A_CUBEMAP_FACE_ALIGNMENT - 1);
 
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_X,
-                          s, texture_data + 0 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
-                          s, texture_data + 1 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Y,
-                          s, texture_data + 2 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
-                          s, texture_data + 3 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Z,
-                          s, texture_data + 4 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z,
-                          s, texture_data + 5 * length, palette_data);
+        int face;
+        for (face = 0; face < 6; face++) {
+            num_jobs += texture_upload_plan(&s,
+                                            GL_TEXTURE_CUBE_MAP_POSITIVE_X + face,
+                                            texture_data + face * length,
+                                            &jobs[num_jobs], &staging_size);
+        }
     } else {
-        upload_gl_texture(gl_target, s, texture_data, palette_data);
+        num_jobs = texture_upload_plan(&s, gl_target, texture_data,
+                                       jobs, &staging_size);
+    }
+
+    /* Allocate every level up front, so the driver doesn't have to
+     * revalidate the texture as each level is specified */
+    bool immutable = pg->texture_storage;
+    if (immutable) {
+        GLenum gl_internal_format = texture_color_format(&s).gl_internal_format;
+        if (gl_target == GL_TEXTURE_3D) {
+            glTexStorage3D(gl_target, num_jobs, gl_internal_format,
+                           jobs[0].width, jobs[0].height, jobs[0].depth);
+        } else {
+            glTexStorage2D(gl_target,
+                           gl_target == GL_TEXTURE_CUBE_MAP ? num_jobs / 6
+                                                            : num_jobs,
+                           gl_internal_format,
+                           jobs[0].width, jobs[0].height);
+        }
     }
 
+    pgraph_upload_texture(pg, &s, palette_data, jobs, num_jobs, staging_size,
+                          immutable);
+
     /* Linear textures don't support mipmapping */
     if (!f.linear) {
         glTexParameteri(gl_target, GL_TEXTURE_BASE_LEVEL,
@@ -4486,15 +5251,48 @@ static void texture_binding_destroy(gpointer data)
     }
 }
 
+/* Estimate the host memory used by a texture, for the cache budget */
+static size_t texture_host_size(const TextureShape *s)
+{
+    ColorFormatInfo f = kelvin_color_format_map[s->color_format];
+    unsigned int w = s->width, h = s->height, d = s->depth;
+    size_t size = 0;
+    int level;
+
+    for (level = 0; level < s->levels; level++) {
+        if (f.gl_format == 0) {
+            /* S3TC blocks stay compressed */
+            unsigned int block_size =
+                f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+                    ? 8 : 16;
+            size += s3tc_level_size(w, h, block_size);
+        } else if (s->color_format
+                       == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8
+                   && s->decode == TEX_DECODE_NONE) {
+            /* Palettized textures are expanded */
+            size += (size_t)w * h * d * 4;
+        } else {
+            size += (size_t)w * h * d * f.bytes_per_pixel;
+        }
+
+        w = MAX(w / 2, 1);
+        h = MAX(h / 2, 1);
+        d = MAX(d / 2, 1);
+    }
+
+    return s->cubemap ? size * 6 : size;
+}
+
 /* functions for texture LRU cache */
 static struct lru_node *texture_cache_entry_init(struct lru_node *obj, void *key)
 {
     struct TextureKey *k_out = container_of(obj, struct TextureKey, node);
     struct TextureKey *k_in = (struct TextureKey *)key;
     memcpy(k_out, k_in, sizeof(struct TextureKey));
-    k_out->binding = generate_texture(k_in->state,
+    k_out->binding = generate_texture(k_in->pg, k_in->state,
                                       k_in->texture_data,
                                       k_in->palette_data);
+    obj->size = texture_host_size(&k_in->state);
     return obj;
 }
 
@@ -4523,6 +5321,64 @@ static gboolean shader_equal(gconstpointer a, gconstpointer b)
     return memcmp(as, bs, sizeof(ShaderState)) == 0;
 }
 
+/* Wrap mode of a texture coordinate, resolved the way GL resolved it back
+ * when it was set on the texture itself */
+static GLenum pgraph_texture_wrap(unsigned int addr, bool linear)
+{
+    assert(addr < ARRAY_SIZE(pgraph_texture_addr_map));
+    GLenum wrap = pgraph_texture_addr_map[addr];
+    if (linear) {
+        /* Rectangle textures can't repeat or mirror */
+        return wrap == GL_CLAMP_TO_BORDER ? wrap : GL_CLAMP_TO_EDGE;
+    }
+    return wrap ? wrap : GL_REPEAT;
+}
+
+static void pgraph_bind_sampler(PGRAPHState *pg, int unit,
+                                const SamplerKey *key)
+{
+    GLuint sampler = GPOINTER_TO_UINT(
+        g_hash_table_lookup(pg->sampler_cache, key));
+
+    if (!sampler) {
+        glGenSamplers(1, &sampler);
+        glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, key->min_filter);
+        glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, key->mag_filter);
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, key->wrap_s);
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, key->wrap_t);
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, key->wrap_r);
+
+        GLfloat gl_border_color[] = {
+            /* FIXME: Color channels might be wrong order */
+            ((key->border_color >> 16) & 0xFF) / 255.0f, /* red */
+            ((key->border_color >> 8) & 0xFF) / 255.0f,  /* green */
+            (key->border_color & 0xFF) / 255.0f,         /* blue */
+            ((key->border_color >> 24) & 0xFF) / 255.0f  /* alpha */
+        };
+        glSamplerParameterfv(sampler, GL_TEXTURE_BORDER_COLOR,
+                             gl_border_color);
+
+        g_hash_table_insert(pg->sampler_cache,
+                            g_memdup(key, sizeof(SamplerKey)),
+                            GUINT_TO_POINTER(sampler));
+    }
+
+    if (pg->texture_sampler[unit] != sampler) {
+        glBindSampler(unit, sampler);
+        pg->texture_sampler[unit] = sampler;
+    }
+}
+
+/* hash and equality for sampler cache hash table */
+static guint sampler_hash(gconstpointer key)
+{
+    return fnv_hash((const uint8_t *)key, sizeof(SamplerKey));
+}
+static gboolean sampler_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(SamplerKey)) == 0;
+}
+
 static unsigned int kelvin_map_stencil_op(uint32_t parameter)
 {
     unsigned int op;
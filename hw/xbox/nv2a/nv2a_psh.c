@@ -514,6 +514,88 @@ static void add_final_stage_code(struct PixelShader *ps, struct FCInputInfo fina
 
 
 
+/* Declare the sampler for a decoded PROJECT2D stage along with a
+ * texDecode%d(uv) function that returns the expanded colour. Indices and
+ * chroma pairs must not be filtered, so the texture itself is always
+ * sampled with GL_NEAREST and bilinear filtering is done here on the
+ * decoded texels.
+ */
+static void add_tex_decode(struct PixelShader *ps, QString *preflight, int i)
+{
+    switch (ps->state.tex_decode[i]) {
+    case TEX_DECODE_PALETTE:
+        assert(!ps->state.rect_tex[i]);
+        qstring_append_fmt(preflight, "uniform sampler2D texSamp%d;\n", i);
+        qstring_append_fmt(preflight, "uniform sampler1D palette%d;\n", i);
+        qstring_append_fmt(preflight,
+            "vec4 paletteLookup%d(float index) {\n"
+            "  return texelFetch(palette%d, int(index * 255.0 + 0.5), 0);\n"
+            "}\n", i, i);
+        if (!ps->state.tex_decode_linear[i]) {
+            qstring_append_fmt(preflight,
+                "vec4 texDecode%d(vec2 uv) {\n"
+                "  return paletteLookup%d(texture(texSamp%d, uv).r);\n"
+                "}\n", i, i, i);
+            break;
+        }
+        /* Pick the level the hardware would have used, then filter the
+         * four nearest texels of that level. */
+        qstring_append_fmt(preflight,
+            "vec4 texDecode%d(vec2 uv) {\n"
+            "  vec2 size0 = vec2(textureSize(texSamp%d, 0));\n"
+            "  vec2 dx = dFdx(uv * size0), dy = dFdy(uv * size0);\n"
+            "  float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));\n"
+            "  lod = clamp(floor(lod + 0.5), 0.0, log2(max(size0.x, size0.y)));\n"
+            "  vec2 size = max(floor(size0 / exp2(lod)), vec2(1.0));\n"
+            "  vec2 st = uv * size - 0.5;\n"
+            "  vec2 f = fract(st);\n"
+            "  vec2 t0 = (floor(st) + 0.5) / size;\n"
+            "  vec2 t1 = t0 + 1.0 / size;\n"
+            "  vec4 a = paletteLookup%d(textureLod(texSamp%d, t0, lod).r);\n"
+            "  vec4 b = paletteLookup%d(textureLod(texSamp%d, vec2(t1.x, t0.y), lod).r);\n"
+            "  vec4 c = paletteLookup%d(textureLod(texSamp%d, vec2(t0.x, t1.y), lod).r);\n"
+            "  vec4 d = paletteLookup%d(textureLod(texSamp%d, t1, lod).r);\n"
+            "  return mix(mix(a, b, f.x), mix(c, d, f.x), f.y);\n"
+            "}\n", i, i, i, i, i, i, i, i, i, i);
+        break;
+    case TEX_DECODE_YUY2:
+        /* Each RGBA8 texel holds two pixels as Y0 U Y1 V */
+        assert(ps->state.rect_tex[i]);
+        qstring_append_fmt(preflight, "uniform sampler2DRect texSamp%d;\n", i);
+        qstring_append_fmt(preflight,
+            "vec4 yuy2Fetch%d(ivec2 p) {\n"
+            "  ivec2 size = textureSize(texSamp%d) * ivec2(2, 1);\n"
+            "  p = clamp(p, ivec2(0), size - 1);\n"
+            "  vec4 c = texelFetch(texSamp%d, ivec2(p.x >> 1, p.y));\n"
+            "  float y = 1.164383 * (((p.x & 1) != 0 ? c.b : c.r) - 16.0 / 255.0);\n"
+            "  float u = c.g - 0.5, v = c.a - 0.5;\n"
+            "  return vec4(clamp(vec3(y + 1.596027 * v,\n"
+            "                         y - 0.391762 * u - 0.812968 * v,\n"
+            "                         y + 2.017232 * u), 0.0, 1.0), 1.0);\n"
+            "}\n", i, i, i);
+        if (!ps->state.tex_decode_linear[i]) {
+            qstring_append_fmt(preflight,
+                "vec4 texDecode%d(vec2 uv) {\n"
+                "  return yuy2Fetch%d(ivec2(floor(uv)));\n"
+                "}\n", i, i);
+            break;
+        }
+        qstring_append_fmt(preflight,
+            "vec4 texDecode%d(vec2 uv) {\n"
+            "  vec2 st = uv - 0.5;\n"
+            "  vec2 f = fract(st);\n"
+            "  ivec2 p = ivec2(floor(st));\n"
+            "  return mix(mix(yuy2Fetch%d(p), yuy2Fetch%d(p + ivec2(1, 0)), f.x),\n"
+            "             mix(yuy2Fetch%d(p + ivec2(0, 1)), yuy2Fetch%d(p + ivec2(1, 1)), f.x),\n"
+            "             f.y);\n"
+            "}\n", i, i, i, i, i);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
 static QString* psh_convert(struct PixelShader *ps)
 {
     int i;
@@ -595,6 +677,12 @@ static QString* psh_convert(struct PixelShader *ps)
             } else {
                 sampler_type = "sampler2D";
             }
+            if (ps->state.tex_decode[i] != TEX_DECODE_NONE) {
+                add_tex_decode(ps, preflight, i);
+                qstring_append_fmt(vars, "vec4 t%d = texDecode%d(pT%d.xy / pT%d.w);\n",
+                                   i, i, i, i);
+                break;
+            }
             qstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyw);\n",
                                i, i, i);
             break;
@@ -707,7 +795,11 @@ static QString* psh_convert(struct PixelShader *ps)
         }
         
         if (sampler_type != NULL) {
-            qstring_append_fmt(preflight, "uniform %s texSamp%d;\n", sampler_type, i);
+            /* Decoded stages declare their own samplers */
+            if (ps->state.tex_decode[i] == TEX_DECODE_NONE) {
+                qstring_append_fmt(preflight, "uniform %s texSamp%d;\n",
+                                   sampler_type, i);
+            }
 
             /* As this means a texture fetch does happen, do alphakill */
             if (ps->state.alphakill[i]) {
@@ -864,3 +956,9 @@ QString *psh_translate(const PshState state)
 
     return psh_convert(&ps);
 }
+
+bool psh_stage_is_project2d(uint32_t shader_stage_program, int stage)
+{
+    return ((shader_stage_program >> (stage * 5)) & 0x1F)
+               == PS_TEXTUREMODES_PROJECT2D;
+}
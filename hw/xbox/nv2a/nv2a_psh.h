@@ -33,6 +33,13 @@ enum PshAlphaFunc {
     ALPHA_FUNC_ALWAYS,
 };
 
+/* Texture formats that are expanded by the fragment shader */
+enum PshTexDecode {
+    TEX_DECODE_NONE,
+    TEX_DECODE_PALETTE, /* R8 indices into a 1D palette texture */
+    TEX_DECODE_YUY2,    /* CR8YB8CB8YA8 pairs stored as RGBA8 */
+};
+
 typedef struct PshState {
     /* fragment shader - register combiner stuff */
     uint32_t combiner_control;
@@ -47,6 +54,8 @@ typedef struct PshState {
     bool rect_tex[4];
     bool compare_mode[4][4];
     bool alphakill[4];
+    enum PshTexDecode tex_decode[4];
+    bool tex_decode_linear[4];
 
     bool alpha_test;
     enum PshAlphaFunc alpha_func;
@@ -56,5 +65,6 @@ typedef struct PshState {
 } PshState;
 
 QString *psh_translate(const PshState state);
+bool psh_stage_is_project2d(uint32_t shader_stage_program, int stage);
 
 #endif
@@ -49,9 +49,12 @@ uint64_t ptimer_read(void *opaque, hwaddr addr, unsigned int size)
         break;
     case NV_PTIMER_TIME_0:
         r = (ptimer_get_clock(d) & 0x7ffffff) << 5;
+        /* The time always changes, so only count back-to-back reads */
+        nv2a_spin_check(d, &d->spin.ptimer, NV_PTIMER_TIME_0, 0);
         break;
     case NV_PTIMER_TIME_1:
         r = (ptimer_get_clock(d) >> 27) & 0x1fffffff;
+        nv2a_spin_check(d, &d->spin.ptimer, NV_PTIMER_TIME_0, 0);
         break;
     default:
         break;
@@ -145,54 +145,40 @@ static QString* generate_geometry_shader(
                "  EndPrimitive();\n";
         break;
     case PRIM_TYPE_QUADS:
-        *gl_primitive_mode = GL_LINES_ADJACENCY;
-        layout_in = "layout(lines_adjacency) in;\n";
-        if (polygon_mode == POLY_MODE_LINE) {
-            layout_out = "layout(line_strip, max_vertices = 5) out;\n";
-            body = "  emit_vertex(0);\n"
-                   "  emit_vertex(1);\n"
-                   "  emit_vertex(2);\n"
-                   "  emit_vertex(3);\n"
-                   "  emit_vertex(0);\n"
-                   "  EndPrimitive();\n";
-        } else if (polygon_mode == POLY_MODE_FILL) {
-            layout_out = "layout(triangle_strip, max_vertices = 4) out;\n";
-            body = "  emit_vertex(0);\n"
-                   "  emit_vertex(1);\n"
-                   "  emit_vertex(3);\n"
-                   "  emit_vertex(2);\n"
-                   "  EndPrimitive();\n";
-        } else {
-            assert(false);
+        /* Filled quads are drawn as indexed triangles by pgraph */
+        if (polygon_mode == POLY_MODE_FILL) {
+            *gl_primitive_mode = GL_TRIANGLES;
             return NULL;
         }
+        assert(polygon_mode == POLY_MODE_LINE);
+        *gl_primitive_mode = GL_LINES_ADJACENCY;
+        layout_in = "layout(lines_adjacency) in;\n";
+        layout_out = "layout(line_strip, max_vertices = 5) out;\n";
+        body = "  emit_vertex(0);\n"
+               "  emit_vertex(1);\n"
+               "  emit_vertex(2);\n"
+               "  emit_vertex(3);\n"
+               "  emit_vertex(0);\n"
+               "  EndPrimitive();\n";
         break;
     case PRIM_TYPE_QUAD_STRIP:
-        *gl_primitive_mode = GL_LINE_STRIP_ADJACENCY;
-        layout_in = "layout(lines_adjacency) in;\n";
-        if (polygon_mode == POLY_MODE_LINE) {
-            layout_out = "layout(line_strip, max_vertices = 5) out;\n";
-            body = "  if ((gl_PrimitiveIDIn & 1) != 0) { return; }\n"
-                   "  if (gl_PrimitiveIDIn == 0) {\n"
-                   "    emit_vertex(0);\n"
-                   "  }\n"
-                   "  emit_vertex(1);\n"
-                   "  emit_vertex(3);\n"
-                   "  emit_vertex(2);\n"
-                   "  emit_vertex(0);\n"
-                   "  EndPrimitive();\n";
-        } else if (polygon_mode == POLY_MODE_FILL) {
-            layout_out = "layout(triangle_strip, max_vertices = 4) out;\n";
-            body = "  if ((gl_PrimitiveIDIn & 1) != 0) { return; }\n"
-                   "  emit_vertex(0);\n"
-                   "  emit_vertex(1);\n"
-                   "  emit_vertex(2);\n"
-                   "  emit_vertex(3);\n"
-                   "  EndPrimitive();\n";
-        } else {
-            assert(false);
+        if (polygon_mode == POLY_MODE_FILL) {
+            *gl_primitive_mode = GL_TRIANGLES;
             return NULL;
         }
+        assert(polygon_mode == POLY_MODE_LINE);
+        *gl_primitive_mode = GL_LINE_STRIP_ADJACENCY;
+        layout_in = "layout(lines_adjacency) in;\n";
+        layout_out = "layout(line_strip, max_vertices = 5) out;\n";
+        body = "  if ((gl_PrimitiveIDIn & 1) != 0) { return; }\n"
+               "  if (gl_PrimitiveIDIn == 0) {\n"
+               "    emit_vertex(0);\n"
+               "  }\n"
+               "  emit_vertex(1);\n"
+               "  emit_vertex(3);\n"
+               "  emit_vertex(2);\n"
+               "  emit_vertex(0);\n"
+               "  EndPrimitive();\n";
         break;
     case PRIM_TYPE_POLYGON:
         if (polygon_mode == POLY_MODE_LINE) {
@@ -939,6 +925,12 @@ ShaderBinding* generate_shaders(const ShaderState state)
         if (texSampLoc >= 0) {
             glUniform1i(texSampLoc, i);
         }
+        /* palettes of decoded textures live past the texture units */
+        snprintf(samplerName, sizeof(samplerName), "palette%d", i);
+        GLint paletteLoc = glGetUniformLocation(program, samplerName);
+        if (paletteLoc >= 0) {
+            glUniform1i(paletteLoc, NV2A_MAX_TEXTURES + i);
+        }
     }
 
     /* validate the program */
@@ -64,6 +64,15 @@ uint64_t user_read(void *opaque, hwaddr addr, unsigned int size)
 
     qemu_mutex_unlock(&d->pfifo.lock);
 
+    switch (addr & 0xFFFF) {
+    case NV_USER_DMA_GET:
+    case NV_USER_REF:
+        nv2a_spin_check(d, &d->spin.user, addr, r);
+        break;
+    default:
+        break;
+    }
+
     reg_log_read(NV_USER, addr, r);
     return r;
 }
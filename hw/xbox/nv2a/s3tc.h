@@ -0,0 +1,70 @@
+/*
+ * QEMU Geforce NV2A S3TC texture layout
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_XBOX_NV2A_S3TC_H
+#define HW_XBOX_NV2A_S3TC_H
+
+#define S3TC_BLOCK_DIM 4
+
+typedef struct S3TCLevel {
+    unsigned int width, height; /* Size of the level itself */
+    size_t offset, size;        /* Location of its blocks in the image */
+} S3TCLevel;
+
+static inline size_t s3tc_level_size(unsigned int width, unsigned int height,
+                                     unsigned int block_size)
+{
+    return (size_t)DIV_ROUND_UP(width, S3TC_BLOCK_DIM)
+               * DIV_ROUND_UP(height, S3TC_BLOCK_DIM) * block_size;
+}
+
+/*
+ * The Xbox and D3D store every mip level of a DXT texture as whole 4x4
+ * blocks: a level narrower or shorter than a block still takes a full
+ * block, with its texels in the top left corner (the "virtual size" of
+ * the level). GL accepts the padded blocks as they are for levels of
+ * width or height 1 and 2, so no level has to be dropped.
+ *
+ * Fills in @levels if it is not NULL and returns the length of the image.
+ */
+static inline size_t s3tc_layout(unsigned int width, unsigned int height,
+                                 unsigned int num_levels,
+                                 unsigned int block_size,
+                                 S3TCLevel *levels)
+{
+    size_t offset = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_levels; i++) {
+        size_t size = s3tc_level_size(width, height, block_size);
+
+        if (levels) {
+            levels[i].width = width;
+            levels[i].height = height;
+            levels[i].offset = offset;
+            levels[i].size = size;
+        }
+        offset += size;
+
+        width = MAX(width / 2, 1);
+        height = MAX(height / 2, 1);
+    }
+
+    return offset;
+}
+
+#endif
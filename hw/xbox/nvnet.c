@@ -24,6 +24,7 @@
 #include "hw/pci/pci.h"
 #include "net/net.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 #define IOPORT_SIZE 0x8
 #define MMIO_SIZE   0x400
@@ -239,6 +240,11 @@ enum {
 /* even more slack */
 #define RX_ALLOC_BUFSIZE      (DEFAULT_MTU + 128)
 
+/* Minimum time between two interrupts */
+#define NVNET_IRQ_MODERATION_NS 50000
+/* Retry delivering queued packets after the RX ring ran full */
+#define NVNET_RX_RETRY_NS       1000000
+
 #define OOM_REFILL            (1 + HZ / 20)
 #define POLL_WAIT             (1 + HZ / 100)
 
@@ -269,6 +275,27 @@ enum {
  * Primary State Structure
  ******************************************************************************/
 
+struct RingDesc {
+    uint32_t packet_buffer;
+    uint16_t length;
+    uint16_t flags;
+};
+
+/*
+ * A descriptor ring as last programmed by the guest. Rings in RAM stay
+ * mapped until the guest moves or resizes them; anything else is
+ * accessed with individual DMA transfers.
+ */
+typedef struct NvNetRing {
+    dma_addr_t      addr;
+    unsigned int    size;
+    bool            valid;
+    struct RingDesc *desc;
+    dma_addr_t      len;
+    MemoryRegion    *mr;
+    hwaddr          mr_offset;
+} NvNetRing;
+
 typedef struct NvNetState {
     PCIDevice    dev;
     NICState     *nic;
@@ -276,21 +303,21 @@ typedef struct NvNetState {
     MemoryRegion mmio, io;
     uint8_t      regs[MMIO_SIZE / 4];
     uint32_t     phy_regs[6];
-    uint8_t      tx_ring_index;
-    uint8_t      tx_ring_size;
-    uint8_t      rx_ring_index;
-    uint8_t      rx_ring_size;
+    uint32_t     tx_ring_index;
+    uint32_t     tx_ring_size;
+    uint32_t     rx_ring_index;
+    uint32_t     rx_ring_size;
+    bool         rx_ring_full;
+    NvNetRing    tx_ring;
+    NvNetRing    rx_ring;
     uint8_t      txrx_dma_buf[RX_ALLOC_BUFSIZE];
+    QEMUTimer    *timer;
+    uint32_t     irq_pending_status;
+    int64_t      irq_next_ns;
     FILE         *packet_dump_file;
     char         *packet_dump_path;
 } NvNetState;
 
-struct RingDesc {
-    uint32_t packet_buffer;
-    uint16_t length;
-    uint16_t flags;
-};
-
 /*******************************************************************************
  * Helper Macros
  ******************************************************************************/
@@ -337,11 +364,12 @@ static void nvnet_update_irq(NvNetState *s);
 
 /* Packet Tx / Rx */
 static void nvnet_send_packet(NvNetState *s,
-    const uint8_t *buf, int size);
+    const struct iovec *iov, int iovcnt);
 static ssize_t nvnet_dma_packet_to_guest(NvNetState *s,
-    const uint8_t *buf, size_t size);
+    const struct iovec *iov, int iovcnt, size_t size);
 static ssize_t nvnet_dma_packet_from_guest(NvNetState *s);
 static int nvnet_can_receive(NetClientState *nc);
+static void nvnet_rx_kick(NvNetState *s);
 static ssize_t nvnet_receive(NetClientState *nc,
     const uint8_t *buf, size_t size);
 static ssize_t nvnet_receive_iov(NetClientState *nc,
@@ -535,6 +563,7 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr,
         nvnet_set_reg(s, addr, val, size);
         s->rx_ring_size = ((val >> NVREG_RINGSZ_RXSHIFT) & 0xffff) + 1;
         s->tx_ring_size = ((val >> NVREG_RINGSZ_TXSHIFT) & 0xffff) + 1;
+        nvnet_rx_kick(s);
         break;
 
     case NvRegMIIData:
@@ -566,6 +595,7 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr,
         }
 
         nvnet_set_reg(s, NvRegTxRxControl, val, size);
+        nvnet_rx_kick(s);
         break;
 
     case NvRegIrqMask:
@@ -576,6 +606,8 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr,
     case NvRegIrqStatus:
         nvnet_set_reg(s, addr, nvnet_get_reg(s, addr, size) & ~val, size);
         nvnet_update_irq(s);
+        /* Guest has processed received packets, their buffers are free */
+        nvnet_rx_kick(s);
         break;
 
     default:
@@ -593,19 +625,161 @@ static const MemoryRegionOps nvnet_mmio_ops = {
  * Packet TX / RX
  ******************************************************************************/
 
-static void nvnet_send_packet(NvNetState *s, const uint8_t *buf, int size)
+static void nvnet_ring_unmap(NvNetState *s, NvNetRing *ring)
+{
+    if (ring->desc) {
+        pci_dma_unmap(&s->dev, ring->desc, ring->len,
+                      DMA_DIRECTION_FROM_DEVICE, ring->len);
+        ring->desc = NULL;
+    }
+    ring->valid = false;
+}
+
+/*
+ * Map the ring programmed in addr_reg, unless it is the one already
+ * mapped. Only rings backed by RAM are mapped: any other region would
+ * come back as a bounce buffer that neither sees the guest's updates
+ * nor is written back until unmapped.
+ */
+static void nvnet_ring_update(NvNetState *s, NvNetRing *ring,
+                              hwaddr addr_reg, unsigned int size)
+{
+    dma_addr_t addr = nvnet_get_reg(s, addr_reg, 4);
+    MemoryRegion *mr;
+    hwaddr xlat, plen;
+    bool is_ram;
+
+    if (ring->valid && ring->addr == addr && ring->size == size) {
+        return;
+    }
+
+    nvnet_ring_unmap(s, ring);
+    ring->addr = addr;
+    ring->size = size;
+    ring->len = size * sizeof(struct RingDesc);
+    ring->valid = true;
+
+    if (!size) {
+        return;
+    }
+
+    rcu_read_lock();
+    plen = ring->len;
+    mr = address_space_translate(pci_get_address_space(&s->dev), addr,
+                                 &xlat, &plen, true, MEMTXATTRS_UNSPECIFIED);
+    is_ram = memory_region_is_ram(mr) && !mr->readonly && plen >= ring->len;
+    rcu_read_unlock();
+
+    if (!is_ram) {
+        return;
+    }
+
+    plen = ring->len;
+    ring->desc = pci_dma_map(&s->dev, addr, &plen, DMA_DIRECTION_FROM_DEVICE);
+    if (ring->desc && plen < ring->len) {
+        pci_dma_unmap(&s->dev, ring->desc, plen, DMA_DIRECTION_FROM_DEVICE, 0);
+        ring->desc = NULL;
+    }
+    /* The mapping holds a reference on mr until it is unmapped */
+    ring->mr = mr;
+    ring->mr_offset = xlat;
+}
+
+static void nvnet_ring_get_desc(NvNetState *s, NvNetRing *ring,
+                                unsigned int index, struct RingDesc *desc)
+{
+    if (ring->desc) {
+        smp_mb();
+        memcpy(desc, &ring->desc[index], sizeof(*desc));
+    } else {
+        pci_dma_read(&s->dev, ring->addr + index * sizeof(*desc),
+                     desc, sizeof(*desc));
+    }
+}
+
+static void nvnet_ring_set_desc(NvNetState *s, NvNetRing *ring,
+                                unsigned int index, const struct RingDesc *desc)
+{
+    if (ring->desc) {
+        memcpy(&ring->desc[index], desc, sizeof(*desc));
+        smp_mb();
+        memory_region_set_dirty(ring->mr,
+                                ring->mr_offset + index * sizeof(*desc),
+                                sizeof(*desc));
+    } else {
+        pci_dma_write(&s->dev, ring->addr + index * sizeof(*desc),
+                      desc, sizeof(*desc));
+    }
+}
+
+/*
+ * The guest may have handed RX descriptors back, retry delivering the
+ * packets queued while the RX ring was full.
+ */
+static void nvnet_rx_kick(NvNetState *s)
+{
+    s->rx_ring_full = false;
+    qemu_flush_queued_packets(qemu_get_queue(s->nic));
+}
+
+/*
+ * Post interrupt status bits. Interrupts are delivered at most once per
+ * moderation interval; bits posted in between are collected and
+ * delivered together when the interval ends.
+ */
+static void nvnet_post_irq(NvNetState *s, uint32_t status)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    s->irq_pending_status |= status;
+
+    if (now >= s->irq_next_ns) {
+        nvnet_set_reg(s, NvRegIrqStatus,
+                      nvnet_get_reg(s, NvRegIrqStatus, 4)
+                      | s->irq_pending_status, 4);
+        s->irq_pending_status = 0;
+        s->irq_next_ns = now + NVNET_IRQ_MODERATION_NS;
+        nvnet_update_irq(s);
+    } else {
+        timer_mod_anticipate(s->timer, s->irq_next_ns);
+    }
+}
+
+static void nvnet_timer_cb(void *opaque)
+{
+    NvNetState *s = opaque;
+
+    if (s->irq_pending_status) {
+        nvnet_post_irq(s, 0);
+    }
+
+    /* Guest may have handed RX descriptors back without telling us */
+    nvnet_rx_kick(s);
+}
+
+static void nvnet_send_packet(NvNetState *s,
+                              const struct iovec *iov, int iovcnt)
 {
     NetClientState *nc = qemu_get_queue(s->nic);
 
     NVNET_DPRINTF("nvnet: Sending packet!\n");
-    nvnet_hex_dump(s, buf, size);
-    qemu_send_packet(nc, buf, size);
+    if (iovcnt == 1) {
+        nvnet_hex_dump(s, iov[0].iov_base, iov[0].iov_len);
+    }
+    qemu_sendv_packet(nc, iov, iovcnt);
 }
 
+/*
+ * Only the last delivery attempt is tracked: once it found the RX ring
+ * full, nothing is accepted until nvnet_rx_kick() says the guest may have
+ * returned descriptors.
+ */
 static int nvnet_can_receive(NetClientState *nc)
 {
-    NVNET_DPRINTF("nvnet_can_receive called\n");
-    return 1;
+    NvNetState *s = qemu_get_nic_opaque(nc);
+
+    NVNET_DPRINTF("nvnet_can_receive: %d\n", !s->rx_ring_full);
+    return s->rx_ring_size && !s->rx_ring_full;
 }
 
 static ssize_t nvnet_receive(NetClientState *nc,
@@ -628,96 +802,139 @@ static ssize_t nvnet_receive_iov(NetClientState *nc,
 
     NVNET_DPRINTF("nvnet: Packet received!\n");
 
-    if (size > sizeof(s->txrx_dma_buf)) {
+    if (size > RX_ALLOC_BUFSIZE) {
         NVNET_DPRINTF("nvnet_receive_iov packet too large!\n");
-        assert(0);
-        return -1;
+        return size;
+    }
+
+    if (s->packet_dump_file) {
+        iov_to_buf(iov, iovcnt, 0, s->txrx_dma_buf, size);
+        nvnet_hex_dump(s, s->txrx_dma_buf, size);
     }
 
-    iov_to_buf(iov, iovcnt, 0, s->txrx_dma_buf, size);
-    nvnet_hex_dump(s, s->txrx_dma_buf, size);
-    return nvnet_dma_packet_to_guest(s, s->txrx_dma_buf, size);
+    return nvnet_dma_packet_to_guest(s, iov, iovcnt, size);
 }
 
 static ssize_t nvnet_dma_packet_to_guest(NvNetState *s,
-                                         const uint8_t *buf, size_t size)
+                                         const struct iovec *iov, int iovcnt,
+                                         size_t size)
 {
+    NvNetRing *ring = &s->rx_ring;
     struct RingDesc desc;
+    dma_addr_t addr;
+    unsigned int index;
     int i;
 
-    for (i = 0; i < s->rx_ring_size; i++) {
-        /* Read current ring descriptor */
-        s->rx_ring_index %= s->rx_ring_size;
-        dma_addr_t rx_ring_addr = nvnet_get_reg(s, NvRegRxRingPhysAddr, 4);
-        rx_ring_addr += s->rx_ring_index * sizeof(desc);
-        pci_dma_read(&s->dev, rx_ring_addr, &desc, sizeof(desc));
-        NVNET_DPRINTF("Looking at ring descriptor %d (0x%llx): ",
-                      s->rx_ring_index, rx_ring_addr);
-        NVNET_DPRINTF("Buffer: 0x%x, ", desc.packet_buffer);
-        NVNET_DPRINTF("Length: 0x%x, ", desc.length);
-        NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
+    nvnet_ring_update(s, ring, NvRegRxRingPhysAddr, s->rx_ring_size);
 
-        s->rx_ring_index += 1;
-
-        if (!(desc.flags & NV_RX_AVAIL) || !(desc.length >= size)) {
-            continue;
-        }
+    /* The guest hands descriptors back in ring order, so only the one at
+     * the head can be available */
+    index = 0;
+    desc.flags = 0;
+    if (ring->size) {
+        index = s->rx_ring_index % ring->size;
+        nvnet_ring_get_desc(s, ring, index, &desc);
+    }
+    if (!(desc.flags & NV_RX_AVAIL)) {
+        /* Ring is full; the net layer queues the packet until the guest
+         * returns descriptors and the queue is flushed */
+        NVNET_DPRINTF("Could not find free buffer!\n");
+        s->rx_ring_full = true;
+        timer_mod_anticipate(s->timer,
+            qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + NVNET_RX_RETRY_NS);
+        return 0;
+    }
 
-        /* Transfer packet from device to memory */
-        NVNET_DPRINTF("Transferring packet, size 0x%zx, to memory at 0x%x\n",
-                      size, desc.packet_buffer);
-        pci_dma_write(&s->dev, desc.packet_buffer, buf, size);
+    NVNET_DPRINTF("Using ring descriptor %u: ", index);
+    NVNET_DPRINTF("Buffer: 0x%x, ", desc.packet_buffer);
+    NVNET_DPRINTF("Length: 0x%x, ", desc.length);
+    NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
 
-        /* Update descriptor indicating the packet is waiting */
-        desc.length = size;
-        desc.flags  = NV_RX_BIT4 | NV_RX_DESCRIPTORVALID;
-        pci_dma_write(&s->dev, rx_ring_addr, &desc, sizeof(desc));
-        NVNET_DPRINTF("Updated ring descriptor: ");
-        NVNET_DPRINTF("Length: 0x%x, ", desc.length);
-        NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
+    s->rx_ring_index = (index + 1) % ring->size;
 
-        /* Trigger interrupt */
-        NVNET_DPRINTF("Triggering interrupt\n");
-        nvnet_set_reg(s, NvRegIrqStatus, NVREG_IRQSTAT_BIT1, 4);
-        nvnet_update_irq(s);
+    if (desc.length < size) {
+        /* Packet too large for the guest's buffer, drop it */
+        NVNET_DPRINTF("Dropping packet, size 0x%zx\n", size);
         return size;
     }
 
-    /* Could not find free buffer, or packet too large. */
-    NVNET_DPRINTF("Could not find free buffer!\n");
-    return -1;
+    /* Transfer packet from device to memory, straight from the iovec */
+    NVNET_DPRINTF("Transferring packet, size 0x%zx, to memory at 0x%x\n",
+                  size, desc.packet_buffer);
+    addr = desc.packet_buffer;
+    for (i = 0; i < iovcnt; i++) {
+        pci_dma_write(&s->dev, addr, iov[i].iov_base, iov[i].iov_len);
+        addr += iov[i].iov_len;
+    }
+
+    /* Update descriptor indicating the packet is waiting */
+    desc.length = size;
+    desc.flags  = NV_RX_BIT4 | NV_RX_DESCRIPTORVALID;
+    nvnet_ring_set_desc(s, ring, index, &desc);
+    NVNET_DPRINTF("Updated ring descriptor: ");
+    NVNET_DPRINTF("Length: 0x%x, ", desc.length);
+    NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
+
+    /* Trigger interrupt */
+    NVNET_DPRINTF("Triggering interrupt\n");
+    nvnet_post_irq(s, NVREG_IRQSTAT_BIT1);
+    return size;
 }
 
 static ssize_t nvnet_dma_packet_from_guest(NvNetState *s)
 {
+    NvNetRing *ring = &s->tx_ring;
     struct RingDesc desc;
     bool is_last_packet;
     int i;
     bool packet_sent = false;
 
-    for (i = 0; i < s->tx_ring_size; i++) {
+    nvnet_ring_update(s, ring, NvRegTxRingPhysAddr, s->tx_ring_size);
+
+    for (i = 0; i < ring->size; i++) {
         /* Read ring descriptor */
-        s->tx_ring_index %= s->tx_ring_size;
-        dma_addr_t tx_ring_addr = nvnet_get_reg(s, NvRegTxRingPhysAddr, 4);
-        tx_ring_addr += s->tx_ring_index * sizeof(desc);
-        pci_dma_read(&s->dev, tx_ring_addr, &desc, sizeof(desc));
-        NVNET_DPRINTF("Looking at ring desc %d (%llx): ",
-                      s->tx_ring_index, tx_ring_addr);
+        unsigned int index = s->tx_ring_index % ring->size;
+        nvnet_ring_get_desc(s, ring, index, &desc);
+        NVNET_DPRINTF("Looking at ring desc %d: ", index);
         NVNET_DPRINTF("Buffer: 0x%x, ", desc.packet_buffer);
         NVNET_DPRINTF("Length: 0x%x, ", desc.length);
         NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
 
-        s->tx_ring_index += 1;
+        s->tx_ring_index = index + 1;
 
         if (!(desc.flags & NV_TX_VALID)) {
             continue;
         }
 
-        /* Transfer packet from guest memory */
+        /* Send packet straight from guest memory */
         NVNET_DPRINTF("Sending packet...\n");
-        pci_dma_read(&s->dev, desc.packet_buffer,
-                              s->txrx_dma_buf, desc.length + 1);
-        nvnet_send_packet(s, s->txrx_dma_buf, desc.length + 1);
+        dma_addr_t packet_len = desc.length + 1;
+        struct iovec iov = {
+            .iov_base = pci_dma_map(&s->dev, desc.packet_buffer, &packet_len,
+                                    DMA_DIRECTION_TO_DEVICE),
+            .iov_len = packet_len,
+        };
+        bool tx_error = false;
+        if (iov.iov_base && packet_len == desc.length + 1) {
+            nvnet_send_packet(s, &iov, 1);
+        } else if (desc.length + 1 <= sizeof(s->txrx_dma_buf)) {
+            /* Buffer not directly accessible, bounce it */
+            struct iovec bounce = {
+                .iov_base = s->txrx_dma_buf,
+                .iov_len = desc.length + 1,
+            };
+            pci_dma_read(&s->dev, desc.packet_buffer,
+                         s->txrx_dma_buf, bounce.iov_len);
+            nvnet_send_packet(s, &bounce, 1);
+        } else {
+            /* Too large to bounce, report it instead of sending */
+            NVNET_DPRINTF("Dropping packet, size 0x%x\n", desc.length + 1);
+            tx_error = true;
+        }
+        if (iov.iov_base) {
+            pci_dma_unmap(&s->dev, iov.iov_base, packet_len,
+                          DMA_DIRECTION_TO_DEVICE, 0);
+        }
         packet_sent = true;
 
         /* Update descriptor */
@@ -725,8 +942,11 @@ static ssize_t nvnet_dma_packet_from_guest(NvNetState *s)
         desc.flags &= ~(NV_TX_VALID | NV_TX_RETRYERROR | NV_TX_DEFERRED |
             NV_TX_CARRIERLOST | NV_TX_LATECOLLISION | NV_TX_UNDERFLOW |
             NV_TX_ERROR);
+        if (tx_error) {
+            desc.flags |= NV_TX_ERROR;
+        }
         desc.length = desc.length + 5;
-        pci_dma_write(&s->dev, tx_ring_addr, &desc, sizeof(desc));
+        nvnet_ring_set_desc(s, ring, index, &desc);
 
         if (is_last_packet) {
             NVNET_DPRINTF("  -- Last packet\n");
@@ -737,8 +957,7 @@ static ssize_t nvnet_dma_packet_from_guest(NvNetState *s)
     /* Trigger interrupt */
     if (packet_sent) {
         NVNET_DPRINTF("Triggering interrupt\n");
-        nvnet_set_reg(s, NvRegIrqStatus, NVREG_IRQSTAT_BIT4, 4);
-        nvnet_update_irq(s);
+        nvnet_post_irq(s, NVREG_IRQSTAT_BIT4);
     }
 
     return 0;
@@ -814,8 +1033,11 @@ static void nvnet_realize(PCIDevice *pci_dev, Error **errp)
 
     s->rx_ring_index = 0;
     s->rx_ring_size  = 0;
+    s->rx_ring_full  = false;
     s->tx_ring_index = 0;
     s->tx_ring_size  = 0;
+    memset(&s->tx_ring, 0, sizeof(s->tx_ring));
+    memset(&s->rx_ring, 0, sizeof(s->rx_ring));
 
     memory_region_init_io(&s->mmio, OBJECT(dev), &nvnet_mmio_ops, s,
         "nvnet-mmio", MMIO_SIZE);
@@ -825,6 +1047,10 @@ static void nvnet_realize(PCIDevice *pci_dev, Error **errp)
         "nvnet-io", IOPORT_SIZE);
     pci_register_bar(&s->dev, 1, PCI_BASE_ADDRESS_SPACE_IO, &s->io);
 
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvnet_timer_cb, s);
+    s->irq_pending_status = 0;
+    s->irq_next_ns = 0;
+
     qemu_macaddr_default_if_unset(&s->conf.macaddr);
     s->nic = qemu_new_nic(&net_nvnet_info, &s->conf,
         object_get_typename(OBJECT(s)), dev->id, s);
@@ -839,6 +1065,12 @@ static void nvnet_uninit(PCIDevice *dev)
         fclose(s->packet_dump_file);
     }
 
+    timer_del(s->timer);
+    timer_free(s->timer);
+
+    nvnet_ring_unmap(s, &s->tx_ring);
+    nvnet_ring_unmap(s, &s->rx_ring);
+
     // memory_region_destroy(&s->mmio);
     // memory_region_destroy(&s->io);
     qemu_del_nic(s->nic);
@@ -852,6 +1084,13 @@ static void nvnet_reset(void *opaque)
 {
     NvNetState *s = opaque;
 
+    timer_del(s->timer);
+    s->irq_pending_status = 0;
+    s->irq_next_ns = 0;
+    s->rx_ring_full = false;
+    nvnet_ring_unmap(s, &s->tx_ring);
+    nvnet_ring_unmap(s, &s->rx_ring);
+
     if (qemu_get_queue(s->nic)->link_down) {
         nvnet_link_down(s);
     }
@@ -37,6 +37,8 @@
 #include "cpu.h"
 
 #include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/cutils.h"
 #include "qemu/error-report.h"
 
 #include "hw/timer/i8254.h"
@@ -277,11 +279,61 @@ uint8_t *load_eeprom(void)
     return eeprom_data;
 }
 
+/* Parse "start-end[,start-end...]" guest PC ranges, end exclusive */
+static int xbox_parse_idle_pc(const char *str, X86IdleRange *ranges,
+                              Error **errp)
+{
+    gchar **specs = g_strsplit(str, ",", 0);
+    int n = 0;
+    int i;
+
+    for (i = 0; specs[i]; i++) {
+        uint64_t start, end;
+        const char *p;
+
+        if (!*specs[i]) {
+            continue;
+        }
+        if (n == X86_IDLE_MAX_RANGES) {
+            error_setg(errp, "at most %d idle PC ranges are supported",
+                       X86_IDLE_MAX_RANGES);
+            n = -1;
+            break;
+        }
+        if (qemu_strtou64(specs[i], &p, 0, &start) || *p != '-' ||
+            qemu_strtou64(p + 1, NULL, 0, &end) || end <= start) {
+            error_setg(errp, "invalid idle PC range '%s', "
+                       "expected start-end", specs[i]);
+            n = -1;
+            break;
+        }
+        ranges[n].start = start;
+        ranges[n].end = end;
+        n++;
+    }
+
+    g_strfreev(specs);
+    return n;
+}
+
 /* PC hardware initialisation */
 static void xbox_init(MachineState *machine)
 {
+    XboxMachineState *ms = XBOX_MACHINE(machine);
     uint8_t *eeprom_data = load_eeprom();
     xbox_init_common(machine, eeprom_data, NULL, NULL);
+
+    if (ms->idle_detect) {
+        X86IdleRange ranges[X86_IDLE_MAX_RANGES];
+        int num_ranges = 0;
+
+        if (ms->idle_pc) {
+            num_ranges = xbox_parse_idle_pc(ms->idle_pc, ranges,
+                                            &error_fatal);
+        }
+        x86_cpu_enable_idle_detect(X86_CPU(first_cpu), ranges, num_ranges,
+                                   ms->idle_sleep_us);
+    }
 }
 
 void xbox_init_common(MachineState *machine,
@@ -512,8 +564,74 @@ static bool machine_get_short_animation(Object *obj, Error **errp)
     return ms->short_animation;
 }
 
+static void machine_set_idle_detect(Object *obj, bool value, Error **errp)
+{
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+
+    ms->idle_detect = value;
+}
+
+static bool machine_get_idle_detect(Object *obj, Error **errp)
+{
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+    return ms->idle_detect;
+}
+
+static char *machine_get_idle_pc(Object *obj, Error **errp)
+{
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+
+    return g_strdup(ms->idle_pc);
+}
+
+static void machine_set_idle_pc(Object *obj, const char *value,
+                                Error **errp)
+{
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+    X86IdleRange ranges[X86_IDLE_MAX_RANGES];
+
+    if (xbox_parse_idle_pc(value, ranges, errp) < 0) {
+        return;
+    }
+
+    g_free(ms->idle_pc);
+    ms->idle_pc = g_strdup(value);
+}
+
+static void machine_get_idle_sleep_us(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+    uint32_t value = ms->idle_sleep_us;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void machine_set_idle_sleep_us(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (value == 0) {
+        error_setg(errp, "-machine idle-sleep-us must be non-zero");
+        return;
+    }
+    ms->idle_sleep_us = value;
+}
+
 static inline void xbox_machine_initfn(Object *obj)
 {
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+
     object_property_add_str(obj, "bootrom", machine_get_bootrom,
                             machine_set_bootrom, NULL);
     object_property_set_description(obj, "bootrom",
@@ -538,6 +656,28 @@ static inline void xbox_machine_initfn(Object *obj)
                                     NULL);
     object_property_set_bool(obj, false, "short-animation", NULL);
 
+    object_property_add_bool(obj, "idle-detect",
+                             machine_get_idle_detect,
+                             machine_set_idle_detect, NULL);
+    object_property_set_description(obj, "idle-detect",
+                                    "Put the CPU to sleep while the guest "
+                                    "spins in an idle or wait loop",
+                                    NULL);
+    object_property_set_bool(obj, false, "idle-detect", NULL);
+
+    object_property_add_str(obj, "idle-pc", machine_get_idle_pc,
+                            machine_set_idle_pc, NULL);
+    object_property_set_description(obj, "idle-pc",
+                                    "Guest code ranges treated as idle loops "
+                                    "(start-end[,start-end...])", NULL);
+
+    ms->idle_sleep_us = 500;
+    object_property_add(obj, "idle-sleep-us", "uint32",
+                        machine_get_idle_sleep_us,
+                        machine_set_idle_sleep_us, NULL, NULL, NULL);
+    object_property_set_description(obj, "idle-sleep-us",
+                                    "Longest time in microseconds an idle "
+                                    "CPU sleeps without an interrupt", NULL);
 }
 
 static void xbox_machine_class_init(ObjectClass *oc, void *data)
@@ -49,6 +49,9 @@ typedef struct XboxMachineState {
     char *eeprom;
     char *avpack;
     bool short_animation;
+    bool idle_detect;
+    char *idle_pc;
+    uint32_t idle_sleep_us;
 } XboxMachineState;
 
 typedef struct XboxMachineClass {
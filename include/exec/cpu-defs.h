@@ -174,6 +174,9 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    /* Writes through TLB_NOTDIRTY and walks re-arming it */
+    size_t notdirty_write_count;
+    size_t reset_dirty_count;
 } CPUTLBCommon;
 
 # define CPU_TLB                                                        \
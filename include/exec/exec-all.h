@@ -351,6 +351,7 @@ struct TranslationBlock {
 #define CF_USE_ICOUNT  0x00020000
 #define CF_INVALID     0x00040000 /* TB is stale. Set with @jmp_lock held */
 #define CF_PARALLEL    0x00080000 /* Generate code for a parallel context */
+#define CF_TRACE       0x00100000 /* Hot TB, translated across jumps */
 #define CF_CLUSTER_MASK 0xff000000 /* Top 8 bits are cluster ID */
 #define CF_CLUSTER_SHIFT 24
 /* cflags' mask for hashing/comparison */
@@ -360,6 +361,9 @@ struct TranslationBlock {
     /* Per-vCPU dynamic tracing state used to generate this TB */
     uint32_t trace_vcpu_dstate;
 
+    /* Number of times cpu_exec() entered this TB, see tcg_tier_threshold */
+    uint32_t exec_count;
+
     struct tb_tc tc;
 
     /* original tb when cflags has CF_NOCACHE */
@@ -408,6 +412,10 @@ struct TranslationBlock {
 
 extern bool parallel_cpus;
 
+/* Executions after which a TB is translated again as a trace (CF_TRACE);
+   0 disables tiering.  */
+extern uint32_t tcg_tier_threshold;
+
 /* Hide the atomic_read to make code a little easier on the eyes */
 static inline uint32_t tb_cflags(const TranslationBlock *tb)
 {
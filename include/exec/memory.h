@@ -1287,6 +1287,33 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
 
+/**
+ * memory_region_test_and_clear_dirty_deferred: Like
+ *     memory_region_test_and_clear_dirty(), but leaves TCG writes to the
+ *     range unlogged until memory_region_rearm_dirty() is called on it.
+ *
+ * This lets a client that checks the same pages many times batch the
+ * cost of making the TLB track writes again.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information.
+ */
+bool memory_region_test_and_clear_dirty_deferred(MemoryRegion *mr,
+                                                 hwaddr addr, hwaddr size,
+                                                 unsigned client);
+
+/**
+ * memory_region_rearm_dirty: Resume logging TCG writes to a range after
+ *     memory_region_test_and_clear_dirty_deferred().
+ *
+ * @mr: the memory region.
+ * @addr: the start of the range (relative to the start of the region).
+ * @size: the size of the range.
+ */
+void memory_region_rearm_dirty(MemoryRegion *mr, hwaddr addr, hwaddr size);
+
 /**
  * memory_region_set_client_dirty: Mark a range of bytes as dirty
  *                                 in a memory region for a specified client.
@@ -1313,15 +1340,11 @@ void memory_region_set_client_dirty(MemoryRegion *mr, hwaddr addr,
  * querying the same page multiple times, which is especially useful for
  * display updates where the scanlines often are not page aligned.
  *
- * The dirty bitmap region which gets copyed into the snapshot (and
- * cleared afterwards) can be larger than requested.  The boundaries
- * are rounded up/down so complete bitmap longs (covering 64 pages on
- * 64bit hosts) can be copied over into the bitmap snapshot.  Which
- * isn't a problem for display updates as the extra pages are outside
- * the visible area, and in case the visible area changes a full
- * display redraw is due anyway.  Should other use cases for this
- * function emerge we might have to revisit this implementation
- * detail.
+ * The snapshot covers complete bitmap longs (64 pages on 64bit hosts),
+ * so its boundaries are rounded up/down from the requested range.  Only
+ * the pages inside the range are cleared and reported dirty though; the
+ * extra pages read clean in the snapshot and keep their dirty bits for
+ * other users of the same client.
  *
  * Use g_free to release DirtyBitmapSnapshot.
  *
@@ -1335,6 +1358,21 @@ DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
                                                             hwaddr size,
                                                             unsigned client);
 
+/**
+ * memory_region_snapshot_and_clear_dirty_deferred: Like
+ *     memory_region_snapshot_and_clear_dirty(), but leaves TCG writes to the
+ *     range unlogged until memory_region_rearm_dirty() is called on it.
+ *
+ * Use g_free to release DirtyBitmapSnapshot.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information.
+ */
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty_deferred(
+    MemoryRegion *mr, hwaddr addr, hwaddr size, unsigned client);
+
 /**
  * memory_region_snapshot_get_dirty: Check whether a range of bytes is dirty
  *                                   in the specified dirty bitmap snapshot.
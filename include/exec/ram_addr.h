@@ -211,11 +211,13 @@ static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
 static inline bool cpu_physical_memory_is_clean(ram_addr_t addr)
 {
     bool nv2a = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A);
+    bool nv2a_vertex =
+        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_VERTEX);
     bool vga = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_VGA);
     bool code = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE);
     bool migration =
         cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
-    return !(nv2a && vga && code && migration);
+    return !(nv2a && nv2a_vertex && vga && code && migration);
 }
 
 static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
@@ -228,6 +230,11 @@ static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
         !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_NV2A)) {
         ret |= (1 << DIRTY_MEMORY_NV2A);
     }
+    if (mask & (1 << DIRTY_MEMORY_NV2A_VERTEX) &&
+        !cpu_physical_memory_all_dirty(start, length,
+                                       DIRTY_MEMORY_NV2A_VERTEX)) {
+        ret |= (1 << DIRTY_MEMORY_NV2A_VERTEX);
+    }
     if (mask & (1 << DIRTY_MEMORY_VGA) &&
         !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_VGA)) {
         ret |= (1 << DIRTY_MEMORY_VGA);
@@ -304,6 +311,10 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
             bitmap_set_atomic(blocks[DIRTY_MEMORY_NV2A]->blocks[idx],
                               offset, next - page);
         }
+        if (unlikely(mask & (1 << DIRTY_MEMORY_NV2A_VERTEX))) {
+            bitmap_set_atomic(blocks[DIRTY_MEMORY_NV2A_VERTEX]->blocks[idx],
+                              offset, next - page);
+        }
         if (unlikely(mask & (1 << DIRTY_MEMORY_CODE))) {
             bitmap_set_atomic(blocks[DIRTY_MEMORY_CODE]->blocks[idx],
                               offset, next - page);
@@ -359,6 +370,8 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                 atomic_or(&blocks[DIRTY_MEMORY_MIGRATION][idx][offset], temp);
                 atomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
                 atomic_or(&blocks[DIRTY_MEMORY_NV2A][idx][offset], temp);
+                atomic_or(&blocks[DIRTY_MEMORY_NV2A_VERTEX][idx][offset],
+                          temp);
                 if (tcg_enabled()) {
                     atomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset], temp);
                 }
@@ -401,9 +414,23 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+/* Clear the dirty bits of @client without making the TLB catch writes to
+ * the range again; until cpu_physical_memory_rearm_dirty() is called, CPU
+ * stores to pages that were dirty stay on the fast path and go unlogged.
+ */
+bool cpu_physical_memory_test_and_clear_dirty_deferred(ram_addr_t start,
+                                                       ram_addr_t length,
+                                                       unsigned client);
+
+void cpu_physical_memory_rearm_dirty(ram_addr_t start, ram_addr_t length);
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
     (ram_addr_t start, ram_addr_t length, unsigned client);
 
+/* Snapshot counterpart of cpu_physical_memory_test_and_clear_dirty_deferred */
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty_deferred
+    (ram_addr_t start, ram_addr_t length, unsigned client);
+
 bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
                                             ram_addr_t start,
                                             ram_addr_t length);
@@ -414,6 +441,8 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_MIGRATION);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_VGA);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_NV2A);
+    cpu_physical_memory_test_and_clear_dirty(start, length,
+                                             DIRTY_MEMORY_NV2A_VERTEX);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_CODE);
 }
 
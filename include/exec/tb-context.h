@@ -35,6 +35,9 @@ struct TBContext {
 
     /* statistics */
     unsigned tb_flush_count;
+    unsigned tb_tier_up_count;
+    unsigned trace_jmp_count;
+    unsigned trace_side_exit_count;
 };
 
 extern TBContext tb_ctx;
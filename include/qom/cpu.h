@@ -155,6 +155,9 @@ struct TranslationBlock;
  * @disas_set_info: Setup architecture specific components of disassembly info
  * @adjust_watchpoint_address: Perform a target-specific adjustment to an
  * address before attempting to match it against watchpoints.
+ * @tb_cache_config: Append the CPU settings, besides the TB flags, that
+ *       translated code depends on. Used to tell whether a persistent TB
+ *       cache may be reused.
  *
  * Represents a CPU family or model.
  */
@@ -223,6 +226,7 @@ typedef struct CPUClass {
     void (*disas_set_info)(CPUState *cpu, disassemble_info *info);
     vaddr (*adjust_watchpoint_address)(CPUState *cpu, vaddr addr, int len);
     void (*tcg_initialize)(void);
+    void (*tb_cache_config)(CPUState *cpu, GByteArray *config);
 
     /* Keep non-pointer data at the end to minimize holes.  */
     int gdb_num_core_regs;
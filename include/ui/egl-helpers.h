@@ -47,6 +47,10 @@ EGLSurface qemu_egl_init_surface_x11(EGLContext ectx, EGLNativeWindowType win);
 
 int qemu_egl_init_dpy_x11(EGLNativeDisplayType dpy, DisplayGLMode mode);
 int qemu_egl_init_dpy_mesa(EGLNativeDisplayType dpy, DisplayGLMode mode);
+int qemu_egl_open_dpy_mesa(EGLNativeDisplayType dpy, DisplayGLMode mode,
+                           EGLDisplay *display, EGLConfig *config);
+int qemu_egl_open_dpy_surfaceless(DisplayGLMode mode,
+                                  EGLDisplay *display, EGLConfig *config);
 EGLContext qemu_egl_init_ctx(void);
 
 #endif /* EGL_HELPERS_H */
@@ -2084,6 +2084,30 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
             memory_region_get_ram_addr(mr) + addr, size, client);
 }
 
+bool memory_region_test_and_clear_dirty_deferred(MemoryRegion *mr,
+                                                 hwaddr addr, hwaddr size,
+                                                 unsigned client)
+{
+    if (mr->alias) {
+        return memory_region_test_and_clear_dirty_deferred(
+                mr->alias, addr - mr->alias_offset, size, client);
+    }
+    assert(mr->terminates);
+    return cpu_physical_memory_test_and_clear_dirty_deferred(
+            memory_region_get_ram_addr(mr) + addr, size, client);
+}
+
+void memory_region_rearm_dirty(MemoryRegion *mr, hwaddr addr, hwaddr size)
+{
+    if (mr->alias) {
+        memory_region_rearm_dirty(mr->alias, addr - mr->alias_offset, size);
+        return;
+    }
+    assert(mr->terminates);
+    cpu_physical_memory_rearm_dirty(memory_region_get_ram_addr(mr) + addr,
+                                    size);
+}
+
 static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
     MemoryListener *listener;
@@ -2126,6 +2150,18 @@ DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
                 memory_region_get_ram_addr(mr) + addr, size, client);
 }
 
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty_deferred(
+    MemoryRegion *mr, hwaddr addr, hwaddr size, unsigned client)
+{
+    if (mr->alias) {
+        return memory_region_snapshot_and_clear_dirty_deferred(
+                mr->alias, addr - mr->alias_offset, size, client);
+    }
+    assert(mr->ram_block);
+    return cpu_physical_memory_snapshot_and_clear_dirty_deferred(
+                memory_region_get_ram_addr(mr) + addr, size, client);
+}
+
 bool memory_region_snapshot_get_dirty(MemoryRegion *mr, DirtyBitmapSnapshot *snap,
                                       hwaddr addr, hwaddr size)
 {
@@ -118,9 +118,12 @@ Select CPU model (@code{-cpu help} for list and additional feature selection)
 ETEXI
 
 DEF("accel", HAS_ARG, QEMU_OPTION_accel,
-    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "-accel [accel=]accelerator[,thread=single|multi][,tb-cache=file]\n"
+    "                [,tier-threshold=n]\n"
     "                select accelerator (kvm, xen, hax, hvf, whpx or tcg; use 'help' for a list)\n"
-    "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                tb-cache=file (keep translated code across runs in file)\n"
+    "                tier-threshold=n (retranslate blocks run n times as traces)\n", QEMU_ARCH_ALL)
 STEXI
 @item -accel @var{name}[,prop=@var{value}[,...]]
 @findex -accel
@@ -134,6 +137,19 @@ Controls number of TCG threads. When the TCG is multi-threaded there will be one
 thread per vCPU therefor taking advantage of additional host cores. The default
 is to enable multi-threading where both the back-end and front-ends support it and
 no incompatible TCG features have been enabled (e.g. icount/replay).
+@item tb-cache=@var{file}
+Load translated code from @var{file} and write it back when QEMU exits, so
+that guest code already translated by a previous run does not have to be
+translated again. Translated blocks are only reused if the guest code at the
+same address is identical. The file is only valid for the QEMU binary that
+wrote it. Only supported on x86-64 Linux hosts.
+@item tier-threshold=@var{n}
+Translate a block again once it has been executed @var{n} times, as a trace
+that continues through forward jumps and, predicting them not taken, forward
+conditional branches. This gives the TCG optimizer and register allocator
+larger regions to work on. Blocks are not chained to each other until they
+have been retranslated, so small values work best. Only the x86 front end
+builds traces, and not with icount. The default, 0, disables retranslation.
 @end table
 ETEXI
 
@@ -4674,7 +4674,7 @@ static void x86_cpu_reset(CPUState *s)
     }
     cpu_set_fpuc(env, 0x37f);
 
-    env->mxcsr = 0x1f80;
+    cpu_set_mxcsr(env, 0x1f80);
     /* All units are in INIT state.  */
     env->xstate_bv = 0;
 
@@ -5770,6 +5770,7 @@ static Property x86_cpu_properties[] = {
 #endif
     DEFINE_PROP_INT32("node-id", X86CPU, node_id, CPU_UNSET_NUMA_NODE_ID),
     DEFINE_PROP_BOOL("pmu", X86CPU, enable_pmu, false),
+    DEFINE_PROP_BOOL("x87-hostfp", X86CPU, x87_hostfp, false),
     { .name  = "hv-spinlocks", .info  = &qdev_prop_spinlocks },
     DEFINE_PROP_BOOL("hv-relaxed", X86CPU, hyperv_relaxed_timing, false),
     DEFINE_PROP_BOOL("hv-vapic", X86CPU, hyperv_vapic, false),
@@ -5893,6 +5894,7 @@ static void x86_cpu_common_class_init(ObjectClass *oc, void *data)
     cc->cpu_exec_exit = x86_cpu_exec_exit;
 #ifdef CONFIG_TCG
     cc->tcg_initialize = tcg_x86_init;
+    cc->tb_cache_config = x86_cpu_tb_cache_config;
 #endif
     cc->disas_set_info = x86_disas_set_info;
 
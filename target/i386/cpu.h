@@ -963,6 +963,29 @@ typedef struct {
  */
 #define UNASSIGNED_APIC_ID 0xFFFFFFFF
 
+#define X86_IDLE_MAX_RANGES 8
+
+typedef struct X86IdleRange {
+    target_ulong start;
+    target_ulong end;       /* exclusive */
+} X86IdleRange;
+
+typedef struct X86IdleState {
+    bool enabled;
+    uint32_t sleep_us;
+    int num_ranges;
+    X86IdleRange ranges[X86_IDLE_MAX_RANGES];
+
+    QEMUTimer *wake_timer;
+    bool sleeping;
+
+    /* current spin candidate */
+    target_ulong pc;
+    target_ulong regs[CPU_NB_REGS];
+    uint32_t count;
+    int64_t last_ns;
+} X86IdleState;
+
 typedef union X86LegacyXSaveArea {
     struct {
         uint16_t fcw;
@@ -1173,12 +1196,17 @@ typedef struct CPUX86State {
     /* emulator internal variables */
     float_status fp_status;
     floatx80 ft0;
+    /* floatx80 precision the host FPU fast path applies to, 0 if off */
+    uint8_t x87_hostfp_prec;
 
     float_status mmx_status; /* for 3DNow! float ops */
     float_status sse_status;
     uint32_t mxcsr;
-    ZMMReg xmm_regs[CPU_NB_REGS == 8 ? 8 : 32];
-    ZMMReg xmm_t0;
+    /* packed single ops may run on the host FPU, see update_mxcsr_status */
+    uint8_t sse_hostfp;
+    /* 16-byte alignment lets the translator use gvec ops on xmm registers */
+    ZMMReg xmm_regs[CPU_NB_REGS == 8 ? 8 : 32] QEMU_ALIGNED(16);
+    ZMMReg xmm_t0 QEMU_ALIGNED(16);
     MMXReg mmx_t0;
 
     XMMReg ymmh_regs[CPU_NB_REGS];
@@ -1431,6 +1459,15 @@ struct X86CPU {
      */
     bool enable_pmu;
 
+    /* Execute x87 arithmetic on the host FPU when the x87 precision
+     * control is set to single or double precision and the result is
+     * guaranteed to match softfloat. Enabled with 'x87-hostfp=on'.
+     */
+    bool x87_hostfp;
+
+    /* Idle/spin-loop detection, see x86_cpu_enable_idle_detect() */
+    X86IdleState idle;
+
     /* LMCE support can be enabled/disabled via cpu option 'lmce=on/off'. It is
      * disabled by default to avoid breaking migration between QEMU with
      * different LMCE configurations.
@@ -1772,6 +1809,7 @@ static inline target_long lshift(target_long x, int n)
 
 /* translate.c */
 void tcg_x86_init(void);
+void x86_cpu_tb_cache_config(CPUState *cs, GByteArray *config);
 
 #include "exec/cpu-all.h"
 #include "svm.h"
@@ -1916,6 +1954,10 @@ void apic_handle_tpr_access_report(DeviceState *d, target_ulong ip,
  */
 void x86_cpu_change_kvm_default(const char *prop, const char *value);
 
+/* misc_helper.c */
+void x86_cpu_enable_idle_detect(X86CPU *cpu, const X86IdleRange *ranges,
+                                int num_ranges, uint32_t sleep_us);
+
 /* Return name of 32-bit register, from a R_* constant */
 const char *get_register_name_32(unsigned int reg);
 
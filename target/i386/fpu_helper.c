@@ -19,12 +19,14 @@
 
 #include "qemu/osdep.h"
 #include <math.h>
+#include <float.h>
 #include "cpu.h"
 #include "exec/helper-proto.h"
 #include "qemu/host-utils.h"
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
 #include "fpu/softfloat.h"
+#include "x87-hostfp.h"
 
 #define FPU_RC_MASK         0xc00
 #define FPU_RC_NEAR         0x000
@@ -122,10 +124,48 @@ static void fpu_set_exception(CPUX86State *env, int mask)
     }
 }
 
+static inline floatx80 helper_fadd(CPUX86State *env, floatx80 a, floatx80 b)
+{
+    floatx80 r;
+
+    if (env->x87_hostfp_prec &&
+        x87_hostfp_op(X87_HOSTFP_ADD, env->x87_hostfp_prec, a, b, &r)) {
+        return r;
+    }
+    return floatx80_add(a, b, &env->fp_status);
+}
+
+static inline floatx80 helper_fsub(CPUX86State *env, floatx80 a, floatx80 b)
+{
+    floatx80 r;
+
+    if (env->x87_hostfp_prec &&
+        x87_hostfp_op(X87_HOSTFP_SUB, env->x87_hostfp_prec, a, b, &r)) {
+        return r;
+    }
+    return floatx80_sub(a, b, &env->fp_status);
+}
+
+static inline floatx80 helper_fmul(CPUX86State *env, floatx80 a, floatx80 b)
+{
+    floatx80 r;
+
+    if (env->x87_hostfp_prec &&
+        x87_hostfp_op(X87_HOSTFP_MUL, env->x87_hostfp_prec, a, b, &r)) {
+        return r;
+    }
+    return floatx80_mul(a, b, &env->fp_status);
+}
+
 static inline floatx80 helper_fdiv(CPUX86State *env, floatx80 a, floatx80 b)
 {
+    floatx80 r;
+
     if (floatx80_is_zero(b)) {
         fpu_set_exception(env, FPUS_ZE);
+    } else if (env->x87_hostfp_prec &&
+               x87_hostfp_op(X87_HOSTFP_DIV, env->x87_hostfp_prec, a, b, &r)) {
+        return r;
     }
     return floatx80_div(a, b, &env->fp_status);
 }
@@ -426,22 +466,22 @@ void helper_fucomi_ST0_FT0(CPUX86State *env)
 
 void helper_fadd_ST0_FT0(CPUX86State *env)
 {
-    ST0 = floatx80_add(ST0, FT0, &env->fp_status);
+    ST0 = helper_fadd(env, ST0, FT0);
 }
 
 void helper_fmul_ST0_FT0(CPUX86State *env)
 {
-    ST0 = floatx80_mul(ST0, FT0, &env->fp_status);
+    ST0 = helper_fmul(env, ST0, FT0);
 }
 
 void helper_fsub_ST0_FT0(CPUX86State *env)
 {
-    ST0 = floatx80_sub(ST0, FT0, &env->fp_status);
+    ST0 = helper_fsub(env, ST0, FT0);
 }
 
 void helper_fsubr_ST0_FT0(CPUX86State *env)
 {
-    ST0 = floatx80_sub(FT0, ST0, &env->fp_status);
+    ST0 = helper_fsub(env, FT0, ST0);
 }
 
 void helper_fdiv_ST0_FT0(CPUX86State *env)
@@ -458,22 +498,22 @@ void helper_fdivr_ST0_FT0(CPUX86State *env)
 
 void helper_fadd_STN_ST0(CPUX86State *env, int st_index)
 {
-    ST(st_index) = floatx80_add(ST(st_index), ST0, &env->fp_status);
+    ST(st_index) = helper_fadd(env, ST(st_index), ST0);
 }
 
 void helper_fmul_STN_ST0(CPUX86State *env, int st_index)
 {
-    ST(st_index) = floatx80_mul(ST(st_index), ST0, &env->fp_status);
+    ST(st_index) = helper_fmul(env, ST(st_index), ST0);
 }
 
 void helper_fsub_STN_ST0(CPUX86State *env, int st_index)
 {
-    ST(st_index) = floatx80_sub(ST(st_index), ST0, &env->fp_status);
+    ST(st_index) = helper_fsub(env, ST(st_index), ST0);
 }
 
 void helper_fsubr_STN_ST0(CPUX86State *env, int st_index)
 {
-    ST(st_index) = floatx80_sub(ST0, ST(st_index), &env->fp_status);
+    ST(st_index) = helper_fsub(env, ST0, ST(st_index));
 }
 
 void helper_fdiv_STN_ST0(CPUX86State *env, int st_index)
@@ -587,6 +627,17 @@ void update_fp_status(CPUX86State *env)
         break;
     }
     set_floatx80_rounding_precision(rnd_type, &env->fp_status);
+
+    /*
+     * Only hand arithmetic to the host FPU when it rounds exactly like
+     * softfloat would and no unmasked exception can be missed.
+     */
+    env->x87_hostfp_prec = 0;
+    if (x86_env_get_cpu(env)->x87_hostfp && X87_HOSTFP_SUPPORTED &&
+        (env->fpuc & FPU_RC_MASK) == FPU_RC_NEAR &&
+        (env->fpuc & FPUC_EM) == FPUC_EM && rnd_type != 80) {
+        env->x87_hostfp_prec = rnd_type;
+    }
 }
 
 void helper_fldcw(CPUX86State *env, uint32_t val)
@@ -1544,6 +1595,7 @@ void helper_xsetbv(CPUX86State *env, uint32_t ecx, uint64_t mask)
 /* XXX: optimize by storing fptt and fptags in the static cpu state */
 
 #define SSE_DAZ             0x0040
+#define SSE_EM              0x1f80
 #define SSE_RC_MASK         0x6000
 #define SSE_RC_NEAR         0x0000
 #define SSE_RC_DOWN         0x2000
@@ -1579,6 +1631,14 @@ void update_mxcsr_status(CPUX86State *env)
 
     /* set flush to zero */
     set_flush_to_zero((mxcsr & SSE_FZ) ? 1 : 0, &env->fp_status);
+
+    /*
+     * The host FPU computes the same packed single results as softfloat
+     * when rounding to nearest with denormals honoured and nothing can
+     * trap; NaN results are still left to softfloat by the helpers.
+     */
+    env->sse_hostfp = (mxcsr & (SSE_RC_MASK | SSE_DAZ | SSE_FZ)) == 0 &&
+                      (mxcsr & SSE_EM) == SSE_EM;
 }
 
 void helper_ldmxcsr(CPUX86State *env, uint32_t val)
@@ -19,6 +19,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "cpu.h"
 #include "exec/helper-proto.h"
 #include "exec/exec-all.h"
@@ -554,6 +555,8 @@ static void do_hlt(X86CPU *cpu)
     CPUX86State *env = &cpu->env;
 
     env->hflags &= ~HF_INHIBIT_IRQ_MASK; /* needed if sti is just before */
+    /* a guest hlt must not be ended by a pending idle wake-up */
+    atomic_set(&cpu->idle.sleeping, false);
     cs->halted = 1;
     cs->exception_index = EXCP_HLT;
     cpu_loop_exit(cs);
@@ -569,6 +572,117 @@ void helper_hlt(CPUX86State *env, int next_eip_addend)
     do_hlt(cpu);
 }
 
+/*
+ * Idle detection
+ *
+ * Loops that spin on memory, e.g. the kernel idle loop or a title waiting
+ * for vblank or the GPU, keep a TCG vCPU busy without doing anything. When
+ * enabled, the translator marks side-effect free blocks that branch back to
+ * themselves (helper_idle_loop) and blocks inside configured PC ranges
+ * (helper_idle_range). Once such a block has run often enough without the
+ * guest making progress, the vCPU halts until the next interrupt or for
+ * at most sleep_us.
+ */
+
+/* Consecutive spin iterations before the vCPU is put to sleep */
+#define X86_IDLE_THRESHOLD 256
+
+/* Hits in an idle range further apart than this restart the count */
+#define X86_IDLE_RANGE_WINDOW_NS 100000
+
+#ifndef CONFIG_USER_ONLY
+static void x86_idle_wake(void *opaque)
+{
+    X86CPU *cpu = opaque;
+    CPUState *cs = CPU(cpu);
+
+    if (atomic_xchg(&cpu->idle.sleeping, false)) {
+        cs->halted = 0;
+        qemu_cpu_kick(cs);
+    }
+}
+
+/* Must be called before the vCPU starts running */
+void x86_cpu_enable_idle_detect(X86CPU *cpu, const X86IdleRange *ranges,
+                                int num_ranges, uint32_t sleep_us)
+{
+    X86IdleState *idle = &cpu->idle;
+
+    assert(num_ranges <= X86_IDLE_MAX_RANGES);
+    memcpy(idle->ranges, ranges, num_ranges * sizeof(*ranges));
+    idle->num_ranges = num_ranges;
+    idle->sleep_us = sleep_us;
+    if (!idle->wake_timer) {
+        idle->wake_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, x86_idle_wake,
+                                        cpu);
+    }
+    idle->enabled = true;
+}
+
+static void x86_idle_sleep(X86CPU *cpu)
+{
+    CPUState *cs = CPU(cpu);
+    X86IdleState *idle = &cpu->idle;
+
+    idle->count = 0;
+    atomic_set(&idle->sleeping, true);
+    timer_mod(idle->wake_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                (int64_t)idle->sleep_us * SCALE_US);
+
+    cpu->env.hflags &= ~HF_INHIBIT_IRQ_MASK;
+    cs->halted = 1;
+    cs->exception_index = EXCP_HLT;
+    cpu_loop_exit(cs);
+}
+
+/* The same loop running again with unchanged registers is spinning */
+static void x86_idle_spin(X86CPU *cpu, target_ulong pc)
+{
+    CPUX86State *env = &cpu->env;
+    X86IdleState *idle = &cpu->idle;
+
+    atomic_set(&idle->sleeping, false);
+    if (idle->pc != pc || memcmp(idle->regs, env->regs, sizeof(idle->regs))) {
+        idle->pc = pc;
+        memcpy(idle->regs, env->regs, sizeof(idle->regs));
+        idle->count = 0;
+        return;
+    }
+    if (++idle->count >= X86_IDLE_THRESHOLD) {
+        x86_idle_sleep(cpu);
+    }
+}
+
+void helper_idle_loop(CPUX86State *env)
+{
+    x86_idle_spin(x86_env_get_cpu(env), env->eip);
+}
+
+void helper_idle_range(CPUX86State *env)
+{
+    X86CPU *cpu = x86_env_get_cpu(env);
+    X86IdleState *idle = &cpu->idle;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    atomic_set(&idle->sleeping, false);
+    if (now - idle->last_ns > X86_IDLE_RANGE_WINDOW_NS) {
+        idle->count = 0;
+    }
+    idle->last_ns = now;
+    if (++idle->count >= X86_IDLE_THRESHOLD) {
+        x86_idle_sleep(cpu);
+    }
+}
+#else
+void helper_idle_loop(CPUX86State *env)
+{
+}
+
+void helper_idle_range(CPUX86State *env)
+{
+}
+#endif
+
 void helper_monitor(CPUX86State *env, target_ulong ptr)
 {
     if ((uint32_t)env->regs[R_ECX] != 0) {
@@ -606,6 +720,11 @@ void helper_pause(CPUX86State *env, int next_eip_addend)
     cpu_svm_check_intercept_param(env, SVM_EXIT_PAUSE, 0, GETPC());
     env->eip += next_eip_addend;
 
+#ifndef CONFIG_USER_ONLY
+    if (cpu->idle.enabled) {
+        x86_idle_spin(cpu, env->eip);
+    }
+#endif
     do_pause(cpu);
 }
 
@@ -579,15 +579,16 @@ void glue(helper_pshufhw, SUFFIX)(Reg *d, Reg *s, int order)
 /* FPU ops */
 /* XXX: not accurate */
 
-#define SSE_HELPER_S(name, F)                                           \
+#define SSE_HELPER_PS(name, F)                                          \
     void helper_ ## name ## ps(CPUX86State *env, Reg *d, Reg *s)        \
     {                                                                   \
         d->ZMM_S(0) = F(32, d->ZMM_S(0), s->ZMM_S(0));                  \
         d->ZMM_S(1) = F(32, d->ZMM_S(1), s->ZMM_S(1));                  \
         d->ZMM_S(2) = F(32, d->ZMM_S(2), s->ZMM_S(2));                  \
         d->ZMM_S(3) = F(32, d->ZMM_S(3), s->ZMM_S(3));                  \
-    }                                                                   \
-                                                                        \
+    }
+
+#define SSE_HELPER_SS_PD_SD(name, F)                                    \
     void helper_ ## name ## ss(CPUX86State *env, Reg *d, Reg *s)        \
     {                                                                   \
         d->ZMM_S(0) = F(32, d->ZMM_S(0), s->ZMM_S(0));                  \
@@ -604,6 +605,89 @@ void glue(helper_pshufhw, SUFFIX)(Reg *d, Reg *s, int order)
         d->ZMM_D(0) = F(64, d->ZMM_D(0), s->ZMM_D(0));                  \
     }
 
+#define SSE_HELPER_S(name, F)                                           \
+    SSE_HELPER_PS(name, F)                                              \
+    SSE_HELPER_SS_PD_SD(name, F)
+
+/*
+ * Packed single add/sub/mul/div on the host FPU, four lanes at a time.
+ * With env->sse_hostfp set (round to nearest, no DAZ/FTZ, all exceptions
+ * masked) the host produces the same bits as softfloat for every lane
+ * that is not a NaN; NaN propagation differs between hosts, so any NaN
+ * result sends the whole operation back to softfloat. This needs a host
+ * that evaluates float expressions in single precision.
+ */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define SSE_HOSTFP_SUPPORTED 1
+typedef float sse_v4sf __attribute__((vector_size(16)));
+typedef int32_t sse_v4si __attribute__((vector_size(16)));
+#else
+#define SSE_HOSTFP_SUPPORTED 0
+#endif
+
+enum {
+    SSE_HOSTFP_ADD,
+    SSE_HOSTFP_SUB,
+    SSE_HOSTFP_MUL,
+    SSE_HOSTFP_DIV,
+};
+
+static inline bool sse_hostfp_ps(CPUX86State *env, Reg *d, Reg *s, int op)
+{
+#if SSE_HOSTFP_SUPPORTED
+    sse_v4si a, b, nan;
+    sse_v4sf r;
+
+    if (unlikely(!env->sse_hostfp)) {
+        return false;
+    }
+    a = (sse_v4si) { d->ZMM_L(0), d->ZMM_L(1), d->ZMM_L(2), d->ZMM_L(3) };
+    b = (sse_v4si) { s->ZMM_L(0), s->ZMM_L(1), s->ZMM_L(2), s->ZMM_L(3) };
+    switch (op) {
+    case SSE_HOSTFP_ADD:
+        r = (sse_v4sf)a + (sse_v4sf)b;
+        break;
+    case SSE_HOSTFP_SUB:
+        r = (sse_v4sf)a - (sse_v4sf)b;
+        break;
+    case SSE_HOSTFP_MUL:
+        r = (sse_v4sf)a * (sse_v4sf)b;
+        break;
+    case SSE_HOSTFP_DIV:
+        r = (sse_v4sf)a / (sse_v4sf)b;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    nan = r != r;
+    if (unlikely(nan[0] | nan[1] | nan[2] | nan[3])) {
+        return false;
+    }
+    a = (sse_v4si)r;
+    d->ZMM_L(0) = a[0];
+    d->ZMM_L(1) = a[1];
+    d->ZMM_L(2) = a[2];
+    d->ZMM_L(3) = a[3];
+    return true;
+#else
+    return false;
+#endif
+}
+
+#define SSE_HELPER_S_HOST(name, F, OP)                                  \
+    void helper_ ## name ## ps(CPUX86State *env, Reg *d, Reg *s)        \
+    {                                                                   \
+        if (sse_hostfp_ps(env, d, s, OP)) {                             \
+            return;                                                     \
+        }                                                               \
+        d->ZMM_S(0) = F(32, d->ZMM_S(0), s->ZMM_S(0));                  \
+        d->ZMM_S(1) = F(32, d->ZMM_S(1), s->ZMM_S(1));                  \
+        d->ZMM_S(2) = F(32, d->ZMM_S(2), s->ZMM_S(2));                  \
+        d->ZMM_S(3) = F(32, d->ZMM_S(3), s->ZMM_S(3));                  \
+    }                                                                   \
+                                                                        \
+    SSE_HELPER_SS_PD_SD(name, F)
+
 #define FPU_ADD(size, a, b) float ## size ## _add(a, b, &env->sse_status)
 #define FPU_SUB(size, a, b) float ## size ## _sub(a, b, &env->sse_status)
 #define FPU_MUL(size, a, b) float ## size ## _mul(a, b, &env->sse_status)
@@ -619,10 +703,10 @@ void glue(helper_pshufhw, SUFFIX)(Reg *d, Reg *s, int order)
 #define FPU_MAX(size, a, b)                                     \
     (float ## size ## _lt(b, a, &env->sse_status) ? (a) : (b))
 
-SSE_HELPER_S(add, FPU_ADD)
-SSE_HELPER_S(sub, FPU_SUB)
-SSE_HELPER_S(mul, FPU_MUL)
-SSE_HELPER_S(div, FPU_DIV)
+SSE_HELPER_S_HOST(add, FPU_ADD, SSE_HOSTFP_ADD)
+SSE_HELPER_S_HOST(sub, FPU_SUB, SSE_HOSTFP_SUB)
+SSE_HELPER_S_HOST(mul, FPU_MUL, SSE_HOSTFP_MUL)
+SSE_HELPER_S_HOST(div, FPU_DIV, SSE_HOSTFP_DIV)
 SSE_HELPER_S(min, FPU_MIN)
 SSE_HELPER_S(max, FPU_MAX)
 SSE_HELPER_S(sqrt, FPU_SQRT)
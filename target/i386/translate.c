@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 #include "exec/translator.h"
 
@@ -69,6 +70,9 @@
     case (2 << 6) | (OP << 3) | 0 ... (2 << 6) | (OP << 3) | 7: \
     case (3 << 6) | (OP << 3) | 0 ... (3 << 6) | (OP << 3) | 7
 
+/* Conditional branches a trace may continue past, see gen_jcc() */
+#define X86_MAX_SIDE_EXITS 4
+
 //#define MACRO_TEST   1
 
 /* global register indexes */
@@ -126,6 +130,11 @@ typedef struct DisasContext {
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
     int cpuid_xsave_features;
+    bool idle_detect; /* mark spin loops for idle detection */
+    bool trace; /* continue through forward jumps, see CF_TRACE */
+    int nb_side_exits;
+    TCGLabel *side_exit_label[X86_MAX_SIDE_EXITS];
+    target_ulong side_exit_eip[X86_MAX_SIDE_EXITS];
 
     /* TCG local temps */
     TCGv cc_srcT;
@@ -2221,10 +2230,39 @@ static inline bool use_goto_tb(DisasContext *s, target_ulong pc)
 #endif
 }
 
+/* Nothing emitted so far in this TB stores to memory or has side effects */
+static bool gen_tb_is_read_only(void)
+{
+    TCGOp *op;
+
+    QTAILQ_FOREACH(op, &tcg_ctx->ops, link) {
+        switch (op->opc) {
+        case INDEX_op_qemu_st_i32:
+        case INDEX_op_qemu_st_i64:
+            return false;
+        case INDEX_op_call:
+            if (!(op->args[TCGOP_CALLO(op) + TCGOP_CALLI(op) + 1]
+                  & TCG_CALL_NO_SIDE_EFFECTS)) {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
 static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 {
     target_ulong pc = s->cs_base + eip;
 
+    /* A block that only reads and branches back to itself may be spinning */
+    if (s->idle_detect && pc == s->base.pc_first && gen_tb_is_read_only()) {
+        gen_jmp_im(s, eip);
+        gen_helper_idle_loop(cpu_env);
+    }
+
     if (use_goto_tb(s, pc))  {
         /* jump to same page: we can use a direct jump */
         tcg_gen_goto_tb(tb_num);
@@ -2238,12 +2276,38 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
     }
 }
 
+/* In a trace, keep translating at the target of a forward direct jump
+   within the first page of the block, instead of ending the block.  The
+   block then still covers a single range of guest code.  */
+static bool gen_trace_jmp(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    if (!s->trace || pc <= s->pc ||
+        (pc & TARGET_PAGE_MASK) != (s->base.pc_first & TARGET_PAGE_MASK)) {
+        return false;
+    }
+    s->pc = pc;
+    atomic_inc(&tb_ctx.trace_jmp_count);
+    return true;
+}
+
 static inline void gen_jcc(DisasContext *s, int b,
                            target_ulong val, target_ulong next_eip)
 {
     TCGLabel *l1, *l2;
 
-    if (s->jmp_opt) {
+    if (s->trace && s->cs_base + val > s->pc &&
+        s->nb_side_exits < X86_MAX_SIDE_EXITS) {
+        /* A forward branch is predicted not taken: continue with the
+           fall through and leave the block at the end if it is taken. */
+        l1 = gen_new_label();
+        gen_jcc1(s, b, l1);
+        s->side_exit_label[s->nb_side_exits] = l1;
+        s->side_exit_eip[s->nb_side_exits] = val;
+        s->nb_side_exits++;
+        atomic_inc(&tb_ctx.trace_side_exit_count);
+    } else if (s->jmp_opt) {
         l1 = gen_new_label();
         gen_jcc1(s, b, l1);
 
@@ -2680,12 +2744,17 @@ static inline void gen_sto_env_A0(DisasContext *s, int offset)
     tcg_gen_qemu_st_i64(s->tmp1_i64, s->tmp0, mem_index, MO_LEQ);
 }
 
+/* Offset of the 128 bits of an xmm register within its ZMMReg, for gvec */
+#ifdef HOST_WORDS_BIGENDIAN
+#define XMM_GVEC_OFS offsetof(ZMMReg, ZMM_Q(1))
+#else
+#define XMM_GVEC_OFS offsetof(ZMMReg, ZMM_Q(0))
+#endif
+
 static inline void gen_op_movo(DisasContext *s, int d_offset, int s_offset)
 {
-    tcg_gen_ld_i64(s->tmp1_i64, cpu_env, s_offset + offsetof(ZMMReg, ZMM_Q(0)));
-    tcg_gen_st_i64(s->tmp1_i64, cpu_env, d_offset + offsetof(ZMMReg, ZMM_Q(0)));
-    tcg_gen_ld_i64(s->tmp1_i64, cpu_env, s_offset + offsetof(ZMMReg, ZMM_Q(1)));
-    tcg_gen_st_i64(s->tmp1_i64, cpu_env, d_offset + offsetof(ZMMReg, ZMM_Q(1)));
+    tcg_gen_gvec_mov(MO_64, d_offset + XMM_GVEC_OFS, s_offset + XMM_GVEC_OFS,
+                     16, 16);
 }
 
 static inline void gen_op_movq(DisasContext *s, int d_offset, int s_offset)
@@ -4455,6 +4524,26 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             tcg_gen_addi_ptr(s->ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, s->ptr0, s->ptr1);
             break;
+        case 0x54: /* andps, andpd */
+            tcg_gen_gvec_and(MO_64, op1_offset + XMM_GVEC_OFS,
+                             op1_offset + XMM_GVEC_OFS,
+                             op2_offset + XMM_GVEC_OFS, 16, 16);
+            break;
+        case 0x55: /* andnps, andnpd */
+            tcg_gen_gvec_andc(MO_64, op1_offset + XMM_GVEC_OFS,
+                              op2_offset + XMM_GVEC_OFS,
+                              op1_offset + XMM_GVEC_OFS, 16, 16);
+            break;
+        case 0x56: /* orps, orpd */
+            tcg_gen_gvec_or(MO_64, op1_offset + XMM_GVEC_OFS,
+                            op1_offset + XMM_GVEC_OFS,
+                            op2_offset + XMM_GVEC_OFS, 16, 16);
+            break;
+        case 0x57: /* xorps, xorpd */
+            tcg_gen_gvec_xor(MO_64, op1_offset + XMM_GVEC_OFS,
+                             op1_offset + XMM_GVEC_OFS,
+                             op2_offset + XMM_GVEC_OFS, 16, 16);
+            break;
         case 0xf7:
             /* maskmov : we must prepare A0 */
             if (mod != 3)
@@ -6588,7 +6677,9 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
             tval &= 0xffffffff;
         }
         gen_bnd_jmp(s);
-        gen_jmp(s, tval);
+        if (!gen_trace_jmp(s, tval)) {
+            gen_jmp(s, tval);
+        }
         break;
     case 0xea: /* ljmp im */
         {
@@ -6610,7 +6701,9 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
-        gen_jmp(s, tval);
+        if (!gen_trace_jmp(s, tval)) {
+            gen_jmp(s, tval);
+        }
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, MO_8);
@@ -8429,6 +8522,26 @@ void tcg_x86_init(void)
     }
 }
 
+/* Everything i386_tr_init_disas_context() and the decoder read from the
+ * CPU besides the TB flags */
+void x86_cpu_tb_cache_config(CPUState *cs, GByteArray *config)
+{
+    X86CPU *cpu = X86_CPU(cs);
+    CPUX86State *env = &cpu->env;
+    X86IdleState *idle = &cpu->idle;
+
+    g_byte_array_append(config, (guint8 *)env->features,
+                        sizeof(env->features));
+    g_byte_array_append(config, (guint8 *)&env->cpuid_vendor1,
+                        sizeof(env->cpuid_vendor1));
+    g_byte_array_append(config, (guint8 *)&idle->enabled,
+                        sizeof(idle->enabled));
+    if (idle->enabled) {
+        g_byte_array_append(config, (guint8 *)idle->ranges,
+                            idle->num_ranges * sizeof(idle->ranges[0]));
+    }
+}
+
 static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
@@ -8460,6 +8573,7 @@ static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
     dc->cpuid_ext3_features = env->features[FEAT_8000_0001_ECX];
     dc->cpuid_7_0_ebx_features = env->features[FEAT_7_0_EBX];
     dc->cpuid_xsave_features = env->features[FEAT_XSAVE];
+    dc->idle_detect = x86_env_get_cpu(env)->idle.enabled;
 #ifdef TARGET_X86_64
     dc->lma = (flags >> HF_LMA_SHIFT) & 1;
     dc->code64 = (flags >> HF_CS64_SHIFT) & 1;
@@ -8478,6 +8592,10 @@ static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
        additional step for ecx=0 when icount is enabled.
      */
     dc->repz_opt = !dc->jmp_opt && !(tb_cflags(dc->base.tb) & CF_USE_ICOUNT);
+    /* icount charges the whole block up front, so no early exits there */
+    dc->trace = dc->jmp_opt && (tb_cflags(dc->base.tb) & CF_TRACE) &&
+                !(tb_cflags(dc->base.tb) & CF_USE_ICOUNT);
+    dc->nb_side_exits = 0;
 #if 0
     /* check addseg logic */
     if (!dc->addseg && (dc->vm86 || !dc->pe || !dc->code32))
@@ -8500,6 +8618,21 @@ static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
 
 static void i386_tr_tb_start(DisasContextBase *db, CPUState *cpu)
 {
+    DisasContext *dc = container_of(db, DisasContext, base);
+    X86IdleState *idle = &X86_CPU(cpu)->idle;
+    target_ulong pc = dc->base.pc_first;
+    int i;
+
+    if (!dc->idle_detect) {
+        return;
+    }
+    for (i = 0; i < idle->num_ranges; i++) {
+        if (pc >= idle->ranges[i].start && pc < idle->ranges[i].end) {
+            gen_jmp_im(dc, pc - dc->cs_base);
+            gen_helper_idle_range(cpu_env);
+            break;
+        }
+    }
 }
 
 static void i386_tr_insn_start(DisasContextBase *dcbase, CPUState *cpu)
@@ -8564,10 +8697,21 @@ static void i386_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
 
+    int i;
+
     if (dc->base.is_jmp == DISAS_TOO_MANY) {
         gen_jmp_im(dc, dc->base.pc_next - dc->cs_base);
         gen_eob(dc);
     }
+
+    /* Taken trace branches; gen_jcc1() has already written back cc_op */
+    for (i = 0; i < dc->nb_side_exits; i++) {
+        gen_set_label(dc->side_exit_label[i]);
+        dc->cc_op = CC_OP_DYNAMIC;
+        dc->cc_op_dirty = false;
+        gen_jmp_im(dc, dc->side_exit_eip[i]);
+        gen_jr(dc, dc->tmp0);
+    }
 }
 
 static void i386_tr_disas_log(const DisasContextBase *dcbase,
@@ -0,0 +1,213 @@
+/*
+ * x87 host FPU fast path
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef X87_HOSTFP_H
+#define X87_HOSTFP_H
+
+#include <float.h>
+#include "fpu/softfloat.h"
+
+/*
+ * With the precision control set to 24 or 53 bits, round to nearest and
+ * every exception masked, an x87 add/sub/mul/div whose operands are exact
+ * host floats (resp. doubles) rounds to the same value as the host
+ * operation, as long as the host result is a normal number: the wider
+ * floatx80 exponent range only makes a difference on overflow and
+ * underflow. Anything else is left to floatx80 softfloat.
+ *
+ * This relies on the host evaluating float and double expressions in
+ * their own precision, which rules out x87 hosts.
+ */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define X87_HOSTFP_SUPPORTED 1
+#else
+#define X87_HOSTFP_SUPPORTED 0
+#endif
+
+#define X87_HOSTFP_EXP_BIAS 16383
+
+typedef enum X87HostFPOp {
+    X87_HOSTFP_ADD,
+    X87_HOSTFP_SUB,
+    X87_HOSTFP_MUL,
+    X87_HOSTFP_DIV,
+} X87HostFPOp;
+
+static inline bool x87_hostfp_unpack64(floatx80 a, double *d)
+{
+    union {
+        uint64_t i;
+        double d;
+    } u;
+    int exp = (a.high & 0x7fff) - X87_HOSTFP_EXP_BIAS;
+
+    u.i = (uint64_t)(a.high >> 15) << 63;
+    if (a.low != 0 || (a.high & 0x7fff) != 0) {
+        if (exp < -1022 || exp > 1023 ||
+            !(a.low >> 63) || (a.low & 0x7ff) != 0) {
+            return false;
+        }
+        u.i |= (uint64_t)(exp + 1023) << 52;
+        u.i |= (a.low >> 11) & ((1ULL << 52) - 1);
+    }
+    *d = u.d;
+    return true;
+}
+
+static inline floatx80 x87_hostfp_pack64(double d)
+{
+    union {
+        uint64_t i;
+        double d;
+    } u;
+    uint16_t sign, exp;
+
+    u.d = d;
+    sign = (u.i >> 63) << 15;
+    exp = (u.i >> 52) & 0x7ff;
+    if (exp == 0) {
+        return make_floatx80(sign, 0);
+    }
+    return make_floatx80(sign | (exp - 1023 + X87_HOSTFP_EXP_BIAS),
+                         (1ULL << 63) | ((u.i & ((1ULL << 52) - 1)) << 11));
+}
+
+static inline bool x87_hostfp_unpack32(floatx80 a, float *f)
+{
+    union {
+        uint32_t i;
+        float f;
+    } u;
+    int exp = (a.high & 0x7fff) - X87_HOSTFP_EXP_BIAS;
+
+    u.i = (uint32_t)(a.high >> 15) << 31;
+    if (a.low != 0 || (a.high & 0x7fff) != 0) {
+        if (exp < -126 || exp > 127 ||
+            !(a.low >> 63) || (a.low & ((1ULL << 40) - 1)) != 0) {
+            return false;
+        }
+        u.i |= (uint32_t)(exp + 127) << 23;
+        u.i |= (a.low >> 40) & ((1U << 23) - 1);
+    }
+    *f = u.f;
+    return true;
+}
+
+static inline floatx80 x87_hostfp_pack32(float f)
+{
+    union {
+        uint32_t i;
+        float f;
+    } u;
+    uint16_t sign, exp;
+
+    u.f = f;
+    sign = (u.i >> 31) << 15;
+    exp = (u.i >> 23) & 0xff;
+    if (exp == 0) {
+        return make_floatx80(sign, 0);
+    }
+    return make_floatx80(sign | (exp - 127 + X87_HOSTFP_EXP_BIAS),
+                         (1ULL << 63) |
+                         ((uint64_t)(u.i & ((1U << 23) - 1)) << 40));
+}
+
+/*
+ * Filter the host result: a zero is only exact for add/sub (cancellation is
+ * exact) or when a mul/div operand is zero, otherwise the result underflowed
+ * and softfloat would produce a tiny non-zero value. Results at the bottom
+ * of the normal range may have been rounded on the subnormal grid, so they
+ * must lie strictly above it. Infinities and NaNs always fail the compare.
+ */
+#define X87_HOSTFP_BODY(fr, fa, fb, op, min, max)                  \
+    do {                                                            \
+        switch (op) {                                               \
+        case X87_HOSTFP_ADD:                                        \
+            fr = fa + fb;                                           \
+            break;                                                  \
+        case X87_HOSTFP_SUB:                                        \
+            fr = fa - fb;                                           \
+            break;                                                  \
+        case X87_HOSTFP_MUL:                                        \
+            fr = fa * fb;                                           \
+            if (fr == 0 && fa != 0 && fb != 0) {                    \
+                return false;                                       \
+            }                                                       \
+            break;                                                  \
+        case X87_HOSTFP_DIV:                                        \
+            if (fb == 0) {                                          \
+                return false;                                       \
+            }                                                       \
+            fr = fa / fb;                                           \
+            if (fr == 0 && fa != 0) {                               \
+                return false;                                       \
+            }                                                       \
+            break;                                                  \
+        default:                                                    \
+            return false;                                           \
+        }                                                           \
+        if (fr != 0 && !((fr > min && fr <= max) ||                 \
+                         (fr < -min && fr >= -max))) {              \
+            return false;                                           \
+        }                                                           \
+    } while (0)
+
+static inline bool x87_hostfp_op64(X87HostFPOp op, floatx80 a, floatx80 b,
+                                   floatx80 *r)
+{
+    double fa, fb, fr;
+
+    if (!x87_hostfp_unpack64(a, &fa) || !x87_hostfp_unpack64(b, &fb)) {
+        return false;
+    }
+    X87_HOSTFP_BODY(fr, fa, fb, op, DBL_MIN, DBL_MAX);
+    *r = x87_hostfp_pack64(fr);
+    return true;
+}
+
+static inline bool x87_hostfp_op32(X87HostFPOp op, floatx80 a, floatx80 b,
+                                   floatx80 *r)
+{
+    float fa, fb, fr;
+
+    if (!x87_hostfp_unpack32(a, &fa) || !x87_hostfp_unpack32(b, &fb)) {
+        return false;
+    }
+    X87_HOSTFP_BODY(fr, fa, fb, op, FLT_MIN, FLT_MAX);
+    *r = x87_hostfp_pack32(fr);
+    return true;
+}
+
+/*
+ * @prec is the floatx80 rounding precision the fast path was enabled for
+ * (32 or 64), or 0 if it is disabled. Returns false if @r must instead be
+ * computed with softfloat.
+ */
+static inline bool x87_hostfp_op(X87HostFPOp op, int prec, floatx80 a,
+                                 floatx80 b, floatx80 *r)
+{
+#if X87_HOSTFP_SUPPORTED
+    if (prec == 64) {
+        return x87_hostfp_op64(op, a, b, r);
+    } else if (prec == 32) {
+        return x87_hostfp_op32(op, a, b, r);
+    }
+#endif
+    return false;
+}
+
+#endif
@@ -181,6 +181,11 @@ static bool patch_reloc(tcg_insn_unit *code_ptr, int type,
     case R_386_32:
         tcg_patch32(code_ptr, value);
         break;
+#if TCG_TARGET_REG_BITS == 64
+    case R_X86_64_64:
+        tcg_patch64(code_ptr, value);
+        break;
+#endif
     case R_386_PC8:
         value -= (uintptr_t)code_ptr;
         if (value != (int8_t)value) {
@@ -960,9 +965,11 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
         return;
     }
 
-    /* Try a 7 byte pc-relative lea before the 10 byte movq.  */
+    /* Try a 7 byte pc-relative lea before the 10 byte movq.  A relocatable
+       TB must not turn constants into pc-relative references.  */
     diff = arg - ((uintptr_t)s->code_ptr + 7);
-    if (diff == (int32_t)diff) {
+    if (diff == (int32_t)diff && !(TCG_TARGET_HAS_tb_reloc &&
+                                   s->tb_reloc_enabled)) {
         tcg_out_opc(s, OPC_LEA | P_REXW, ret, 0, 0);
         tcg_out8(s, (LOWREGMASK(ret) << 3) | 5);
         tcg_out32(s, diff);
@@ -973,6 +980,20 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     tcg_out64(s, arg);
 }
 
+/* Load the address of @ptr, within the code of the current TB.  */
+static void tcg_out_movi_code(TCGContext *s, TCGReg ret, tcg_insn_unit *ptr)
+{
+#if TCG_TARGET_HAS_tb_reloc
+    if (s->tb_reloc_enabled) {
+        tcg_out_opc(s, OPC_LEA | P_REXW, ret, 0, 0);
+        tcg_out8(s, (LOWREGMASK(ret) << 3) | 5);
+        tcg_out32(s, tcg_pcrel_diff(s, ptr) - 4);
+        return;
+    }
+#endif
+    tcg_out_movi(s, TCG_TYPE_PTR, ret, (uintptr_t)ptr);
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -1530,6 +1551,22 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_insn_unit *dest)
 {
     intptr_t disp = tcg_pcrel_diff(s, dest) - 5;
 
+#if TCG_TARGET_HAS_tb_reloc
+    /* Outside of the TB, the distance to the helper changes with where
+       the TB is loaded: use an absolute address in a call-clobbered
+       register that is not used for arguments.  */
+    if (s->tb_reloc_enabled && (dest < s->code_buf || dest > s->code_ptr)) {
+        tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(TCG_REG_R11),
+                    0, TCG_REG_R11, 0);
+        tcg_out_tb_reloc(s, s->code_ptr, R_X86_64_64, TCG_TB_RELOC_BINARY,
+                         (uintptr_t)dest, 0);
+        tcg_out64(s, (uintptr_t)dest);
+        tcg_out_modrm(s, OPC_GRP5, call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev,
+                      TCG_REG_R11);
+        return;
+    }
+#endif
+
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
         tcg_out32(s, disp);
@@ -1555,6 +1592,28 @@ static void tcg_out_jmp(TCGContext *s, tcg_insn_unit *dest)
     tcg_out_branch(s, 0, dest);
 }
 
+#if TCG_TARGET_HAS_tb_reloc
+/* exit_tb for a relocatable TB: the epilogue is always within reach of
+   a rel32, but both it and the TB pointer move with the TB.  */
+static void tcg_out_exit_tb_reloc(TCGContext *s, uintptr_t a0)
+{
+    TCGTBRelocSym sym = TCG_TB_RELOC_EPILOGUE;
+    tcg_insn_unit *dest = s->code_gen_epilogue;
+
+    if (a0 != 0) {
+        tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(TCG_REG_EAX),
+                    0, TCG_REG_EAX, 0);
+        tcg_out_tb_reloc(s, s->code_ptr, R_X86_64_64, TCG_TB_RELOC_TB, a0, 0);
+        tcg_out64(s, a0);
+        sym = TCG_TB_RELOC_TB_RET;
+        dest = tb_ret_addr;
+    }
+    tcg_out8(s, OPC_JMP_long);
+    tcg_out_tb_reloc(s, s->code_ptr, R_386_PC32, sym, (uintptr_t)dest, -4);
+    tcg_out32(s, tcg_pcrel_diff(s, dest) - 4);
+}
+#endif
+
 static void tcg_out_nopn(TCGContext *s, int n)
 {
     int i;
@@ -1765,8 +1824,7 @@ static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
         tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
         /* The second argument is already loaded with addrlo.  */
         tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2], oi);
-        tcg_out_movi(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[3],
-                     (uintptr_t)l->raddr);
+        tcg_out_movi_code(s, tcg_target_call_iarg_regs[3], l->raddr);
     }
 
     tcg_out_call(s, qemu_ld_helpers[opc & (MO_BSWAP | MO_SIZE)]);
@@ -1864,10 +1922,10 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
 
         if (ARRAY_SIZE(tcg_target_call_iarg_regs) > 4) {
             retaddr = tcg_target_call_iarg_regs[4];
-            tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+            tcg_out_movi_code(s, retaddr, l->raddr);
         } else {
             retaddr = TCG_REG_RAX;
-            tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+            tcg_out_movi_code(s, retaddr, l->raddr);
             tcg_out_st(s, TCG_TYPE_PTR, retaddr, TCG_REG_ESP,
                        TCG_TARGET_CALL_STACK_OFFSET);
         }
@@ -2196,6 +2254,12 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch (opc) {
     case INDEX_op_exit_tb:
+#if TCG_TARGET_HAS_tb_reloc
+        if (s->tb_reloc_enabled) {
+            tcg_out_exit_tb_reloc(s, a0);
+            break;
+        }
+#endif
         /* Reuse the zeroing that exists for goto_ptr.  */
         if (a0 == 0) {
             tcg_out_jmp(s, s->code_gen_epilogue);
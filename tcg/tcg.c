@@ -126,6 +126,11 @@ static bool tcg_out_sti(TCGContext *s, TCGType type, TCGArg val,
 static void tcg_out_call(TCGContext *s, tcg_insn_unit *target);
 static int tcg_target_const_match(tcg_target_long val, TCGType type,
                                   const TCGArgConstraint *arg_ct);
+#if TCG_TARGET_HAS_tb_reloc
+static void tcg_out_tb_reloc(TCGContext *s, tcg_insn_unit *code_ptr, int type,
+                             TCGTBRelocSym sym, uintptr_t value,
+                             intptr_t addend);
+#endif
 #ifdef TCG_TARGET_NEED_LDST_LABELS
 static bool tcg_out_ldst_finalize(TCGContext *s);
 #endif
@@ -322,6 +327,80 @@ static void set_jmp_reset_offset(TCGContext *s, int which)
 
 #include "tcg-target.inc.c"
 
+#if TCG_TARGET_HAS_tb_reloc
+/* Bounds of the executable's text, provided by the linker */
+extern const char __executable_start[], etext[];
+
+static uintptr_t tcg_tb_reloc_base(TCGContext *s, TranslationBlock *tb,
+                                   TCGTBRelocSym sym)
+{
+    switch (sym) {
+    case TCG_TB_RELOC_BINARY:
+        return (uintptr_t)__executable_start;
+    case TCG_TB_RELOC_EPILOGUE:
+        return (uintptr_t)s->code_gen_epilogue;
+    case TCG_TB_RELOC_TB_RET:
+        return (uintptr_t)tb_ret_addr;
+    case TCG_TB_RELOC_TB:
+        return (uintptr_t)tb;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* Record that @code_ptr refers to @value, which is about to be encoded
+   at @code_ptr as a relocation of @type against @value with @addend.  */
+static void tcg_out_tb_reloc(TCGContext *s, tcg_insn_unit *code_ptr, int type,
+                             TCGTBRelocSym sym, uintptr_t value,
+                             intptr_t addend)
+{
+    TCGTBReloc *r;
+
+    if (s->tb_reloc_failed) {
+        return;
+    }
+    addend += value - tcg_tb_reloc_base(s, s->gen_tb, sym);
+    if ((sym == TCG_TB_RELOC_BINARY &&
+         (value < (uintptr_t)__executable_start || value >= (uintptr_t)etext)) ||
+        (sym == TCG_TB_RELOC_TB && (addend & ~TB_EXIT_MASK)) ||
+        s->nb_tb_relocs == TCG_MAX_TB_RELOCS) {
+        s->tb_reloc_failed = true;
+        return;
+    }
+
+    r = &s->tb_relocs[s->nb_tb_relocs++];
+    r->offset = tcg_ptr_byte_diff(code_ptr, s->code_buf);
+    r->type = type;
+    r->sym = sym;
+    r->addend = addend;
+}
+
+/* Patch the code of @tb, copied from another TB (possibly generated by
+   another QEMU process running the same executable), for its address.  */
+bool tcg_tb_reloc_apply(TCGContext *s, TranslationBlock *tb,
+                        const TCGTBReloc *relocs, int nb_relocs)
+{
+    int i;
+
+    for (i = 0; i < nb_relocs; i++) {
+        const TCGTBReloc *r = &relocs[i];
+
+        if (r->offset >= tb->tc.size ||
+            !patch_reloc((void *)tb->tc.ptr + r->offset, r->type,
+                         tcg_tb_reloc_base(s, tb, r->sym), r->addend)) {
+            return false;
+        }
+    }
+    return true;
+}
+#else
+bool tcg_tb_reloc_apply(TCGContext *s, TranslationBlock *tb,
+                        const TCGTBReloc *relocs, int nb_relocs)
+{
+    return false;
+}
+#endif
+
 /* compare a pointer @ptr and a tb_tc @s */
 static int ptr_cmp_tb_tc(const void *ptr, const struct tb_tc *s)
 {
@@ -3917,6 +3996,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 
     s->code_buf = tb->tc.ptr;
     s->code_ptr = tb->tc.ptr;
+    s->gen_tb = tb;
+    s->tb_reloc_failed = false;
+    s->nb_tb_relocs = 0;
 
 #ifdef TCG_TARGET_NEED_LDST_LABELS
     QSIMPLEQ_INIT(&s->ldst_labels);
@@ -198,6 +198,12 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_HAS_v256             0
 #endif
 
+/* Backend can record the relocations needed to move a TB to another
+   address, see TCGTBReloc.  */
+#ifndef TCG_TARGET_HAS_tb_reloc
+#define TCG_TARGET_HAS_tb_reloc         0
+#endif
+
 #ifndef TARGET_INSN_START_EXTRA_WORDS
 # define TARGET_INSN_START_WORDS 1
 #else
@@ -661,6 +667,25 @@ typedef struct TCGProfile {
     int64_t table_op_count[NB_OPS];
 } TCGProfile;
 
+/* What a TB relocation is relative to.  */
+typedef enum TCGTBRelocSym {
+    TCG_TB_RELOC_BINARY,    /* code in the QEMU executable */
+    TCG_TB_RELOC_EPILOGUE,  /* code_gen_epilogue */
+    TCG_TB_RELOC_TB_RET,    /* the backend's return path for exit_tb */
+    TCG_TB_RELOC_TB,        /* the TranslationBlock itself */
+} TCGTBRelocSym;
+
+/* A reference from the code of a TB to something outside of it, which
+   must be patched with patch_reloc() if the code is moved.  */
+typedef struct TCGTBReloc {
+    uint32_t offset;        /* from the start of the TB code */
+    uint8_t type;           /* backend relocation type */
+    uint8_t sym;            /* TCGTBRelocSym */
+    int64_t addend;
+} TCGTBReloc;
+
+#define TCG_MAX_TB_RELOCS 512
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current, *pool_first_large;
@@ -724,6 +749,15 @@ struct TCGContext {
 
     TCGLabel *exitreq_label;
 
+    /* Relocations of the TB being generated, recorded by the backend if
+       tb_reloc_enabled.  tb_reloc_failed is set if the code cannot be
+       made relocatable.  */
+    bool tb_reloc_enabled;
+    bool tb_reloc_failed;
+    int nb_tb_relocs;
+    TranslationBlock *gen_tb;
+    TCGTBReloc tb_relocs[TCG_MAX_TB_RELOCS];
+
     TCGTempSet free_temps[TCG_TYPE_COUNT * 2];
     TCGTemp temps[TCG_MAX_TEMPS]; /* globals first, temps after */
 
@@ -916,6 +950,8 @@ void tcg_prologue_init(TCGContext *s);
 void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb);
+bool tcg_tb_reloc_apply(TCGContext *s, TranslationBlock *tb,
+                        const TCGTBReloc *relocs, int nb_relocs);
 
 void tcg_set_frame(TCGContext *s, TCGReg reg, intptr_t start, intptr_t size);
 
@@ -0,0 +1,214 @@
+/*
+ * x87-hostfp-test.c - check the x87 host FPU fast path against softfloat
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ *
+ * Feeds random operands (biased towards the edges of the float/double
+ * exponent range, cancellation and values that are not representable in
+ * the target precision) to the fast path used by the x87 helpers and
+ * checks that whenever it produces a result, the result is bit-identical
+ * to floatx80 softfloat with the same rounding precision.
+ */
+#ifndef HW_POISON_H
+#error Must define HW_POISON_H to work around TARGET_* poisoning
+#endif
+
+#include "qemu/osdep.h"
+#include "fpu/softfloat.h"
+#include "target/i386/x87-hostfp.h"
+
+#define SEED 0xdeadfacedeadface
+
+static const char * const op_names[] = {
+    [X87_HOSTFP_ADD] = "add",
+    [X87_HOSTFP_SUB] = "sub",
+    [X87_HOSTFP_MUL] = "mul",
+    [X87_HOSTFP_DIV] = "div",
+};
+
+static uint64_t n_iter = 1000000;
+static uint64_t rnd_state = SEED;
+
+static uint64_t xorshift64star(void)
+{
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return rnd_state * UINT64_C(2685821657736338717);
+}
+
+/* Pick an unbiased exponent, favouring the ends of the host range */
+static int random_exp(int emin, int emax)
+{
+    uint64_t r = xorshift64star();
+    int span = emax - emin + 1;
+
+    switch (r & 3) {
+    case 0:
+        return emin + (int)((r >> 8) % 8) - 2;
+    case 1:
+        return emax - (int)((r >> 8) % 8) + 2;
+    default:
+        return emin + (int)((r >> 8) % span);
+    }
+}
+
+static floatx80 random_operand(int prec)
+{
+    uint64_t r = xorshift64star();
+    uint64_t mant = xorshift64star() | (1ULL << 63);
+    uint16_t sign = (r & 1) << 15;
+    int exp;
+
+    switch ((r >> 1) & 7) {
+    case 0:
+        return make_floatx80(sign, 0);
+    case 1:
+        /* anything goes, mostly not representable */
+        return make_floatx80(sign | ((r >> 8) & 0x7fff), mant);
+    default:
+        break;
+    }
+
+    if (prec == 64) {
+        exp = random_exp(-1022, 1023);
+        mant &= ~0x7ffULL;
+    } else {
+        exp = random_exp(-126, 127);
+        mant &= ~((1ULL << 40) - 1);
+    }
+    /* a few low mantissa bits keep products and quotients exact */
+    if ((r >> 4) & 1) {
+        mant &= prec == 64 ? ~((1ULL << 50) - 1) : ~((1ULL << 58) - 1);
+        mant |= 1ULL << 63;
+    }
+    return make_floatx80(sign | (exp + X87_HOSTFP_EXP_BIAS), mant);
+}
+
+/* Derive a second operand close to @a to exercise cancellation */
+static floatx80 related_operand(floatx80 a, int prec)
+{
+    uint64_t r = xorshift64star();
+    uint64_t ulp = prec == 64 ? 1ULL << 11 : 1ULL << 40;
+
+    switch (r & 3) {
+    case 0:
+        return a;
+    case 1:
+        return floatx80_chs(a);
+    case 2:
+        a.low += ulp * ((r >> 8) & 15);
+        a.low |= 1ULL << 63;
+        return a;
+    default:
+        a.high += (int)((r >> 8) % 5) - 2;
+        return a;
+    }
+}
+
+static floatx80 softfloat_op(X87HostFPOp op, floatx80 a, floatx80 b,
+                             float_status *s)
+{
+    switch (op) {
+    case X87_HOSTFP_ADD:
+        return floatx80_add(a, b, s);
+    case X87_HOSTFP_SUB:
+        return floatx80_sub(a, b, s);
+    case X87_HOSTFP_MUL:
+        return floatx80_mul(a, b, s);
+    case X87_HOSTFP_DIV:
+        return floatx80_div(a, b, s);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static bool run_test(X87HostFPOp op, int prec)
+{
+    float_status s = { 0 };
+    uint64_t hits = 0;
+    uint64_t i;
+
+    set_float_rounding_mode(float_round_nearest_even, &s);
+    set_floatx80_rounding_precision(prec, &s);
+
+    for (i = 0; i < n_iter; i++) {
+        floatx80 a = random_operand(prec);
+        floatx80 b = (i & 1) ? related_operand(a, prec)
+                             : random_operand(prec);
+        floatx80 host, soft;
+
+        if (!x87_hostfp_op(op, prec, a, b, &host)) {
+            continue;
+        }
+        hits++;
+        soft = softfloat_op(op, a, b, &s);
+        if (host.high != soft.high || host.low != soft.low) {
+            fprintf(stderr, "%s/%d: %04x:%016" PRIx64 " %04x:%016" PRIx64
+                    " -> host %04x:%016" PRIx64 " soft %04x:%016" PRIx64 "\n",
+                    op_names[op], prec, a.high, a.low, b.high, b.low,
+                    host.high, host.low, soft.high, soft.low);
+            return false;
+        }
+    }
+    printf("%s/%d: %" PRIu64 " of %" PRIu64 " on the fast path\n",
+           op_names[op], prec, hits, n_iter);
+    /* The fast path must actually be taken for the test to mean anything */
+    return hits > 0;
+}
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -n = number of random operand pairs per test. "
+            "Default: %" PRIu64 "\n", n_iter);
+    fprintf(stderr, " -s = random seed. Default: 0x%" PRIx64 "\n",
+            (uint64_t)SEED);
+    fprintf(stderr, " -h = show this help message.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const int precs[] = { 32, 64 };
+    bool ok = true;
+    int op, i;
+
+    for (;;) {
+        int c = getopt(argc, argv, "hn:s:");
+
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argc, argv);
+            exit(EXIT_SUCCESS);
+        case 'n':
+            n_iter = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            rnd_state = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage_complete(argc, argv);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (rnd_state == 0) {
+        rnd_state = SEED;
+    }
+
+    if (!X87_HOSTFP_SUPPORTED) {
+        printf("host FPU fast path not supported on this host, skipping\n");
+        return 0;
+    }
+
+    for (op = X87_HOSTFP_ADD; op <= X87_HOSTFP_DIV; op++) {
+        for (i = 0; i < ARRAY_SIZE(precs); i++) {
+            ok &= run_test(op, precs[i]);
+        }
+    }
+    return ok ? 0 : 1;
+}
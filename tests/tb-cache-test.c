@@ -0,0 +1,108 @@
+/*
+ * QTest testcase for the persistent translated code cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+/* How long to wait for the guest to translate its first blocks */
+#define TB_CACHE_TEST_TIMEOUT_US (10 * G_USEC_PER_SEC)
+
+static unsigned long info_jit_value(QTestState *qts, const char *name)
+{
+    char *info = qtest_hmp(qts, "info jit");
+    char *line = strstr(info, name);
+    unsigned long val;
+
+    g_assert(line);
+    val = strtoul(line + strlen(name), NULL, 10);
+    g_free(info);
+    return val;
+}
+
+/* Run the firmware until it has translated something, then quit */
+static void run_guest(const char *path, bool singlestep,
+                      unsigned long *hits)
+{
+    QTestState *qts;
+    gint64 deadline = g_get_monotonic_time() + TB_CACHE_TEST_TIMEOUT_US;
+
+    qts = qtest_initf("-M pc -accel tcg,tb-cache=%s%s", path,
+                      singlestep ? " -singlestep" : "");
+    while (info_jit_value(qts, "TB count") < 100) {
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        g_usleep(10 * 1000);
+    }
+    *hits = info_jit_value(qts, "TB cache hits");
+    qtest_quit(qts);
+}
+
+/* Code translated while single-stepping must not be written to the cache */
+static void test_singlestep_not_saved(void)
+{
+    char *dir = g_dir_make_tmp("tb-cache-test-XXXXXX", NULL);
+    char *path = g_build_filename(dir, "cache", NULL);
+    unsigned long hits;
+
+    g_assert(dir);
+    run_guest(path, true, &hits);
+    g_assert_cmpuint(hits, ==, 0);
+    g_assert_false(g_file_test(path, G_FILE_TEST_EXISTS));
+
+    /* The same run without single-stepping does fill the cache */
+    run_guest(path, false, &hits);
+    g_assert_true(g_file_test(path, G_FILE_TEST_EXISTS));
+
+    unlink(path);
+    rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+/* A cache written normally must not be used while single-stepping */
+static void test_singlestep_not_reused(void)
+{
+    char *dir = g_dir_make_tmp("tb-cache-test-XXXXXX", NULL);
+    char *path = g_build_filename(dir, "cache", NULL);
+    gchar *before, *after;
+    gsize before_len, after_len;
+    unsigned long hits;
+
+    g_assert(dir);
+    run_guest(path, false, &hits);
+    g_assert_true(g_file_get_contents(path, &before, &before_len, NULL));
+
+    run_guest(path, true, &hits);
+    g_assert_cmpuint(hits, ==, 0);
+    g_assert_true(g_file_get_contents(path, &after, &after_len, NULL));
+    g_assert_cmpuint(before_len, ==, after_len);
+    g_assert(!memcmp(before, after, before_len));
+
+    /* Without single-stepping, the cache is picked up again */
+    run_guest(path, false, &hits);
+    g_assert_cmpuint(hits, >, 0);
+
+    g_free(before);
+    g_free(after);
+    unlink(path);
+    rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+    /* Hosts the cache is implemented for */
+    qtest_add_func("tb-cache/singlestep/not-saved", test_singlestep_not_saved);
+    qtest_add_func("tb-cache/singlestep/not-reused",
+                   test_singlestep_not_reused);
+#endif
+
+    return g_test_run();
+}
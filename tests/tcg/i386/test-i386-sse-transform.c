@@ -0,0 +1,114 @@
+/*
+ * SSE packed single microbenchmark
+ *
+ * Transforms a vertex buffer by a 4x4 matrix the way D3DXVec4Transform and
+ * friends do it on a Pentium III: broadcast each vertex component with
+ * shufps, multiply by a matrix row with mulps and accumulate with addps.
+ * The inputs are small integers so that the result is exact and can be
+ * checked against plain C arithmetic.
+ *
+ * Usage: test-i386-sse-transform [iterations]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_VERTICES 1024
+
+typedef struct {
+    float v[4];
+} __attribute__((aligned(16))) vec4;
+
+static vec4 matrix[4];
+static vec4 in[NUM_VERTICES];
+static vec4 out[NUM_VERTICES];
+
+static void transform_sse(vec4 *dst, const vec4 *src, const vec4 *m, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        asm volatile("movaps (%1), %%xmm0\n\t"
+                     "movaps %%xmm0, %%xmm1\n\t"
+                     "movaps %%xmm0, %%xmm2\n\t"
+                     "movaps %%xmm0, %%xmm3\n\t"
+                     "shufps $0x00, %%xmm0, %%xmm0\n\t"
+                     "shufps $0x55, %%xmm1, %%xmm1\n\t"
+                     "shufps $0xaa, %%xmm2, %%xmm2\n\t"
+                     "shufps $0xff, %%xmm3, %%xmm3\n\t"
+                     "mulps 0(%2), %%xmm0\n\t"
+                     "mulps 16(%2), %%xmm1\n\t"
+                     "mulps 32(%2), %%xmm2\n\t"
+                     "mulps 48(%2), %%xmm3\n\t"
+                     "addps %%xmm1, %%xmm0\n\t"
+                     "addps %%xmm3, %%xmm2\n\t"
+                     "addps %%xmm2, %%xmm0\n\t"
+                     "movaps %%xmm0, (%0)\n\t"
+                     :
+                     : "r"(&dst[i]), "r"(&src[i]), "r"(m)
+                     : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+    }
+}
+
+static int check(void)
+{
+    int i, j;
+
+    for (i = 0; i < NUM_VERTICES; i++) {
+        for (j = 0; j < 4; j++) {
+            float expected = in[i].v[0] * matrix[0].v[j] +
+                             in[i].v[1] * matrix[1].v[j] +
+                             in[i].v[2] * matrix[2].v[j] +
+                             in[i].v[3] * matrix[3].v[j];
+
+            if (out[i].v[j] != expected) {
+                printf("vertex %d lane %d: got %f expected %f\n",
+                       i, j, out[i].v[j], expected);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec start, end;
+    long iterations = argc > 1 ? atol(argv[1]) : 100;
+    long it;
+    double ns;
+    int i, j;
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++) {
+            matrix[i].v[j] = (float)((i * 4 + j) % 7 - 3);
+        }
+    }
+    for (i = 0; i < NUM_VERTICES; i++) {
+        for (j = 0; j < 4; j++) {
+            in[i].v[j] = (float)((i * 13 + j * 5) % 64 - 32);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (it = 0; it < iterations; it++) {
+        transform_sse(out, in, matrix, NUM_VERTICES);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (check()) {
+        return 1;
+    }
+
+    ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    fprintf(stderr, "%ld x %d vertices: %.2f ns/vertex\n",
+            iterations, NUM_VERTICES,
+            iterations ? ns / ((double)iterations * NUM_VERTICES) : 0.0);
+    printf("PASS\n");
+    return 0;
+}
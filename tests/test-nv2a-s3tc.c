@@ -0,0 +1,125 @@
+/*
+ * Test the NV2A DXT mip level layout
+ *
+ * texture_upload_plan() hands GL the level sizes and offsets s3tc_layout()
+ * computes. Check them against mip chains laid out by hand the way D3D
+ * does on the Xbox: every level takes whole 4x4 blocks, so levels smaller
+ * than a block still take a full one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "hw/xbox/nv2a/s3tc.h"
+
+#define MAX_LEVELS 9
+
+typedef enum DXTFormat {
+    DXT1,
+    DXT3,
+    DXT5,
+} DXTFormat;
+
+typedef struct LayoutTest {
+    DXTFormat format;
+    unsigned int width, height, num_levels;
+    size_t length;
+    S3TCLevel levels[MAX_LEVELS];
+} LayoutTest;
+
+static void test_layout(const void *opaque)
+{
+    const LayoutTest *t = opaque;
+    unsigned int block_size = t->format == DXT1 ? 8 : 16;
+    S3TCLevel levels[MAX_LEVELS];
+    unsigned int i;
+
+    g_assert_cmpuint(t->num_levels, <=, MAX_LEVELS);
+
+    g_assert_cmpuint(s3tc_layout(t->width, t->height, t->num_levels,
+                                 block_size, levels), ==, t->length);
+    g_assert_cmpuint(s3tc_layout(t->width, t->height, t->num_levels,
+                                 block_size, NULL), ==, t->length);
+
+    for (i = 0; i < t->num_levels; i++) {
+        g_assert_cmpuint(levels[i].width, ==, t->levels[i].width);
+        g_assert_cmpuint(levels[i].height, ==, t->levels[i].height);
+        g_assert_cmpuint(levels[i].offset, ==, t->levels[i].offset);
+        g_assert_cmpuint(levels[i].size, ==, t->levels[i].size);
+    }
+}
+
+/* { width, height, offset, size } of each level */
+static const LayoutTest layout_tests[] = {
+    /* Tail levels 16x2, 8x1, 4x1, 2x1 and 1x1 used to be dropped */
+    { DXT1, 64, 8, 7, 392, {
+        { 64, 8,   0, 256 },
+        { 32, 4, 256,  64 },
+        { 16, 2, 320,  32 },
+        {  8, 1, 352,  16 },
+        {  4, 1, 368,   8 },
+        {  2, 1, 376,   8 },
+        {  1, 1, 384,   8 },
+    } },
+    { DXT3, 16, 16, 5, 368, {
+        { 16, 16,   0, 256 },
+        {  8,  8, 256,  64 },
+        {  4,  4, 320,  16 },
+        {  2,  2, 336,  16 },
+        {  1,  1, 352,  16 },
+    } },
+    { DXT5, 8, 32, 6, 400, {
+        { 8, 32,   0, 256 },
+        { 4, 16, 256,  64 },
+        { 2,  8, 320,  32 },
+        { 1,  4, 352,  16 },
+        { 1,  2, 368,  16 },
+        { 1,  1, 384,  16 },
+    } },
+    { DXT5, 256, 4, 9, 2064, {
+        { 256, 4,    0, 1024 },
+        { 128, 2, 1024,  512 },
+        {  64, 1, 1536,  256 },
+        {  32, 1, 1792,  128 },
+        {  16, 1, 1920,   64 },
+        {   8, 1, 1984,   32 },
+        {   4, 1, 2016,   16 },
+        {   2, 1, 2032,   16 },
+        {   1, 1, 2048,   16 },
+    } },
+    /* Base levels smaller than a block */
+    { DXT1, 2, 2, 2, 16, {
+        { 2, 2, 0, 8 },
+        { 1, 1, 8, 8 },
+    } },
+    { DXT3, 1, 8, 4, 80, {
+        { 1, 8,  0, 32 },
+        { 1, 4, 32, 16 },
+        { 1, 2, 48, 16 },
+        { 1, 1, 64, 16 },
+    } },
+    { DXT5, 1, 1, 1, 16, {
+        { 1, 1, 0, 16 },
+    } },
+};
+
+int main(int argc, char **argv)
+{
+    static const char * const format_names[] = { "dxt1", "dxt3", "dxt5" };
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(layout_tests); i++) {
+        const LayoutTest *t = &layout_tests[i];
+        char *path = g_strdup_printf("/nv2a/s3tc/layout/%s-%ux%u-%u",
+                                     format_names[t->format],
+                                     t->width, t->height, t->num_levels);
+        g_test_add_data_func(path, t, test_layout);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
@@ -347,12 +347,15 @@ static EGLDisplay qemu_egl_get_display(EGLNativeDisplayType native,
     return dpy;
 }
 
-static int qemu_egl_init_dpy(EGLNativeDisplayType dpy,
+static int qemu_egl_open_dpy(EGLNativeDisplayType dpy,
                              EGLenum platform,
-                             DisplayGLMode mode)
+                             EGLint surface_type,
+                             DisplayGLMode mode,
+                             EGLDisplay *display,
+                             EGLConfig *config)
 {
-    static const EGLint conf_att_core[] = {
-        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+    const EGLint conf_att_core[] = {
+        EGL_SURFACE_TYPE, surface_type,
         EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
         EGL_RED_SIZE,   5,
         EGL_GREEN_SIZE, 5,
@@ -360,8 +363,8 @@ static int qemu_egl_init_dpy(EGLNativeDisplayType dpy,
         EGL_ALPHA_SIZE, 0,
         EGL_NONE,
     };
-    static const EGLint conf_att_gles[] = {
-        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+    const EGLint conf_att_gles[] = {
+        EGL_SURFACE_TYPE, surface_type,
         EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
         EGL_RED_SIZE,   5,
         EGL_GREEN_SIZE, 5,
@@ -374,13 +377,13 @@ static int qemu_egl_init_dpy(EGLNativeDisplayType dpy,
     EGLint n;
     bool gles = (mode == DISPLAYGL_MODE_ES);
 
-    qemu_egl_display = qemu_egl_get_display(dpy, platform);
-    if (qemu_egl_display == EGL_NO_DISPLAY) {
+    *display = qemu_egl_get_display(dpy, platform);
+    if (*display == EGL_NO_DISPLAY) {
         error_report("egl: eglGetDisplay failed");
         return -1;
     }
 
-    b = eglInitialize(qemu_egl_display, &major, &minor);
+    b = eglInitialize(*display, &major, &minor);
     if (b == EGL_FALSE) {
         error_report("egl: eglInitialize failed");
         return -1;
@@ -393,16 +396,34 @@ static int qemu_egl_init_dpy(EGLNativeDisplayType dpy,
         return -1;
     }
 
-    b = eglChooseConfig(qemu_egl_display,
+    b = eglChooseConfig(*display,
                         gles ? conf_att_gles : conf_att_core,
-                        &qemu_egl_config, 1, &n);
+                        config, 1, &n);
     if (b == EGL_FALSE || n != 1) {
         error_report("egl: eglChooseConfig failed (%s mode)",
                      gles ? "gles" : "core");
         return -1;
     }
 
-    qemu_egl_mode = gles ? DISPLAYGL_MODE_ES : DISPLAYGL_MODE_CORE;
+    return 0;
+}
+
+static int qemu_egl_init_dpy(EGLNativeDisplayType dpy,
+                             EGLenum platform,
+                             DisplayGLMode mode)
+{
+    EGLDisplay display;
+    EGLConfig config;
+
+    if (qemu_egl_open_dpy(dpy, platform, EGL_WINDOW_BIT, mode,
+                          &display, &config) < 0) {
+        return -1;
+    }
+
+    qemu_egl_display = display;
+    qemu_egl_config = config;
+    qemu_egl_mode = (mode == DISPLAYGL_MODE_ES) ? DISPLAYGL_MODE_ES
+                                                : DISPLAYGL_MODE_CORE;
     return 0;
 }
 
@@ -424,6 +445,41 @@ int qemu_egl_init_dpy_mesa(EGLNativeDisplayType dpy, DisplayGLMode mode)
 #endif
 }
 
+/*
+ * The qemu_egl_open_dpy_* variants hand the display and config back to the
+ * caller instead of setting qemu_egl_display and qemu_egl_config, for users
+ * that render offscreen next to whatever display the UI has set up.
+ */
+int qemu_egl_open_dpy_mesa(EGLNativeDisplayType dpy, DisplayGLMode mode,
+                           EGLDisplay *display, EGLConfig *config)
+{
+#ifdef EGL_MESA_platform_gbm
+    return qemu_egl_open_dpy(dpy, EGL_PLATFORM_GBM_MESA, EGL_WINDOW_BIT, mode,
+                             display, config);
+#else
+    return qemu_egl_open_dpy(dpy, 0, EGL_WINDOW_BIT, mode, display, config);
+#endif
+}
+
+/* Surfaceless displays only have pbuffer configs, and need no native
+ * display: Mesa picks a render node, or renders in software. */
+int qemu_egl_open_dpy_surfaceless(DisplayGLMode mode,
+                                  EGLDisplay *display, EGLConfig *config)
+{
+#ifdef EGL_MESA_platform_surfaceless
+    if (!epoxy_has_egl_extension(NULL, "EGL_MESA_platform_surfaceless")) {
+        error_report("egl: EGL_MESA_platform_surfaceless not supported");
+        return -1;
+    }
+    return qemu_egl_open_dpy(EGL_DEFAULT_DISPLAY,
+                             EGL_PLATFORM_SURFACELESS_MESA,
+                             EGL_PBUFFER_BIT, mode, display, config);
+#else
+    error_report("egl: built without EGL_MESA_platform_surfaceless");
+    return -1;
+#endif
+}
+
 EGLContext qemu_egl_init_ctx(void)
 {
     static const EGLint ctx_att_core[] = {
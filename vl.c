@@ -305,6 +305,14 @@ static QemuOptsList qemu_accel_opts = {
             .name = "thread",
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
+        }, {
+            .name = "tb-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "File to keep translated code in across runs",
+        }, {
+            .name = "tier-threshold",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Executions after which a block is retranslated as a trace",
         },
         { /* end of list */ }
     },